@@ -6,10 +6,17 @@ uniform mat4 osg_ModelViewMatrix;
 uniform mat4 diffuseTexMtx;
 uniform mat4 blendTexMtx;
 
+// Converts terrain space (x, y across, z up) to the world's alignment
+uniform mat3 terrainAlign;
+// Eye distance at which to start blending toward the coarser LOD, and one over
+// the distance the blend takes. Zero when not morphing.
+uniform vec2 morphRange;
+
 in vec4 osg_Vertex;
 in vec3 osg_Normal;
 in vec4 osg_Color;
 in vec4 osg_MultiTexCoord0;
+in float morphHeight;
 
 out vec3 pos_viewspace;
 out vec3 n_viewspace;
@@ -20,12 +27,17 @@ out vec4 Color;
 
 void main()
 {
-    gl_Position = osg_ModelViewProjectionMatrix * osg_Vertex;
+    // Move toward the coarser LOD's surface before switching to it, so the switch doesn't pop
+    float morph = clamp((length((osg_ModelViewMatrix * osg_Vertex).xyz) - morphRange.x) * morphRange.y, 0.0, 1.0);
+    vec3 up = terrainAlign[2];
+    vec4 vertex = vec4(osg_Vertex.xyz + up * ((morphHeight - dot(osg_Vertex.xyz, up)) * morph), 1.0);
+
+    gl_Position = osg_ModelViewProjectionMatrix * vertex;
     TexCoords.xy = (diffuseTexMtx * osg_MultiTexCoord0).xy;
     TexCoords.zw = (blendTexMtx * osg_MultiTexCoord0).xy;
     Color = osg_Color;
 
-    pos_viewspace = (osg_ModelViewMatrix * osg_Vertex).xyz;
+    pos_viewspace = (osg_ModelViewMatrix * vertex).xyz;
 
     vec3 binormal = cross(osg_Normal, vec3(1.0, 0.0, 0.0));
     n_viewspace   = normalize(mat3(osg_ModelViewMatrix) * osg_Normal);
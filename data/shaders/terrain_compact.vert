@@ -0,0 +1,59 @@
+#version 130
+
+uniform mat4 osg_ModelViewProjectionMatrix;
+uniform mat4 osg_ModelViewMatrix;
+
+uniform mat4 diffuseTexMtx;
+uniform mat4 blendTexMtx;
+
+// World size of the chunk along each axis
+uniform float chunkSize;
+// Converts terrain space (x, y across, z up) to the world's alignment
+uniform mat3 terrainAlign;
+// Eye distance at which to start blending toward the coarser LOD, and one over
+// the distance the blend takes. Zero when not morphing.
+uniform vec2 morphRange;
+
+in float height;
+in vec2 packedNormal;
+in float morphHeight;
+in vec4 osg_MultiTexCoord0;
+
+out vec3 pos_viewspace;
+out vec3 n_viewspace;
+out vec3 t_viewspace;
+out vec3 b_viewspace;
+out vec4 TexCoords;
+out vec4 Color;
+
+vec3 decodeOctahedral(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if(n.z < 0.0)
+        n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    return normalize(n);
+}
+
+void main()
+{
+    // The vertex grid is regular, so the position across the chunk follows from the UV
+    vec3 local = vec3((osg_MultiTexCoord0.xy - 0.5) * chunkSize, height);
+
+    // Move toward the coarser LOD's surface before switching to it, so the switch doesn't pop
+    float morph = clamp((length((osg_ModelViewMatrix * vec4(terrainAlign * local, 1.0)).xyz) - morphRange.x) * morphRange.y, 0.0, 1.0);
+    local.z = mix(height, morphHeight, morph);
+    vec4 vertex = vec4(terrainAlign * local, 1.0);
+    vec3 normal = terrainAlign * decodeOctahedral(packedNormal);
+
+    gl_Position = osg_ModelViewProjectionMatrix * vertex;
+    TexCoords.xy = (diffuseTexMtx * osg_MultiTexCoord0).xy;
+    TexCoords.zw = (blendTexMtx * osg_MultiTexCoord0).xy;
+    Color = vec4(1.0);
+
+    pos_viewspace = (osg_ModelViewMatrix * vertex).xyz;
+
+    vec3 binormal = cross(normal, vec3(1.0, 0.0, 0.0));
+    n_viewspace   = normalize(mat3(osg_ModelViewMatrix) * normal);
+    t_viewspace   = normalize(mat3(osg_ModelViewMatrix) * cross(normal, binormal));
+    b_viewspace   = normalize(mat3(osg_ModelViewMatrix) * binormal);
+}
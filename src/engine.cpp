@@ -17,6 +17,7 @@
 #include <osgDB/ReadFile>
 #include <osg/MatrixTransform>
 #include <osg/PolygonMode>
+#include <osg/Polytope>
 
 #include "archives/physfs.hpp"
 #include "input/input.hpp"
@@ -96,7 +97,7 @@ Engine::~Engine(void)
     mSceneRoot = nullptr;
     mCamera = nullptr;
 
-    Log::get().setGuiIface(nullptr);
+    Log::get().setConsole(nullptr);
 
     delete mGui;
     mGui = nullptr;
@@ -415,7 +416,10 @@ bool Engine::go(void)
     Log::get().message("Initializing GUI...");
     mGui = new Gui(viewer.get(), viewer->getSceneData()->asGroup());
 
-    Log::get().setGuiIface(mGui);
+    {
+        Gui *gui = mGui;
+        Log::get().setConsole([gui](const std::string &str) { gui->printToConsole(str); });
+    }
     {
         ref_ptr<CommandDelegateT> deleg = makeDelegate(this, &Engine::internalCommand);
         for(const auto &cmd : mCommandFuncs)
@@ -476,7 +480,10 @@ bool Engine::go(void)
             mCamera->setViewMatrix(matf);
         }
 
-        World::get().update(mCameraPos);
+        osg::Polytope frustum;
+        frustum.setToUnitFrustum();
+        frustum.transformProvidingInverse(mCamera->getViewMatrix() * Pipeline::get().getProjectionMatrix());
+        World::get().update(mCameraPos, frustum);
 
         last_fps_time += tick_count;
         if(last_fps_time >= Timer::TicksPerSecond())
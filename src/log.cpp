@@ -6,8 +6,6 @@
 #include <chrono>
 #include <ctime>
 
-#include "gui/iface.hpp"
-
 namespace TK
 {
 
@@ -16,7 +14,7 @@ Log *Singleton<Log>::sInstance = nullptr;
 
 
 Log::Log(Level level, const std::string &name)
-  : mLevel(level), mGui(nullptr)
+  : mLevel(level)
 {
     if(!name.empty())
         setLog(name);
@@ -49,13 +47,13 @@ void Log::setLog(const std::string &name)
     mOutfile<< getTimestamp()<<"--- Starting log ---" <<std::endl;
 }
 
-void Log::setGuiIface(GuiIface *iface)
+void Log::setConsole(const ConsoleFunc &console)
 {
-    mGui = iface;
-    if(mGui)
+    mConsole = console;
+    if(mConsole)
     {
         for(const auto &str : mBuffer)
-            mGui->printToConsole(str);
+            mConsole(str);
         std::vector<std::string>().swap(mBuffer);
     }
 }
@@ -73,8 +71,8 @@ void Log::message(const std::string &msg, Level level)
     }
     out<< msg <<std::endl;
 
-    if(mGui)
-        mGui->printToConsole(msg);
+    if(mConsole)
+        mConsole(msg);
     else
         mBuffer.push_back(msg);
 }
@@ -2,6 +2,7 @@
 #define LOG_HPP
 
 #include <fstream>
+#include <functional>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -12,8 +13,6 @@
 namespace TK
 {
 
-class GuiIface;
-
 class LogStream;
 
 class Log : public Singleton<Log> {
@@ -24,9 +23,12 @@ public:
         Level_Error,
     };
 
+    // Where messages are shown in-game, kept as a function so the log doesn't depend on the GUI
+    typedef std::function<void(const std::string&)> ConsoleFunc;
+
 private:
     Level mLevel;
-    GuiIface *mGui;
+    ConsoleFunc mConsole;
     std::vector<std::string> mBuffer;
     std::ofstream mOutfile;
 
@@ -40,7 +42,8 @@ public:
     void setLevel(Level level) { mLevel = level; }
     Level getLevel() const { return mLevel; }
 
-    void setGuiIface(GuiIface *iface);
+    // Messages logged before a console is set are passed on to it then
+    void setConsole(const ConsoleFunc &console);
 
     LogStream stream(Level level=Level_Normal);
     void message(const std::string &msg, Level level=Level_Normal);
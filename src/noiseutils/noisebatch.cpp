@@ -0,0 +1,379 @@
+// noisebatch.cpp
+//
+// Batched evaluation of libnoise module graphs.
+//
+
+#include <cmath>
+#include <typeinfo>
+#include <vector>
+
+#include <libnoise/interp.h>
+
+#include "noisebatch.h"
+#include "noisebatch_internal.h"
+
+namespace noise {
+namespace utils {
+
+namespace {
+
+// Hash used by noise::GradientNoise3D() to pick a gradient vector.
+int GradientIndex (int ix, int iy, int iz, int seed)
+{
+  int vectorIndex = (int)(1619u * (unsigned int)ix + 31337u * (unsigned int)iy
+    + 6971u * (unsigned int)iz + 1013u * (unsigned int)seed);
+  vectorIndex ^= (vectorIndex >> 8);
+  return vectorIndex & 0xff;
+}
+
+// Recovers a gradient component g from libnoise's (g * 2.12).
+double RecoverComponent (double probe)
+{
+  double g = probe / 2.12;
+  if (g * 2.12 == probe) {
+    return g;
+  }
+  double lower = nextafter (g, -HUGE_VAL);
+  if (lower * 2.12 == probe) {
+    return lower;
+  }
+  double upper = nextafter (g, HUGE_VAL);
+  if (upper * 2.12 == probe) {
+    return upper;
+  }
+  return g;
+}
+
+// Gradient noise at a lattice point computed from the recovered table, using
+// the same expression as noise::GradientNoise3D().
+double TableGradientNoise (const BatchGradients& gradients, double fx,
+  double fy, double fz, int ix, int iy, int iz, int seed)
+{
+  int index = GradientIndex (ix, iy, iz, seed);
+  double xvPoint = (fx - (double)ix);
+  double yvPoint = (fy - (double)iy);
+  double zvPoint = (fz - (double)iz);
+  return ((gradients.x[index] * xvPoint)
+        + (gradients.y[index] * yvPoint)
+        + (gradients.z[index] * zvPoint)) * 2.12;
+}
+
+// libnoise keeps its gradient table private, so rebuild it by evaluating
+// gradient noise one unit along each axis from lattice points that hash to
+// each table entry.
+bool RecoverGradients (BatchGradients& gradients)
+{
+  bool found[256] = { false };
+  int numFound = 0;
+  for (int seed = 0; seed < (1 << 20) && numFound < 256; seed++) {
+    int index = GradientIndex (0, 0, 0, seed);
+    if (found[index]) {
+      continue;
+    }
+    gradients.x[index] = RecoverComponent (
+      noise::GradientNoise3D (1.0, 0.0, 0.0, 0, 0, 0, seed));
+    gradients.y[index] = RecoverComponent (
+      noise::GradientNoise3D (0.0, 1.0, 0.0, 0, 0, 0, seed));
+    gradients.z[index] = RecoverComponent (
+      noise::GradientNoise3D (0.0, 0.0, 1.0, 0, 0, 0, seed));
+    found[index] = true;
+    numFound++;
+  }
+  if (numFound < 256) {
+    return false;
+  }
+
+  // Check the copy against libnoise at arbitrary points, in case its hash
+  // ever changes.  The per-lookup error has to stay well below the overall
+  // tolerance since it accumulates over octaves.
+  unsigned int state = 12345u;
+  for (int i = 0; i < 4096; i++) {
+    int coords[4];
+    for (int j = 0; j < 4; j++) {
+      state = state * 1664525u + 1013904223u;
+      coords[j] = (int)(state >> 8) - (1 << 23);
+    }
+    state = state * 1664525u + 1013904223u;
+    double offset = (double)(state >> 8) / (double)(1 << 24);
+    double fx = coords[0] + offset;
+    double fy = coords[1] + 1.0 - offset;
+    double fz = coords[2] + offset * 0.5;
+    double expected = noise::GradientNoise3D (fx, fy, fz, coords[0],
+      coords[1], coords[2], coords[3]);
+    double actual = TableGradientNoise (gradients, fx, fy, fz, coords[0],
+      coords[1], coords[2], coords[3]);
+    if (fabs (expected - actual) > BATCH_TOLERANCE * 1.0e-3) {
+      return false;
+    }
+  }
+  return true;
+}
+
+BatchKernel DetectKernel ()
+{
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+  __builtin_cpu_init ();
+#ifdef NOISEBATCH_AVX2
+  if (__builtin_cpu_supports ("avx2")) {
+    return BATCH_AVX2;
+  }
+#endif
+#ifdef NOISEBATCH_SSE41
+  if (__builtin_cpu_supports ("sse4.1")) {
+    return BATCH_SSE41;
+  }
+#endif
+#endif
+  return BATCH_SCALAR;
+}
+
+struct BatchState
+{
+  BatchGradients gradients;
+  // Best kernel usable on this machine.
+  BatchKernel supported;
+  // Kernel GetValues() currently uses.
+  BatchKernel current;
+
+  BatchState ()
+  {
+    supported = DetectKernel ();
+    if (supported != BATCH_SCALAR && !RecoverGradients (gradients)) {
+      supported = BATCH_SCALAR;
+    }
+    current = supported;
+  }
+};
+
+BatchState& GetBatchState ()
+{
+  static BatchState state;
+  return state;
+}
+
+#if defined(NOISEBATCH_AVX2) || defined(NOISEBATCH_SSE41)
+double MakeInt32RangeFunc (double n)
+{
+  return noise::MakeInt32Range (n);
+}
+#endif
+
+template <class T>
+void GetFractalValues (const T& fractalModule, bool billow, const double* x,
+  const double* y, const double* z, int count, double* out)
+{
+#if defined(NOISEBATCH_AVX2) || defined(NOISEBATCH_SSE41)
+  const BatchState& state = GetBatchState ();
+  if (state.current != BATCH_SCALAR) {
+    BatchFractalParams params;
+    params.frequency = fractalModule.GetFrequency ();
+    params.lacunarity = fractalModule.GetLacunarity ();
+    params.persistence = fractalModule.GetPersistence ();
+    params.octaveCount = fractalModule.GetOctaveCount ();
+    params.seed = fractalModule.GetSeed ();
+    params.quality = (int)fractalModule.GetNoiseQuality ();
+    params.billow = billow;
+    params.makeInt32Range = MakeInt32RangeFunc;
+#ifdef NOISEBATCH_AVX2
+    if (state.current == BATCH_AVX2) {
+      BatchFractalAVX2 (state.gradients, params, x, y, z, count, out);
+      return;
+    }
+#endif
+#ifdef NOISEBATCH_SSE41
+    if (state.current == BATCH_SSE41) {
+      BatchFractalSSE41 (state.gradients, params, x, y, z, count, out);
+      return;
+    }
+#endif
+  }
+#endif
+  for (int i = 0; i < count; i++) {
+    out[i] = fractalModule.GetValue (x[i], y[i], z[i]);
+  }
+}
+
+// Which source module(s) a Select module uses for a given control value.
+enum SelectRegion
+{
+  SELECT_SOURCE0,
+  SELECT_SOURCE1,
+  SELECT_LOWER_EDGE,
+  SELECT_UPPER_EDGE
+};
+
+// Evaluates a Select module, only generating each source module's values at
+// the points where they're actually needed.
+void GetSelectValues (const module::Select& selectModule, const double* x,
+  const double* y, const double* z, int count, double* out)
+{
+  std::vector<double> controlValues (count);
+  GetValues (selectModule.GetControlModule (), x, y, z, count,
+    &controlValues[0]);
+
+  double lowerBound = selectModule.GetLowerBound ();
+  double upperBound = selectModule.GetUpperBound ();
+  double edgeFalloff = selectModule.GetEdgeFalloff ();
+
+  // Classify each point the same way Select::GetValue() does.
+  std::vector<unsigned char> regions (count);
+  std::vector<int> indices[2];
+  for (int i = 0; i < count; i++) {
+    double controlValue = controlValues[i];
+    SelectRegion region;
+    if (edgeFalloff > 0.0) {
+      if (controlValue < (lowerBound - edgeFalloff)) {
+        region = SELECT_SOURCE0;
+      } else if (controlValue < (lowerBound + edgeFalloff)) {
+        region = SELECT_LOWER_EDGE;
+      } else if (controlValue < (upperBound - edgeFalloff)) {
+        region = SELECT_SOURCE1;
+      } else if (controlValue < (upperBound + edgeFalloff)) {
+        region = SELECT_UPPER_EDGE;
+      } else {
+        region = SELECT_SOURCE0;
+      }
+    } else {
+      if (controlValue < lowerBound || controlValue > upperBound) {
+        region = SELECT_SOURCE0;
+      } else {
+        region = SELECT_SOURCE1;
+      }
+    }
+    regions[i] = (unsigned char)region;
+    if (region != SELECT_SOURCE1) {
+      indices[0].push_back (i);
+    }
+    if (region != SELECT_SOURCE0) {
+      indices[1].push_back (i);
+    }
+  }
+
+  // Gather the points each source is needed for and evaluate them.
+  std::vector<double> sourceValues[2];
+  for (int s = 0; s < 2; s++) {
+    int sourceCount = (int)indices[s].size ();
+    if (sourceCount == 0) {
+      continue;
+    }
+    sourceValues[s].resize (sourceCount);
+    if (sourceCount == count) {
+      GetValues (selectModule.GetSourceModule (s), x, y, z, count,
+        &sourceValues[s][0]);
+      continue;
+    }
+    std::vector<double> xs (sourceCount), ys (sourceCount), zs (sourceCount);
+    for (int i = 0; i < sourceCount; i++) {
+      int index = indices[s][i];
+      xs[i] = x[index];
+      ys[i] = y[index];
+      zs[i] = z[index];
+    }
+    GetValues (selectModule.GetSourceModule (s), &xs[0], &ys[0], &zs[0],
+      sourceCount, &sourceValues[s][0]);
+  }
+
+  // Scatter the results back, blending at the edges.
+  int next[2] = { 0, 0 };
+  for (int i = 0; i < count; i++) {
+    double value0 = 0.0, value1 = 0.0;
+    if (regions[i] != SELECT_SOURCE1) {
+      value0 = sourceValues[0][next[0]++];
+    }
+    if (regions[i] != SELECT_SOURCE0) {
+      value1 = sourceValues[1][next[1]++];
+    }
+
+    switch (regions[i]) {
+      case SELECT_SOURCE0:
+        out[i] = value0;
+        break;
+      case SELECT_SOURCE1:
+        out[i] = value1;
+        break;
+      case SELECT_LOWER_EDGE: {
+        double lowerCurve = (lowerBound - edgeFalloff);
+        double upperCurve = (lowerBound + edgeFalloff);
+        double alpha = SCurve3 (
+          (controlValues[i] - lowerCurve) / (upperCurve - lowerCurve));
+        out[i] = LinearInterp (value0, value1, alpha);
+        break;
+      }
+      case SELECT_UPPER_EDGE: {
+        double lowerCurve = (upperBound - edgeFalloff);
+        double upperCurve = (upperBound + edgeFalloff);
+        double alpha = SCurve3 (
+          (controlValues[i] - lowerCurve) / (upperCurve - lowerCurve));
+        out[i] = LinearInterp (value1, value0, alpha);
+        break;
+      }
+    }
+  }
+}
+
+} // namespace
+
+void GetValues (const module::Module& sourceModule, const double* x,
+  const double* y, const double* z, int count, double* out)
+{
+  if (count <= 0) {
+    return;
+  }
+
+  // Exact type matches only; a subclass may have changed GetValue().
+  const std::type_info& type = typeid (sourceModule);
+  if (const BatchModule* batchModule
+    = dynamic_cast<const BatchModule*> (&sourceModule)) {
+    batchModule->GetValues (x, y, z, count, out);
+  } else if (type == typeid (module::Perlin)) {
+    GetFractalValues (static_cast<const module::Perlin&> (sourceModule),
+      false, x, y, z, count, out);
+  } else if (type == typeid (module::Billow)) {
+    GetFractalValues (static_cast<const module::Billow&> (sourceModule),
+      true, x, y, z, count, out);
+  } else if (type == typeid (module::ScaleBias)) {
+    const module::ScaleBias& scaleBias
+      = static_cast<const module::ScaleBias&> (sourceModule);
+    GetValues (scaleBias.GetSourceModule (0), x, y, z, count, out);
+    double scale = scaleBias.GetScale ();
+    double bias = scaleBias.GetBias ();
+    for (int i = 0; i < count; i++) {
+      out[i] = out[i] * scale + bias;
+    }
+  } else if (type == typeid (module::Add)) {
+    std::vector<double> values (count);
+    GetValues (sourceModule.GetSourceModule (0), x, y, z, count, out);
+    GetValues (sourceModule.GetSourceModule (1), x, y, z, count, &values[0]);
+    for (int i = 0; i < count; i++) {
+      out[i] = out[i] + values[i];
+    }
+  } else if (type == typeid (module::Select)) {
+    GetSelectValues (static_cast<const module::Select&> (sourceModule),
+      x, y, z, count, out);
+  } else if (type == typeid (module::Const)) {
+    double value = static_cast<const module::Const&> (
+      sourceModule).GetConstValue ();
+    for (int i = 0; i < count; i++) {
+      out[i] = value;
+    }
+  } else {
+    for (int i = 0; i < count; i++) {
+      out[i] = sourceModule.GetValue (x[i], y[i], z[i]);
+    }
+  }
+}
+
+BatchKernel GetBatchKernel ()
+{
+  return GetBatchState ().current;
+}
+
+BatchKernel SetBatchKernel (BatchKernel kernel)
+{
+  BatchState& state = GetBatchState ();
+  state.current = (kernel < state.supported) ? kernel : state.supported;
+  return state.current;
+}
+
+} // namespace utils
+} // namespace noise
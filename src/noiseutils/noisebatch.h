@@ -0,0 +1,104 @@
+// noisebatch.h
+//
+// Batched evaluation of libnoise module graphs.
+//
+
+#ifndef NOISEBATCH_H
+#define NOISEBATCH_H
+
+#include <libnoise/noise.h>
+
+namespace noise
+{
+
+  namespace utils
+  {
+
+    /// Maximum absolute difference between the values generated by
+    /// GetValues() and those generated by calling
+    /// noise::module::Module::GetValue() for each point.
+    ///
+    /// The vectorized gradient-noise kernels use a copy of libnoise's
+    /// gradient table that is recovered at startup (libnoise does not
+    /// export it).  Where a gradient component cannot be recovered
+    /// bit-exactly, results may differ in the last few bits.  The copy is
+    /// verified against libnoise before use, and the vectorized kernels are
+    /// disabled if it does not match within this tolerance.
+    const double BATCH_TOLERANCE = 1.0e-9;
+
+    /// Instruction sets the batch kernels may use.
+    enum BatchKernel
+    {
+      BATCH_SCALAR = 0,
+      BATCH_SSE41  = 1,
+      BATCH_AVX2   = 2
+    };
+
+    /// Interface for custom noise modules that can generate many output
+    /// values at once.
+    ///
+    /// Modules that are not part of libnoise can implement this alongside
+    /// noise::module::Module so GetValues() doesn't have to fall back to
+    /// calling GetValue() once per point.
+    class BatchModule
+    {
+
+      public:
+
+        virtual ~BatchModule ()
+        {
+        }
+
+        /// Generates output values for @a count input points.
+        ///
+        /// @param x Array of @a x coordinates.
+        /// @param y Array of @a y coordinates.
+        /// @param z Array of @a z coordinates.
+        /// @param count The number of points.
+        /// @param out Array receiving the output values.
+        virtual void GetValues (const double* x, const double* y,
+          const double* z, int count, double* out) const = 0;
+
+    };
+
+    /// Generates output values for @a count input points from a noise
+    /// module graph.
+    ///
+    /// @param sourceModule The noise module to evaluate.
+    /// @param x Array of @a x coordinates.
+    /// @param y Array of @a y coordinates.
+    /// @param z Array of @a z coordinates.
+    /// @param count The number of points.
+    /// @param out Array receiving the output values.
+    ///
+    /// Perlin, Billow, ScaleBias, Select, Add and Const modules are
+    /// evaluated a batch at a time, using SSE4.1 or AVX2 kernels for the
+    /// gradient noise when the CPU supports them.  Modules implementing
+    /// BatchModule are passed the whole batch.  Any other module is
+    /// evaluated one point at a time.
+    ///
+    /// The output values match noise::module::Module::GetValue() within
+    /// BATCH_TOLERANCE.
+    ///
+    /// This function is thread-safe as long as the modules themselves are.
+    void GetValues (const noise::module::Module& sourceModule,
+      const double* x, const double* y, const double* z, int count,
+      double* out);
+
+    /// Returns the instruction set currently used by GetValues().
+    BatchKernel GetBatchKernel ();
+
+    /// Selects the instruction set used by GetValues().
+    ///
+    /// @returns The instruction set actually selected, which may be less
+    /// capable than requested if the CPU or build doesn't support it.
+    ///
+    /// Mainly useful for testing and benchmarking.  Do not call this while
+    /// other threads are generating values.
+    BatchKernel SetBatchKernel (BatchKernel kernel);
+
+  }
+
+}
+
+#endif
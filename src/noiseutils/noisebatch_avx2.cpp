@@ -0,0 +1,94 @@
+// noisebatch_avx2.cpp
+//
+// AVX2 Perlin/Billow kernel.  Built with -mavx2; only called after a runtime
+// check for AVX2 support.
+//
+
+#include "noisebatch_internal.h"
+
+#if defined(NOISEBATCH_AVX2) && defined(__AVX2__)
+
+#include <immintrin.h>
+
+namespace
+{
+
+  // Four doubles per vector, with the matching four 32-bit integers in an
+  // SSE register.
+  struct AVX2Ops
+  {
+    typedef __m256d Real;
+    typedef __m128i Int;
+
+    static const int WIDTH = 4;
+
+    static inline Real Load (const double* p) { return _mm256_loadu_pd (p); }
+    static inline void Store (double* p, Real v) { _mm256_storeu_pd (p, v); }
+    static inline Real Set (double v) { return _mm256_set1_pd (v); }
+    static inline Real Add (Real a, Real b) { return _mm256_add_pd (a, b); }
+    static inline Real Sub (Real a, Real b) { return _mm256_sub_pd (a, b); }
+    static inline Real Mul (Real a, Real b) { return _mm256_mul_pd (a, b); }
+    static inline Real Abs (Real a)
+    {
+      return _mm256_andnot_pd (_mm256_set1_pd (-0.0), a);
+    }
+    static inline Real Trunc (Real a)
+    {
+      return _mm256_round_pd (a, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    }
+    static inline Real Greater (Real a, Real b)
+    {
+      return _mm256_cmp_pd (a, b, _CMP_GT_OQ);
+    }
+    static inline Real Select (Real mask, Real a, Real b)
+    {
+      return _mm256_blendv_pd (b, a, mask);
+    }
+    static inline Real OutOfRange (Real a, double limit)
+    {
+      return _mm256_or_pd (_mm256_cmp_pd (a, _mm256_set1_pd (limit), _CMP_GE_OQ),
+        _mm256_cmp_pd (a, _mm256_set1_pd (-limit), _CMP_LE_OQ));
+    }
+    static inline bool Any (Real mask)
+    {
+      return _mm256_movemask_pd (mask) != 0;
+    }
+
+    static inline Int ToInt (Real a) { return _mm256_cvttpd_epi32 (a); }
+    static inline Int SetInt (int v) { return _mm_set1_epi32 (v); }
+    static inline Int AddInt (Int a, Int b) { return _mm_add_epi32 (a, b); }
+    static inline Int MulInt (Int a, Int b) { return _mm_mullo_epi32 (a, b); }
+    static inline Int Xor (Int a, Int b) { return _mm_xor_si128 (a, b); }
+    static inline Int And (Int a, Int b) { return _mm_and_si128 (a, b); }
+    static inline Int ShiftRight8 (Int a) { return _mm_srai_epi32 (a, 8); }
+    static inline Real Gather (const double* table, Int index)
+    {
+      // The masked form avoids reading an undefined source register.
+      __m256d all = _mm256_castsi256_pd (_mm256_set1_epi64x (-1));
+      return _mm256_mask_i32gather_pd (_mm256_setzero_pd (), table, index,
+        all, 8);
+    }
+  };
+
+}
+
+#include "noisebatch_kernel.h"
+
+namespace noise
+{
+
+  namespace utils
+  {
+
+    void BatchFractalAVX2 (const BatchGradients& gradients,
+      const BatchFractalParams& params, const double* x, const double* y,
+      const double* z, int count, double* out)
+    {
+      BatchFractalKernel<AVX2Ops> (gradients, params, x, y, z, count, out);
+    }
+
+  }
+
+}
+
+#endif
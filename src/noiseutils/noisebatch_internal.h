@@ -0,0 +1,56 @@
+// noisebatch_internal.h
+//
+// Shared between the batch evaluator and its instruction-set specific
+// kernels.  Not part of the public interface.
+//
+
+#ifndef NOISEBATCH_INTERNAL_H
+#define NOISEBATCH_INTERNAL_H
+
+namespace noise
+{
+
+  namespace utils
+  {
+
+    /// Copy of libnoise's gradient vector table, split by component.
+    struct BatchGradients
+    {
+      double x[256];
+      double y[256];
+      double z[256];
+    };
+
+    /// Parameters of a Perlin or Billow module.
+    struct BatchFractalParams
+    {
+      double frequency;
+      double lacunarity;
+      double persistence;
+      int octaveCount;
+      int seed;
+      /// 0 = fast, 1 = standard, 2 = best (noise::NoiseQuality).
+      int quality;
+      /// Fold each octave as the Billow module does.
+      bool billow;
+      /// noise::MakeInt32Range(), used for the rare lanes that need it.
+      double (*makeInt32Range) (double);
+    };
+
+#ifdef NOISEBATCH_SSE41
+    void BatchFractalSSE41 (const BatchGradients& gradients,
+      const BatchFractalParams& params, const double* x, const double* y,
+      const double* z, int count, double* out);
+#endif
+
+#ifdef NOISEBATCH_AVX2
+    void BatchFractalAVX2 (const BatchGradients& gradients,
+      const BatchFractalParams& params, const double* x, const double* y,
+      const double* z, int count, double* out);
+#endif
+
+  }
+
+}
+
+#endif
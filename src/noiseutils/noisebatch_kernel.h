@@ -0,0 +1,218 @@
+// noisebatch_kernel.h
+//
+// Vectorized Perlin/Billow kernel shared by the instruction-set specific
+// translation units.  Each unit defines an operations struct for its vector
+// width and includes this file; everything here has internal linkage so the
+// differently-compiled copies can't be mixed up by the linker.
+//
+// The kernel performs exactly the same floating-point operations, in the
+// same order, as libnoise's GradientCoherentNoise3D() and the Perlin/Billow
+// modules, so the only source of difference is the recovered gradient
+// table.  Do not build these units with FMA contraction enabled.
+//
+
+#ifndef NOISEBATCH_KERNEL_H
+#define NOISEBATCH_KERNEL_H
+
+#include "noisebatch_internal.h"
+
+namespace
+{
+
+  // Constants used by libnoise's gradient noise hash.
+  const int X_NOISE_GEN = 1619;
+  const int Y_NOISE_GEN = 31337;
+  const int Z_NOISE_GEN = 6971;
+  const int SEED_NOISE_GEN = 1013;
+
+  // Inputs at or beyond this magnitude are wrapped by MakeInt32Range().
+  const double INT32_RANGE_LIMIT = 1073741824.0;
+
+  template <class Ops>
+  inline typename Ops::Real BatchLerp (typename Ops::Real n0,
+    typename Ops::Real n1, typename Ops::Real a)
+  {
+    // ((1.0 - a) * n0) + (a * n1)
+    return Ops::Add (Ops::Mul (Ops::Sub (Ops::Set (1.0), a), n0),
+      Ops::Mul (a, n1));
+  }
+
+  template <class Ops>
+  inline typename Ops::Real BatchSCurve (typename Ops::Real a, int quality)
+  {
+    if (quality == 0) {
+      return a;
+    } else if (quality == 1) {
+      // a * a * (3.0 - 2.0 * a)
+      typename Ops::Real t = Ops::Sub (Ops::Set (3.0),
+        Ops::Mul (Ops::Set (2.0), a));
+      return Ops::Mul (Ops::Mul (a, a), t);
+    }
+    // (6.0 * a5) - (15.0 * a4) + (10.0 * a3)
+    typename Ops::Real a3 = Ops::Mul (Ops::Mul (a, a), a);
+    typename Ops::Real a4 = Ops::Mul (a3, a);
+    typename Ops::Real a5 = Ops::Mul (a4, a);
+    return Ops::Add (Ops::Sub (Ops::Mul (Ops::Set (6.0), a5),
+      Ops::Mul (Ops::Set (15.0), a4)), Ops::Mul (Ops::Set (10.0), a3));
+  }
+
+  template <class Ops>
+  inline typename Ops::Real BatchGradient (
+    const noise::utils::BatchGradients& gradients, typename Ops::Int hash,
+    typename Ops::Real xp, typename Ops::Real yp, typename Ops::Real zp)
+  {
+    hash = Ops::Xor (hash, Ops::ShiftRight8 (hash));
+    hash = Ops::And (hash, Ops::SetInt (0xff));
+    typename Ops::Real xg = Ops::Gather (gradients.x, hash);
+    typename Ops::Real yg = Ops::Gather (gradients.y, hash);
+    typename Ops::Real zg = Ops::Gather (gradients.z, hash);
+    typename Ops::Real n = Ops::Add (Ops::Add (Ops::Mul (xg, xp),
+      Ops::Mul (yg, yp)), Ops::Mul (zg, zp));
+    return Ops::Mul (n, Ops::Set (2.12));
+  }
+
+  // Equivalent of noise::GradientCoherentNoise3D().
+  template <class Ops>
+  inline typename Ops::Real BatchCoherentNoise (
+    const noise::utils::BatchGradients& gradients, typename Ops::Real x,
+    typename Ops::Real y, typename Ops::Real z, int seed, int quality)
+  {
+    typedef typename Ops::Real Real;
+    typedef typename Ops::Int Int;
+
+    // (x > 0.0 ? (int)x : (int)x - 1), kept as doubles for the offsets.
+    Real one = Ops::Set (1.0);
+    Real zero = Ops::Set (0.0);
+    Real xt = Ops::Trunc (x), yt = Ops::Trunc (y), zt = Ops::Trunc (z);
+    Real x0 = Ops::Select (Ops::Greater (x, zero), xt, Ops::Sub (xt, one));
+    Real y0 = Ops::Select (Ops::Greater (y, zero), yt, Ops::Sub (yt, one));
+    Real z0 = Ops::Select (Ops::Greater (z, zero), zt, Ops::Sub (zt, one));
+    Real x1 = Ops::Add (x0, one);
+    Real y1 = Ops::Add (y0, one);
+    Real z1 = Ops::Add (z0, one);
+
+    Real xs = BatchSCurve<Ops> (Ops::Sub (x, x0), quality);
+    Real ys = BatchSCurve<Ops> (Ops::Sub (y, y0), quality);
+    Real zs = BatchSCurve<Ops> (Ops::Sub (z, z0), quality);
+
+    // Per-axis parts of the lattice hash.  Integer overflow wraps the same
+    // way libnoise's does.
+    Int hx0 = Ops::MulInt (Ops::ToInt (x0), Ops::SetInt (X_NOISE_GEN));
+    Int hy0 = Ops::MulInt (Ops::ToInt (y0), Ops::SetInt (Y_NOISE_GEN));
+    Int hz0 = Ops::MulInt (Ops::ToInt (z0), Ops::SetInt (Z_NOISE_GEN));
+    hz0 = Ops::AddInt (hz0, Ops::SetInt ((int)(
+      (unsigned int)SEED_NOISE_GEN * (unsigned int)seed)));
+    Int hx1 = Ops::AddInt (hx0, Ops::SetInt (X_NOISE_GEN));
+    Int hy1 = Ops::AddInt (hy0, Ops::SetInt (Y_NOISE_GEN));
+    Int hz1 = Ops::AddInt (hz0, Ops::SetInt (Z_NOISE_GEN));
+
+    Real xp0 = Ops::Sub (x, x0), xp1 = Ops::Sub (x, x1);
+    Real yp0 = Ops::Sub (y, y0), yp1 = Ops::Sub (y, y1);
+    Real zp0 = Ops::Sub (z, z0), zp1 = Ops::Sub (z, z1);
+
+    Real n0, n1, ix0, ix1, iy0, iy1;
+    n0  = BatchGradient<Ops> (gradients, Ops::AddInt (Ops::AddInt (hx0, hy0), hz0), xp0, yp0, zp0);
+    n1  = BatchGradient<Ops> (gradients, Ops::AddInt (Ops::AddInt (hx1, hy0), hz0), xp1, yp0, zp0);
+    ix0 = BatchLerp<Ops> (n0, n1, xs);
+    n0  = BatchGradient<Ops> (gradients, Ops::AddInt (Ops::AddInt (hx0, hy1), hz0), xp0, yp1, zp0);
+    n1  = BatchGradient<Ops> (gradients, Ops::AddInt (Ops::AddInt (hx1, hy1), hz0), xp1, yp1, zp0);
+    ix1 = BatchLerp<Ops> (n0, n1, xs);
+    iy0 = BatchLerp<Ops> (ix0, ix1, ys);
+    n0  = BatchGradient<Ops> (gradients, Ops::AddInt (Ops::AddInt (hx0, hy0), hz1), xp0, yp0, zp1);
+    n1  = BatchGradient<Ops> (gradients, Ops::AddInt (Ops::AddInt (hx1, hy0), hz1), xp1, yp0, zp1);
+    ix0 = BatchLerp<Ops> (n0, n1, xs);
+    n0  = BatchGradient<Ops> (gradients, Ops::AddInt (Ops::AddInt (hx0, hy1), hz1), xp0, yp1, zp1);
+    n1  = BatchGradient<Ops> (gradients, Ops::AddInt (Ops::AddInt (hx1, hy1), hz1), xp1, yp1, zp1);
+    ix1 = BatchLerp<Ops> (n0, n1, xs);
+    iy1 = BatchLerp<Ops> (ix0, ix1, ys);
+    return BatchLerp<Ops> (iy0, iy1, zs);
+  }
+
+  // Applies MakeInt32Range() to any lanes that need it.
+  template <class Ops>
+  inline typename Ops::Real BatchInt32Range (
+    const noise::utils::BatchFractalParams& params, typename Ops::Real v)
+  {
+    if (!Ops::Any (Ops::OutOfRange (v, INT32_RANGE_LIMIT))) {
+      return v;
+    }
+    double lanes[Ops::WIDTH];
+    Ops::Store (lanes, v);
+    for (int i = 0; i < Ops::WIDTH; i++) {
+      lanes[i] = params.makeInt32Range (lanes[i]);
+    }
+    return Ops::Load (lanes);
+  }
+
+  template <class Ops>
+  inline typename Ops::Real BatchFractal (
+    const noise::utils::BatchGradients& gradients,
+    const noise::utils::BatchFractalParams& params, typename Ops::Real x,
+    typename Ops::Real y, typename Ops::Real z)
+  {
+    typedef typename Ops::Real Real;
+
+    Real value = Ops::Set (0.0);
+    double curPersistence = 1.0;
+
+    x = Ops::Mul (x, Ops::Set (params.frequency));
+    y = Ops::Mul (y, Ops::Set (params.frequency));
+    z = Ops::Mul (z, Ops::Set (params.frequency));
+
+    for (int curOctave = 0; curOctave < params.octaveCount; curOctave++) {
+      Real nx = BatchInt32Range<Ops> (params, x);
+      Real ny = BatchInt32Range<Ops> (params, y);
+      Real nz = BatchInt32Range<Ops> (params, z);
+
+      int seed = (int)((unsigned int)params.seed + (unsigned int)curOctave);
+      Real signal = BatchCoherentNoise<Ops> (gradients, nx, ny, nz, seed,
+        params.quality);
+      if (params.billow) {
+        signal = Ops::Sub (Ops::Mul (Ops::Set (2.0), Ops::Abs (signal)),
+          Ops::Set (1.0));
+      }
+      value = Ops::Add (value, Ops::Mul (signal, Ops::Set (curPersistence)));
+
+      x = Ops::Mul (x, Ops::Set (params.lacunarity));
+      y = Ops::Mul (y, Ops::Set (params.lacunarity));
+      z = Ops::Mul (z, Ops::Set (params.lacunarity));
+      curPersistence *= params.persistence;
+    }
+
+    if (params.billow) {
+      value = Ops::Add (value, Ops::Set (0.5));
+    }
+    return value;
+  }
+
+  template <class Ops>
+  void BatchFractalKernel (const noise::utils::BatchGradients& gradients,
+    const noise::utils::BatchFractalParams& params, const double* x,
+    const double* y, const double* z, int count, double* out)
+  {
+    int i = 0;
+    for (; i + Ops::WIDTH <= count; i += Ops::WIDTH) {
+      Ops::Store (out + i, BatchFractal<Ops> (gradients, params,
+        Ops::Load (x + i), Ops::Load (y + i), Ops::Load (z + i)));
+    }
+    if (i < count) {
+      // Pad the remainder out to a full vector.
+      double xr[Ops::WIDTH], yr[Ops::WIDTH], zr[Ops::WIDTH], vr[Ops::WIDTH];
+      int remaining = count - i;
+      for (int j = 0; j < Ops::WIDTH; j++) {
+        int src = i + (j < remaining ? j : 0);
+        xr[j] = x[src];
+        yr[j] = y[src];
+        zr[j] = z[src];
+      }
+      Ops::Store (vr, BatchFractal<Ops> (gradients, params, Ops::Load (xr),
+        Ops::Load (yr), Ops::Load (zr)));
+      for (int j = 0; j < remaining; j++) {
+        out[i + j] = vr[j];
+      }
+    }
+  }
+
+}
+
+#endif
@@ -0,0 +1,85 @@
+// noisebatch_sse41.cpp
+//
+// SSE4.1 Perlin/Billow kernel.  Built with -msse4.1; only called after a
+// runtime check for SSE4.1 support.
+//
+
+#include "noisebatch_internal.h"
+
+#if defined(NOISEBATCH_SSE41) && defined(__SSE4_1__)
+
+#include <smmintrin.h>
+
+namespace
+{
+
+  // Two doubles per vector.  Integer lanes use the low half of an __m128i.
+  struct SSE41Ops
+  {
+    typedef __m128d Real;
+    typedef __m128i Int;
+
+    static const int WIDTH = 2;
+
+    static inline Real Load (const double* p) { return _mm_loadu_pd (p); }
+    static inline void Store (double* p, Real v) { _mm_storeu_pd (p, v); }
+    static inline Real Set (double v) { return _mm_set1_pd (v); }
+    static inline Real Add (Real a, Real b) { return _mm_add_pd (a, b); }
+    static inline Real Sub (Real a, Real b) { return _mm_sub_pd (a, b); }
+    static inline Real Mul (Real a, Real b) { return _mm_mul_pd (a, b); }
+    static inline Real Abs (Real a)
+    {
+      return _mm_andnot_pd (_mm_set1_pd (-0.0), a);
+    }
+    static inline Real Trunc (Real a)
+    {
+      return _mm_round_pd (a, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    }
+    static inline Real Greater (Real a, Real b) { return _mm_cmpgt_pd (a, b); }
+    static inline Real Select (Real mask, Real a, Real b)
+    {
+      return _mm_blendv_pd (b, a, mask);
+    }
+    static inline Real OutOfRange (Real a, double limit)
+    {
+      return _mm_or_pd (_mm_cmpge_pd (a, _mm_set1_pd (limit)),
+        _mm_cmple_pd (a, _mm_set1_pd (-limit)));
+    }
+    static inline bool Any (Real mask) { return _mm_movemask_pd (mask) != 0; }
+
+    static inline Int ToInt (Real a) { return _mm_cvttpd_epi32 (a); }
+    static inline Int SetInt (int v) { return _mm_set1_epi32 (v); }
+    static inline Int AddInt (Int a, Int b) { return _mm_add_epi32 (a, b); }
+    static inline Int MulInt (Int a, Int b) { return _mm_mullo_epi32 (a, b); }
+    static inline Int Xor (Int a, Int b) { return _mm_xor_si128 (a, b); }
+    static inline Int And (Int a, Int b) { return _mm_and_si128 (a, b); }
+    static inline Int ShiftRight8 (Int a) { return _mm_srai_epi32 (a, 8); }
+    static inline Real Gather (const double* table, Int index)
+    {
+      return _mm_set_pd (table[_mm_extract_epi32 (index, 1)],
+        table[_mm_cvtsi128_si32 (index)]);
+    }
+  };
+
+}
+
+#include "noisebatch_kernel.h"
+
+namespace noise
+{
+
+  namespace utils
+  {
+
+    void BatchFractalSSE41 (const BatchGradients& gradients,
+      const BatchFractalParams& params, const double* x, const double* y,
+      const double* z, int count, double* out)
+    {
+      BatchFractalKernel<SSE41Ops> (gradients, params, x, y, z, count, out);
+    }
+
+  }
+
+}
+
+#endif
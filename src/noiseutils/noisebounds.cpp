@@ -0,0 +1,96 @@
+// noisebounds.cpp
+//
+// Conservative output ranges of libnoise module graphs.
+//
+
+#include <cmath>
+#include <typeinfo>
+
+#include "noisebounds.h"
+
+namespace noise {
+namespace utils {
+
+namespace {
+
+// Sum of the octave weights of a Perlin or Billow module.
+double GetPersistenceSum (double persistence, int octaveCount)
+{
+  double sum = 0.0;
+  double curPersistence = 1.0;
+  for (int curOctave = 0; curOctave < octaveCount; curOctave++) {
+    sum += fabs (curPersistence);
+    curPersistence *= persistence;
+  }
+  return sum;
+}
+
+} // namespace
+
+bool GetOutputBounds (const module::Module& sourceModule,
+  double& lowerBound, double& upperBound)
+{
+  // Exact type matches only; a subclass may have changed GetValue().
+  const std::type_info& type = typeid (sourceModule);
+  if (type == typeid (module::Perlin)) {
+    const module::Perlin& perlin
+      = static_cast<const module::Perlin&> (sourceModule);
+    double amplitude = GRADIENT_NOISE_BOUND * GetPersistenceSum (
+      perlin.GetPersistence (), perlin.GetOctaveCount ());
+    lowerBound = -amplitude;
+    upperBound = amplitude;
+    return true;
+  } else if (type == typeid (module::Billow)) {
+    // Each octave is folded to the range -1 to (2 * GRADIENT_NOISE_BOUND - 1)
+    // and the total offset by 0.5.  The sign of a weight may be negative, so
+    // treat each octave's range as symmetrical.
+    const module::Billow& billow
+      = static_cast<const module::Billow&> (sourceModule);
+    double amplitude = (2.0 * GRADIENT_NOISE_BOUND - 1.0) * GetPersistenceSum (
+      billow.GetPersistence (), billow.GetOctaveCount ());
+    lowerBound = -amplitude + 0.5;
+    upperBound = amplitude + 0.5;
+    return true;
+  } else if (type == typeid (module::ScaleBias)) {
+    const module::ScaleBias& scaleBias
+      = static_cast<const module::ScaleBias&> (sourceModule);
+    double sourceLower, sourceUpper;
+    if (!GetOutputBounds (scaleBias.GetSourceModule (0), sourceLower,
+      sourceUpper)) {
+      return false;
+    }
+    double value0 = sourceLower * scaleBias.GetScale () + scaleBias.GetBias ();
+    double value1 = sourceUpper * scaleBias.GetScale () + scaleBias.GetBias ();
+    lowerBound = GetMin (value0, value1);
+    upperBound = GetMax (value0, value1);
+    return true;
+  } else if (type == typeid (module::Add)) {
+    double lower0, upper0, lower1, upper1;
+    if (!GetOutputBounds (sourceModule.GetSourceModule (0), lower0, upper0)
+      || !GetOutputBounds (sourceModule.GetSourceModule (1), lower1, upper1)) {
+      return false;
+    }
+    lowerBound = lower0 + lower1;
+    upperBound = upper0 + upper1;
+    return true;
+  } else if (type == typeid (module::Select)) {
+    // Edge falloff blends between the two sources, so the output is always
+    // somewhere between them.
+    double lower0, upper0, lower1, upper1;
+    if (!GetOutputBounds (sourceModule.GetSourceModule (0), lower0, upper0)
+      || !GetOutputBounds (sourceModule.GetSourceModule (1), lower1, upper1)) {
+      return false;
+    }
+    lowerBound = GetMin (lower0, lower1);
+    upperBound = GetMax (upper0, upper1);
+    return true;
+  } else if (type == typeid (module::Const)) {
+    lowerBound = upperBound
+      = static_cast<const module::Const&> (sourceModule).GetConstValue ();
+    return true;
+  }
+  return false;
+}
+
+} // namespace utils
+} // namespace noise
@@ -0,0 +1,45 @@
+// noisebounds.h
+//
+// Conservative output ranges of libnoise module graphs.
+//
+
+#ifndef NOISEBOUNDS_H
+#define NOISEBOUNDS_H
+
+#include <libnoise/noise.h>
+
+namespace noise
+{
+
+  namespace utils
+  {
+
+    /// Upper bound of the magnitude of a single octave of gradient noise.
+    ///
+    /// Each lattice point contributes the dot product of a unit gradient
+    /// vector with an offset no longer than sqrt(3), scaled by 2.12, and
+    /// interpolation only blends these together.  In practice libnoise's
+    /// output rarely leaves -1 to +1, so this is very conservative.
+    const double GRADIENT_NOISE_BOUND = 2.12 * 1.7320508075688772935;
+
+    /// Calculates a range guaranteed to contain every output value of a
+    /// noise module graph.
+    ///
+    /// @param sourceModule The noise module to examine.
+    /// @param lowerBound Receives the lower bound.
+    /// @param upperBound Receives the upper bound.
+    ///
+    /// @returns true if the range could be determined, false if the graph
+    /// contains a module other than Perlin, Billow, ScaleBias, Select, Add
+    /// and Const.
+    ///
+    /// The control module of a Select module doesn't need to be supported,
+    /// since the output is always between the values of its sources.
+    bool GetOutputBounds (const noise::module::Module& sourceModule,
+      double& lowerBound, double& upperBound);
+
+  }
+
+}
+
+#endif
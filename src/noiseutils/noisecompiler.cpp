@@ -0,0 +1,316 @@
+// noisecompiler.cpp
+//
+// Flattens libnoise module graphs into a linear program.
+//
+
+#include <cmath>
+#include <typeinfo>
+
+#include <libnoise/interp.h>
+
+#include "noisecompiler.h"
+
+namespace noise {
+namespace utils {
+
+namespace {
+
+// Number of registers kept on the stack by CompiledModule::GetValue().
+const int STACK_REGISTER_COUNT = 32;
+
+// Which source module(s) a Select module uses, as classified by
+// OP_SELECT_CLASSIFY.  Kept in a register, so these are doubles.
+const double SELECT_SOURCE0 = 0.0;
+const double SELECT_SOURCE1 = 1.0;
+const double SELECT_LOWER_EDGE = 2.0;
+const double SELECT_UPPER_EDGE = 3.0;
+
+} // namespace
+
+CompiledModule::CompiledModule ():
+  Module (0),
+  m_registerCount (0),
+  m_resultRegister (0),
+  m_pCompiledModule (NULL)
+{
+}
+
+int CompiledModule::AddInstruction (Opcode opcode, int dest)
+{
+  Instruction instruction = Instruction ();
+  instruction.opcode = opcode;
+  instruction.dest = dest;
+  m_program.push_back (instruction);
+  return (int)m_program.size () - 1;
+}
+
+void CompiledModule::Compile (const module::Module& sourceModule)
+{
+  m_program.clear ();
+  m_registerCount = 0;
+  m_pCompiledModule = NULL;
+
+  CompiledList compiled;
+  m_resultRegister = CompileModule (sourceModule, compiled);
+  m_pCompiledModule = &sourceModule;
+}
+
+int CompiledModule::CompileModule (const module::Module& sourceModule,
+  CompiledList& compiled)
+{
+  // Reuse the output of a module that has already been evaluated.
+  for (size_t i = 0; i < compiled.size (); i++) {
+    if (compiled[i].first == &sourceModule) {
+      return compiled[i].second;
+    }
+  }
+
+  // Exact type matches only; a subclass may have changed GetValue().
+  const std::type_info& type = typeid (sourceModule);
+  int dest;
+  if (type == typeid (module::Perlin) || type == typeid (module::Billow)) {
+    dest = m_registerCount++;
+    Instruction& instruction = m_program[AddInstruction (
+      (type == typeid (module::Perlin)) ? OP_PERLIN : OP_BILLOW, dest)];
+    if (type == typeid (module::Perlin)) {
+      const module::Perlin& perlin
+        = static_cast<const module::Perlin&> (sourceModule);
+      instruction.frequency = perlin.GetFrequency ();
+      instruction.lacunarity = perlin.GetLacunarity ();
+      instruction.persistence = perlin.GetPersistence ();
+      instruction.octaveCount = perlin.GetOctaveCount ();
+      instruction.seed = perlin.GetSeed ();
+      instruction.noiseQuality = perlin.GetNoiseQuality ();
+    } else {
+      const module::Billow& billow
+        = static_cast<const module::Billow&> (sourceModule);
+      instruction.frequency = billow.GetFrequency ();
+      instruction.lacunarity = billow.GetLacunarity ();
+      instruction.persistence = billow.GetPersistence ();
+      instruction.octaveCount = billow.GetOctaveCount ();
+      instruction.seed = billow.GetSeed ();
+      instruction.noiseQuality = billow.GetNoiseQuality ();
+    }
+  } else if (type == typeid (module::ScaleBias)) {
+    const module::ScaleBias& scaleBias
+      = static_cast<const module::ScaleBias&> (sourceModule);
+    int src = CompileModule (scaleBias.GetSourceModule (0), compiled);
+    dest = m_registerCount++;
+    Instruction& instruction = m_program[AddInstruction (OP_SCALE_BIAS,
+      dest)];
+    instruction.src[0] = src;
+    instruction.value[0] = scaleBias.GetScale ();
+    instruction.value[1] = scaleBias.GetBias ();
+  } else if (type == typeid (module::Add)) {
+    int src0 = CompileModule (sourceModule.GetSourceModule (0), compiled);
+    int src1 = CompileModule (sourceModule.GetSourceModule (1), compiled);
+    dest = m_registerCount++;
+    Instruction& instruction = m_program[AddInstruction (OP_ADD, dest)];
+    instruction.src[0] = src0;
+    instruction.src[1] = src1;
+  } else if (type == typeid (module::Select)) {
+    const module::Select& select
+      = static_cast<const module::Select&> (sourceModule);
+    int control = CompileModule (select.GetControlModule (), compiled);
+    const module::Module& source0 = select.GetSourceModule (0);
+    const module::Module& source1 = select.GetSourceModule (1);
+
+    int region = m_registerCount++;
+    int classify = AddInstruction (OP_SELECT_CLASSIFY, region);
+    m_program[classify].src[0] = control;
+    m_program[classify].value[0] = select.GetLowerBound ();
+    m_program[classify].value[1] = select.GetUpperBound ();
+    m_program[classify].value[2] = select.GetEdgeFalloff ();
+
+    // Each source is only evaluated when it's needed, so anything compiled
+    // for one can't be reused outside of it.
+    int skipSource0 = AddInstruction (OP_JUMP_IF, 0);
+    m_program[skipSource0].src[0] = region;
+    m_program[skipSource0].value[0] = SELECT_SOURCE1;
+    CompiledList branchCompiled (compiled);
+    int src0 = CompileModule (source0, branchCompiled);
+
+    int skipSource1 = AddInstruction (OP_JUMP_IF, 0);
+    m_program[skipSource1].src[0] = region;
+    m_program[skipSource1].value[0] = SELECT_SOURCE0;
+    m_program[skipSource0].target = (int)m_program.size ();
+    branchCompiled = compiled;
+    int src1 = CompileModule (source1, branchCompiled);
+    m_program[skipSource1].target = (int)m_program.size ();
+
+    dest = m_registerCount++;
+    Instruction& instruction = m_program[AddInstruction (OP_SELECT_BLEND,
+      dest)];
+    instruction.src[0] = region;
+    instruction.src[1] = src0;
+    instruction.src[2] = src1;
+    instruction.src[3] = control;
+    instruction.value[0] = select.GetLowerBound ();
+    instruction.value[1] = select.GetUpperBound ();
+    instruction.value[2] = select.GetEdgeFalloff ();
+  } else if (type == typeid (module::Const)) {
+    dest = m_registerCount++;
+    m_program[AddInstruction (OP_CONST, dest)].value[0]
+      = static_cast<const module::Const&> (sourceModule).GetConstValue ();
+  } else {
+    dest = m_registerCount++;
+    m_program[AddInstruction (OP_MODULE, dest)].pModule = &sourceModule;
+  }
+
+  compiled.push_back (std::make_pair (&sourceModule, dest));
+  return dest;
+}
+
+double CompiledModule::GetValue (double x, double y, double z) const
+{
+  if (m_pCompiledModule == NULL) {
+    throw noise::ExceptionNoModule ();
+  }
+
+  double stackRegisters[STACK_REGISTER_COUNT];
+  std::vector<double> heapRegisters;
+  double* reg = stackRegisters;
+  if (m_registerCount > STACK_REGISTER_COUNT) {
+    heapRegisters.resize (m_registerCount);
+    reg = &heapRegisters[0];
+  }
+
+  const Instruction* program = &m_program[0];
+  const int programSize = (int)m_program.size ();
+  for (int pc = 0; pc < programSize; pc++) {
+    const Instruction& instruction = program[pc];
+    switch (instruction.opcode) {
+      case OP_CONST:
+        reg[instruction.dest] = instruction.value[0];
+        break;
+
+      case OP_MODULE:
+        reg[instruction.dest] = instruction.pModule->GetValue (x, y, z);
+        break;
+
+      case OP_PERLIN:
+      case OP_BILLOW: {
+        // Same as Perlin::GetValue() and Billow::GetValue().
+        bool billow = (instruction.opcode == OP_BILLOW);
+        double value = 0.0;
+        double signal = 0.0;
+        double curPersistence = 1.0;
+        double nx, ny, nz;
+        int seed;
+
+        double fx = x * instruction.frequency;
+        double fy = y * instruction.frequency;
+        double fz = z * instruction.frequency;
+
+        for (int curOctave = 0; curOctave < instruction.octaveCount;
+          curOctave++) {
+          nx = MakeInt32Range (fx);
+          ny = MakeInt32Range (fy);
+          nz = MakeInt32Range (fz);
+
+          seed = (instruction.seed + curOctave) & 0xffffffff;
+          signal = GradientCoherentNoise3D (nx, ny, nz, seed,
+            instruction.noiseQuality);
+          if (billow) {
+            signal = 2.0 * fabs (signal) - 1.0;
+          }
+          value += signal * curPersistence;
+
+          fx *= instruction.lacunarity;
+          fy *= instruction.lacunarity;
+          fz *= instruction.lacunarity;
+          curPersistence *= instruction.persistence;
+        }
+        if (billow) {
+          value += 0.5;
+        }
+        reg[instruction.dest] = value;
+        break;
+      }
+
+      case OP_SCALE_BIAS:
+        reg[instruction.dest] = reg[instruction.src[0]] * instruction.value[0]
+          + instruction.value[1];
+        break;
+
+      case OP_ADD:
+        reg[instruction.dest] = reg[instruction.src[0]]
+          + reg[instruction.src[1]];
+        break;
+
+      case OP_SELECT_CLASSIFY: {
+        // Same tests as Select::GetValue().
+        double controlValue = reg[instruction.src[0]];
+        double lowerBound = instruction.value[0];
+        double upperBound = instruction.value[1];
+        double edgeFalloff = instruction.value[2];
+        double region;
+        if (edgeFalloff > 0.0) {
+          if (controlValue < (lowerBound - edgeFalloff)) {
+            region = SELECT_SOURCE0;
+          } else if (controlValue < (lowerBound + edgeFalloff)) {
+            region = SELECT_LOWER_EDGE;
+          } else if (controlValue < (upperBound - edgeFalloff)) {
+            region = SELECT_SOURCE1;
+          } else if (controlValue < (upperBound + edgeFalloff)) {
+            region = SELECT_UPPER_EDGE;
+          } else {
+            region = SELECT_SOURCE0;
+          }
+        } else {
+          if (controlValue < lowerBound || controlValue > upperBound) {
+            region = SELECT_SOURCE0;
+          } else {
+            region = SELECT_SOURCE1;
+          }
+        }
+        reg[instruction.dest] = region;
+        break;
+      }
+
+      case OP_JUMP_IF:
+        if (reg[instruction.src[0]] == instruction.value[0]) {
+          // The loop increment moves on to the target.
+          pc = instruction.target - 1;
+        }
+        break;
+
+      case OP_SELECT_BLEND: {
+        double region = reg[instruction.src[0]];
+        if (region == SELECT_SOURCE0) {
+          reg[instruction.dest] = reg[instruction.src[1]];
+        } else if (region == SELECT_SOURCE1) {
+          reg[instruction.dest] = reg[instruction.src[2]];
+        } else {
+          double controlValue = reg[instruction.src[3]];
+          double edgeFalloff = instruction.value[2];
+          double bound = (region == SELECT_LOWER_EDGE)
+            ? instruction.value[0] : instruction.value[1];
+          double lowerCurve = (bound - edgeFalloff);
+          double upperCurve = (bound + edgeFalloff);
+          double alpha = SCurve3 (
+            (controlValue - lowerCurve) / (upperCurve - lowerCurve));
+          if (region == SELECT_LOWER_EDGE) {
+            reg[instruction.dest] = LinearInterp (reg[instruction.src[1]],
+              reg[instruction.src[2]], alpha);
+          } else {
+            reg[instruction.dest] = LinearInterp (reg[instruction.src[2]],
+              reg[instruction.src[1]], alpha);
+          }
+        }
+        break;
+      }
+    }
+  }
+
+  return reg[m_resultRegister];
+}
+
+void CompiledModule::GetValues (const double* x, const double* y,
+  const double* z, int count, double* out) const
+{
+  noise::utils::GetValues (GetCompiledModule (), x, y, z, count, out);
+}
+
+} // namespace utils
+} // namespace noise
@@ -0,0 +1,153 @@
+// noisecompiler.h
+//
+// Flattens libnoise module graphs into a linear program.
+//
+
+#ifndef NOISECOMPILER_H
+#define NOISECOMPILER_H
+
+#include <vector>
+
+#include <libnoise/noise.h>
+
+#include "noisebatch.h"
+
+namespace noise
+{
+
+  namespace utils
+  {
+
+    /// Noise module that evaluates a compiled copy of a module graph.
+    ///
+    /// Compile() flattens the graph into a linear program that generates an
+    /// output value in a single pass, without the per-module virtual calls
+    /// and recursion of noise::module::Module::GetValue().  Modules that are
+    /// referenced more than once in the graph are only evaluated once per
+    /// point, and Select modules skip the source module that isn't needed
+    /// outside of the edge falloff.
+    ///
+    /// Perlin, Billow, ScaleBias, Select, Add and Const modules are compiled
+    /// into the program.  Any other module is called through its GetValue()
+    /// method.  Output values are identical to those of the source graph.
+    ///
+    /// The module parameters are copied when the graph is compiled; call
+    /// Compile() again after changing any module in the graph.  The source
+    /// modules must outlive this module.
+    ///
+    /// Batches requested through GetValues() are generated by the vectorized
+    /// noise::utils::GetValues() path on the source graph.
+    ///
+    /// This noise module does not require any source modules.
+    class CompiledModule: public noise::module::Module, public BatchModule
+    {
+
+      public:
+
+        /// Constructor.
+        CompiledModule ();
+
+        /// Compiles a noise module graph.
+        ///
+        /// @param sourceModule The root module of the graph.
+        ///
+        /// @throw noise::ExceptionNoModule
+        /// - A module in the graph is missing a required source module.
+        void Compile (const noise::module::Module& sourceModule);
+
+        /// Returns the root module of the compiled graph.
+        ///
+        /// @throw noise::ExceptionNoModule
+        /// - No graph has been compiled.
+        const noise::module::Module& GetCompiledModule () const
+        {
+          if (m_pCompiledModule == NULL) {
+            throw noise::ExceptionNoModule ();
+          }
+          return *m_pCompiledModule;
+        }
+
+        /// Returns the number of instructions in the compiled program.
+        int GetInstructionCount () const
+        {
+          return (int)m_program.size ();
+        }
+
+        virtual int GetSourceModuleCount () const
+        {
+          return 0;
+        }
+
+        virtual double GetValue (double x, double y, double z) const;
+
+        virtual void GetValues (const double* x, const double* y,
+          const double* z, int count, double* out) const;
+
+      private:
+
+        /// Operations performed by the compiled program.
+        enum Opcode
+        {
+          OP_CONST,
+          OP_MODULE,
+          OP_PERLIN,
+          OP_BILLOW,
+          OP_SCALE_BIAS,
+          OP_ADD,
+          OP_SELECT_CLASSIFY,
+          OP_JUMP_IF,
+          OP_SELECT_BLEND
+        };
+
+        /// A single step of the compiled program.
+        struct Instruction
+        {
+          Opcode opcode;
+          /// Register receiving the result.
+          int dest;
+          /// Registers read by the instruction.
+          int src[4];
+          /// Instruction to continue from if an OP_JUMP_IF is taken.
+          int target;
+          /// Constants: value, scale/bias, or Select bounds and falloff.
+          double value[3];
+          /// Module to call for OP_MODULE.
+          const noise::module::Module* pModule;
+          /// Parameters for OP_PERLIN and OP_BILLOW.
+          double frequency;
+          double lacunarity;
+          double persistence;
+          int octaveCount;
+          int seed;
+          noise::NoiseQuality noiseQuality;
+        };
+
+        /// Modules already compiled, and the registers holding their
+        /// output values.
+        typedef std::vector<std::pair<const noise::module::Module*, int> >
+          CompiledList;
+
+        int CompileModule (const noise::module::Module& sourceModule,
+          CompiledList& compiled);
+
+        int AddInstruction (Opcode opcode, int dest);
+
+        /// The compiled program.
+        std::vector<Instruction> m_program;
+
+        /// Number of registers used by the program.
+        int m_registerCount;
+
+        /// Register holding the final output value.
+        int m_resultRegister;
+
+        /// Root module of the compiled graph.
+        const noise::module::Module* m_pCompiledModule;
+
+    };
+
+  }
+
+}
+
+#endif
@@ -21,11 +21,13 @@
 //
 
 #include <fstream>
+#include <vector>
 
 #include <libnoise/interp.h>
 #include <libnoise/mathconsts.h>
 
 #include "noiseutils.h"
+#include "noisebatch.h"
 
 // Bitmap header size.
 const int BMP_HEADER_SIZE = 54;
@@ -831,27 +833,52 @@ void NoiseMapBuilderPlane::Build ()
   double xCur    = m_lowerXBound;
   double zCur    = m_lowerZBound;
 
+  if (!m_isSeamlessEnabled) {
+    // Generate the whole map in one batch.  The coordinates are accumulated
+    // the same way as below so the output values don't change.
+    int count = m_destWidth * m_destHeight;
+    std::vector<double> xCoords (count), yCoords (count, 0.0), zCoords (count);
+    for (int z = 0, i = 0; z < m_destHeight; z++) {
+      xCur = m_lowerXBound;
+      for (int x = 0; x < m_destWidth; x++, i++) {
+        xCoords[i] = xCur;
+        zCoords[i] = zCur;
+        xCur += xDelta;
+      }
+      zCur += zDelta;
+    }
+    std::vector<double> values (count);
+    GetValues (*m_pSourceModule, &xCoords[0], &yCoords[0], &zCoords[0], count,
+      &values[0]);
+
+    for (int z = 0; z < m_destHeight; z++) {
+      float* pDest = m_pDestNoiseMap->GetSlabPtr (z);
+      const double* pSource = &values[z * m_destWidth];
+      for (int x = 0; x < m_destWidth; x++) {
+        *pDest++ = (float)*pSource++;
+      }
+      if (m_pCallback != NULL) {
+        m_pCallback (z);
+      }
+    }
+    return;
+  }
+
   // Fill every point in the noise map with the output values from the model.
   for (int z = 0; z < m_destHeight; z++) {
     float* pDest = m_pDestNoiseMap->GetSlabPtr (z);
     xCur = m_lowerXBound;
     for (int x = 0; x < m_destWidth; x++) {
-      float finalValue;
-      if (!m_isSeamlessEnabled) {
-        finalValue = planeModel.GetValue (xCur, zCur);
-      } else {
-        double swValue, seValue, nwValue, neValue;
-        swValue = planeModel.GetValue (xCur          , zCur          );
-        seValue = planeModel.GetValue (xCur + xExtent, zCur          );
-        nwValue = planeModel.GetValue (xCur          , zCur + zExtent);
-        neValue = planeModel.GetValue (xCur + xExtent, zCur + zExtent);
-        double xBlend = 1.0 - ((xCur - m_lowerXBound) / xExtent);
-        double zBlend = 1.0 - ((zCur - m_lowerZBound) / zExtent);
-        double z0 = LinearInterp (swValue, seValue, xBlend);
-        double z1 = LinearInterp (nwValue, neValue, xBlend);
-        finalValue = (float)LinearInterp (z0, z1, zBlend);
-      }
-      *pDest++ = finalValue;
+      double swValue, seValue, nwValue, neValue;
+      swValue = planeModel.GetValue (xCur          , zCur          );
+      seValue = planeModel.GetValue (xCur + xExtent, zCur          );
+      nwValue = planeModel.GetValue (xCur          , zCur + zExtent);
+      neValue = planeModel.GetValue (xCur + xExtent, zCur + zExtent);
+      double xBlend = 1.0 - ((xCur - m_lowerXBound) / xExtent);
+      double zBlend = 1.0 - ((zCur - m_lowerZBound) / zExtent);
+      double z0 = LinearInterp (swValue, seValue, xBlend);
+      double z1 = LinearInterp (nwValue, neValue, xBlend);
+      *pDest++ = (float)LinearInterp (z0, z1, zBlend);
       xCur += xDelta;
     }
     zCur += zDelta;
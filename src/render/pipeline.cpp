@@ -281,6 +281,11 @@ void Pipeline::setProjectionMatrix(const osg::Matrix &matrix)
     mMainPass->setProjectionMatrix(matrix);
 }
 
+const osg::Matrix &Pipeline::getProjectionMatrix() const
+{
+    return mMainPass->getProjectionMatrix();
+}
+
 
 osg::Node* Pipeline::createDirectionalLight()
 {
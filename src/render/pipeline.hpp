@@ -69,7 +69,9 @@ public:
     {
         return double(mScreenWidth) / double(mScreenHeight);
     }
+    int getScreenHeight() const { return mScreenHeight; }
     void setProjectionMatrix(const osg::Matrix &matrix);
+    const osg::Matrix &getProjectionMatrix() const;
 
     osg::Node *createDirectionalLight();
     void removeDirectionalLight(osg::Node *node);
@@ -2,11 +2,15 @@
 #define TERRAIN_HPP
 
 #include <iostream>
+#include <string>
+
+#include <stdint.h>
 
 namespace osg
 {
     class Vec3f;
     class Group;
+    class Polytope;
 }
 
 namespace osgViewer
@@ -31,14 +35,22 @@ class World
     Terrain::World *mTerrain;
 
     World();
+
+    // Keep composite maps in between runs, unless the path is empty
+    void openCompositeMapStore(const std::string &path, uint64_t hash);
 public:
     void initialize(osgViewer::Viewer *viewer, osg::Group *rootNode, const osg::Vec3f &cameraPos);
     void deinitialize();
 
     void rebuildCompositeMaps();
 
+    void benchmarkNoise(int samples);
+
     float getHeightAt(const osg::Vec3f &pos) const;
-    void update(const osg::Vec3f &cameraPos);
+    // Get the heights at many positions at once
+    void getHeightsAt(const osg::Vec3f *pos, size_t count, float *heights) const;
+    // Frustum in world space, for prioritizing what's in view
+    void update(const osg::Vec3f &cameraPos, const osg::Polytope &frustum);
 
     void getStatus(std::ostream &status) const;
 
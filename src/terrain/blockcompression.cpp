@@ -0,0 +1,272 @@
+#include "blockcompression.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include <stdint.h>
+
+#include <osg/Image>
+#include <osg/Texture>
+
+namespace
+{
+
+uint16_t packRGB565(const int rgb[3])
+{
+    return uint16_t((((rgb[0]*31 + 127) / 255) << 11) |
+                    (((rgb[1]*63 + 127) / 255) << 5) |
+                     ((rgb[2]*31 + 127) / 255));
+}
+
+void unpackRGB565(uint16_t color, int rgb[3])
+{
+    const int r = (color >> 11) & 31;
+    const int g = (color >> 5) & 63;
+    const int b = color & 31;
+    rgb[0] = (r << 3) | (r >> 2);
+    rgb[1] = (g << 2) | (g >> 4);
+    rgb[2] = (b << 3) | (b >> 2);
+}
+
+// Gather the 16 pixels of a block, repeating the last row or column past the edges
+void loadBlock(const unsigned char *rgba, int width, int height, int bx, int by, unsigned char block[16][4])
+{
+    for(int y = 0;y < 4;++y)
+    {
+        const int sy = std::min(by+y, height-1);
+        for(int x = 0;x < 4;++x)
+        {
+            const int sx = std::min(bx+x, width-1);
+            memcpy(block[y*4 + x], rgba + (size_t(sy)*width + sx)*4, 4);
+        }
+    }
+}
+
+// BC1 colour block, also the colour half of BC3. Endpoints from the bounding box
+// of the colours, which is good enough for the smooth gradients of distant terrain.
+void compressColorBlock(const unsigned char block[16][4], unsigned char *out)
+{
+    int minColor[3] = { 255, 255, 255 };
+    int maxColor[3] = { 0, 0, 0 };
+    for(int i = 0;i < 16;++i)
+    {
+        for(int c = 0;c < 3;++c)
+        {
+            minColor[c] = std::min(minColor[c], int(block[i][c]));
+            maxColor[c] = std::max(maxColor[c], int(block[i][c]));
+        }
+    }
+    // Pull the endpoints in a little, outliers aren't worth stretching the palette for
+    for(int c = 0;c < 3;++c)
+    {
+        const int inset = (maxColor[c] - minColor[c]) >> 4;
+        minColor[c] += inset;
+        maxColor[c] -= inset;
+    }
+
+    uint16_t color0 = packRGB565(maxColor);
+    uint16_t color1 = packRGB565(minColor);
+    // color0 > color1 selects four colours without transparency
+    if(color0 < color1)
+        std::swap(color0, color1);
+
+    uint32_t indices = 0;
+    if(color0 != color1)
+    {
+        int palette[4][3];
+        unpackRGB565(color0, palette[0]);
+        unpackRGB565(color1, palette[1]);
+        for(int c = 0;c < 3;++c)
+        {
+            palette[2][c] = (2*palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2*palette[1][c]) / 3;
+        }
+
+        for(int i = 0;i < 16;++i)
+        {
+            int best = 0;
+            int bestDist = 0x7fffffff;
+            for(int p = 0;p < 4;++p)
+            {
+                int dist = 0;
+                for(int c = 0;c < 3;++c)
+                {
+                    const int d = int(block[i][c]) - palette[p][c];
+                    dist += d*d;
+                }
+                if(dist < bestDist)
+                {
+                    bestDist = dist;
+                    best = p;
+                }
+            }
+            indices |= uint32_t(best) << (2*i);
+        }
+    }
+
+    out[0] = color0 & 0xff;
+    out[1] = color0 >> 8;
+    out[2] = color1 & 0xff;
+    out[3] = color1 >> 8;
+    for(int b = 0;b < 4;++b)
+        out[4+b] = (indices >> (8*b)) & 0xff;
+}
+
+// BC4 block of a single channel, the alpha half of BC3 and either half of BC5.
+// Eight levels evenly spread between the channel's extremes.
+void compressChannelBlock(const unsigned char block[16][4], int channel, unsigned char *out)
+{
+    int minValue = 255;
+    int maxValue = 0;
+    for(int i = 0;i < 16;++i)
+    {
+        minValue = std::min(minValue, int(block[i][channel]));
+        maxValue = std::max(maxValue, int(block[i][channel]));
+    }
+
+    uint64_t indices = 0;
+    if(maxValue > minValue)
+    {
+        // Index of each step up the ramp from the minimum: the endpoints come first,
+        // then the interpolated values from the maximum down
+        static const int StepIndices[8] = { 1, 7, 6, 5, 4, 3, 2, 0 };
+        const int range = maxValue - minValue;
+        for(int i = 0;i < 16;++i)
+        {
+            const int step = ((int(block[i][channel]) - minValue)*14 + range) / (2*range);
+            indices |= uint64_t(StepIndices[step]) << (3*i);
+        }
+    }
+
+    out[0] = (unsigned char)maxValue;
+    out[1] = (unsigned char)minValue;
+    for(int b = 0;b < 6;++b)
+        out[2+b] = (indices >> (8*b)) & 0xff;
+}
+
+void downsample(const std::vector<unsigned char> &src, int width, int height, std::vector<unsigned char> &dst)
+{
+    const int dstWidth = std::max(width/2, 1);
+    const int dstHeight = std::max(height/2, 1);
+    dst.resize(size_t(dstWidth)*dstHeight*4);
+    for(int y = 0;y < dstHeight;++y)
+    {
+        const unsigned char *row0 = &src[size_t(std::min(y*2, height-1))*width*4];
+        const unsigned char *row1 = &src[size_t(std::min(y*2+1, height-1))*width*4];
+        for(int x = 0;x < dstWidth;++x)
+        {
+            const int x0 = std::min(x*2, width-1)*4;
+            const int x1 = std::min(x*2+1, width-1)*4;
+            for(int c = 0;c < 4;++c)
+                dst[(size_t(y)*dstWidth + x)*4 + c] = (row0[x0+c] + row0[x1+c] + row1[x0+c] + row1[x1+c] + 2) / 4;
+        }
+    }
+}
+
+GLenum getGLFormat(Terrain::BlockFormat format)
+{
+    switch(format)
+    {
+    case Terrain::Block_BC1:
+        return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+    case Terrain::Block_BC3:
+        return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+    case Terrain::Block_BC5:
+        return GL_COMPRESSED_RED_GREEN_RGTC2_EXT;
+    }
+    return 0;
+}
+
+}
+
+namespace Terrain
+{
+
+size_t getCompressedSize(BlockFormat format, int width, int height)
+{
+    const size_t blockBytes = (format == Block_BC1) ? 8 : 16;
+    return size_t((width+3)/4) * ((height+3)/4) * blockBytes;
+}
+
+void compressBlocks(BlockFormat format, const unsigned char *rgba, int width, int height, unsigned char *blocks)
+{
+    unsigned char block[16][4];
+    for(int by = 0;by < height;by += 4)
+    {
+        for(int bx = 0;bx < width;bx += 4)
+        {
+            loadBlock(rgba, width, height, bx, by, block);
+            switch(format)
+            {
+            case Block_BC1:
+                compressColorBlock(block, blocks);
+                blocks += 8;
+                break;
+            case Block_BC3:
+                compressChannelBlock(block, 3, blocks);
+                compressColorBlock(block, blocks+8);
+                blocks += 16;
+                break;
+            case Block_BC5:
+                compressChannelBlock(block, 0, blocks);
+                compressChannelBlock(block, 1, blocks+8);
+                blocks += 16;
+                break;
+            }
+        }
+    }
+}
+
+bool isOpaque(const unsigned char *rgba, int width, int height)
+{
+    const size_t numPixels = size_t(width)*height;
+    for(size_t i = 0;i < numPixels;++i)
+    {
+        if(rgba[i*4 + 3] != 255)
+            return false;
+    }
+    return true;
+}
+
+osg::Image *createCompressedImage(const osg::Image *rgba, BlockFormat format)
+{
+    const int width = rgba->s();
+    const int height = rgba->t();
+
+    // Lay out the whole chain first, so it goes in one allocation
+    osg::Image::MipmapDataType offsets;
+    size_t total = 0;
+    for(int w = width, h = height;;w = std::max(w/2, 1), h = std::max(h/2, 1))
+    {
+        if(total > 0)
+            offsets.push_back((unsigned int)total);
+        total += getCompressedSize(format, w, h);
+        if(w == 1 && h == 1)
+            break;
+    }
+
+    unsigned char *data = new unsigned char[total];
+    std::vector<unsigned char> level(rgba->data(), rgba->data() + size_t(width)*height*4);
+    std::vector<unsigned char> next;
+    size_t offset = 0;
+    for(int w = width, h = height;;)
+    {
+        compressBlocks(format, &level[0], w, h, data + offset);
+        offset += getCompressedSize(format, w, h);
+        if(w == 1 && h == 1)
+            break;
+        downsample(level, w, h, next);
+        level.swap(next);
+        w = std::max(w/2, 1);
+        h = std::max(h/2, 1);
+    }
+
+    const GLenum glFormat = getGLFormat(format);
+    osg::Image *image = new osg::Image();
+    image->setImage(width, height, 1, glFormat, glFormat, GL_UNSIGNED_BYTE, data, osg::Image::USE_NEW_DELETE);
+    image->setMipmapLevels(offsets);
+    return image;
+}
+
+}
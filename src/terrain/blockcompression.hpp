@@ -0,0 +1,42 @@
+#ifndef COMPONENTS_TERRAIN_BLOCKCOMPRESSION_H
+#define COMPONENTS_TERRAIN_BLOCKCOMPRESSION_H
+
+#include <cstddef>
+
+namespace osg
+{
+    class Image;
+}
+
+namespace Terrain
+{
+
+    enum BlockFormat
+    {
+        /// Colour without alpha, 8 bytes per block
+        Block_BC1,
+        /// Colour with interpolated alpha, 16 bytes per block
+        Block_BC3,
+        /// Two interpolated channels (red and green), 16 bytes per block
+        Block_BC5
+    };
+
+    /// Number of bytes of a \a width x \a height image compressed in the given format.
+    /// Partial blocks at the edges count as whole ones.
+    size_t getCompressedSize(BlockFormat format, int width, int height);
+
+    /// Compress an image into 4x4 blocks. Blocks hanging over the edges repeat the last row or column.
+    /// @param rgba width*height RGBA8 pixels, row by row
+    /// @param blocks receives getCompressedSize(format, width, height) bytes
+    void compressBlocks(BlockFormat format, const unsigned char *rgba, int width, int height, unsigned char *blocks);
+
+    /// Check if every pixel of an RGBA8 image is opaque, so it can go in BC1
+    bool isOpaque(const unsigned char *rgba, int width, int height);
+
+    /// Create a block-compressed copy of an RGBA8 image, with a full chain of mipmaps
+    /// box-filtered from it. Thread-safe.
+    osg::Image *createCompressedImage(const osg::Image *rgba, BlockFormat format);
+
+}
+
+#endif
@@ -1,12 +1,17 @@
 #include "buffercache.hpp"
 
 #include <cassert>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
 
 #include <osg/BufferObject>
 #include <osg/PrimitiveSet>
 #include <osg/Array>
 
 #include "defs.hpp"
+#include "vertexcache.hpp"
 
 namespace
 {
@@ -28,22 +33,27 @@ struct ArrayType<GLuint> {
     typedef osg::DrawElementsUInt type;
 };
 
-template<typename IndexType>
-osg::PrimitiveSet *createIndexBuffer(unsigned int flags, unsigned int verts)
+// Reorder the triangles for the post-transform vertex cache. Doesn't change what's drawn.
+template<typename DrawElementsType>
+void optimizeIndices(DrawElementsType &indices, unsigned int verts)
 {
-    size_t lodDeltas[4];
-    for (int i=0; i<4; ++i)
-        lodDeltas[i] = (flags >> (4*i)) & (0xf);
-
-    bool anyDeltas = (lodDeltas[Terrain::North] || lodDeltas[Terrain::South] || lodDeltas[Terrain::West] || lodDeltas[Terrain::East]);
+    if(!indices.empty())
+        Terrain::optimizeVertexCache(&indices.front(), indices.size(), verts*verts);
+}
 
-    std::vector<IndexType> indices;
+// Triangles for the grid of cells, leaving out the outermost ring if inset is set
+template<typename IndexType>
+osg::DrawElements *createGrid(unsigned int verts, bool inset, bool optimize)
+{
+    typedef typename ArrayType<IndexType>::type DrawElementsType;
+    osg::ref_ptr<DrawElementsType> drawElements = new DrawElementsType(osg::PrimitiveSet::TRIANGLES);
+    DrawElementsType &indices = *drawElements;
     indices.reserve((verts-1) * (verts-1) * 2 * 3);
 
     size_t rowStart = 0, colStart = 0, rowEnd = verts-1, colEnd = verts-1;
     // If any edge needs stitching we'll skip all edges at this point,
     // mainly because stitching one edge would have an effect on corners and on the adjacent edges
-    if (anyDeltas)
+    if (inset)
     {
         ++colStart;
         --colEnd;
@@ -64,111 +74,122 @@ osg::PrimitiveSet *createIndexBuffer(unsigned int flags, unsigned int verts)
         }
     }
 
-    if (anyDeltas)
-    {
-        // Now configure LOD transitions at the edges - this is pretty tedious,
-        // and some very long and boring code, but it works great
+    if(optimize)
+        optimizeIndices(indices, verts);
+    return drawElements.release();
+}
 
-        // South
-        size_t row = 0;
-        size_t outerStep = 1 << lodDeltas[Terrain::South];
-        for (size_t col = 0; col < verts-1; col += outerStep)
+// Triangles for the outermost ring of cells, stitched to neighbours with the given LOD deltas
+template<typename IndexType>
+osg::DrawElements *createEdges(const unsigned int *lodDeltas, unsigned int verts, bool optimize)
+{
+    typedef typename ArrayType<IndexType>::type DrawElementsType;
+    osg::ref_ptr<DrawElementsType> drawElements = new DrawElementsType(osg::PrimitiveSet::TRIANGLES);
+    DrawElementsType &indices = *drawElements;
+    indices.reserve((verts-1) * 4 * 2 * 3);
+
+    // Now configure LOD transitions at the edges - this is pretty tedious,
+    // and some very long and boring code, but it works great
+
+    // South
+    size_t row = 0;
+    size_t outerStep = 1 << lodDeltas[Terrain::South];
+    for (size_t col = 0; col < verts-1; col += outerStep)
+    {
+        indices.push_back(verts*col+row);
+        indices.push_back(verts*(col+outerStep)+row);
+        // Make sure not to touch the right edge
+        if (col+outerStep == verts-1)
+            indices.push_back(verts*(col+outerStep-1) + row+1);
+        else
+            indices.push_back(verts*(col+outerStep)   + row+1);
+
+        for (size_t i = 0; i < outerStep; ++i)
         {
-            indices.push_back(verts*col+row);
-            indices.push_back(verts*(col+outerStep)+row);
-            // Make sure not to touch the right edge
-            if (col+outerStep == verts-1)
-                indices.push_back(verts*(col+outerStep-1) + row+1);
-            else
-                indices.push_back(verts*(col+outerStep)   + row+1);
-
-            for (size_t i = 0; i < outerStep; ++i)
-            {
-                // Make sure not to touch the left or right edges
-                if (col+i == 0 || col+i == verts-1-1)
-                    continue;
-                indices.push_back(verts*(col)     + row);
-                indices.push_back(verts*(col+i+1) + row+1);
-                indices.push_back(verts*(col+i)   + row+1);
-            }
+            // Make sure not to touch the left or right edges
+            if (col+i == 0 || col+i == verts-1-1)
+                continue;
+            indices.push_back(verts*(col)     + row);
+            indices.push_back(verts*(col+i+1) + row+1);
+            indices.push_back(verts*(col+i)   + row+1);
         }
+    }
 
-        // North
-        row = verts-1;
-        outerStep = 1 << lodDeltas[Terrain::North];
-        for (size_t col = 0; col < verts-1; col += outerStep)
+    // North
+    row = verts-1;
+    outerStep = 1 << lodDeltas[Terrain::North];
+    for (size_t col = 0; col < verts-1; col += outerStep)
+    {
+        indices.push_back(verts*(col+outerStep) + row);
+        indices.push_back(verts* col            + row);
+        // Make sure not to touch the left edge
+        if (col == 0)
+            indices.push_back(verts*(col+1) + row-1);
+        else
+            indices.push_back(verts*(col)   + row-1);
+
+        for (size_t i = 0; i < outerStep; ++i)
         {
+            // Make sure not to touch the left or right edges
+            if (col+i == 0 || col+i == verts-1-1)
+                continue;
+            indices.push_back(verts*(col+i)         + row-1);
+            indices.push_back(verts*(col+i+1)       + row-1);
             indices.push_back(verts*(col+outerStep) + row);
-            indices.push_back(verts* col            + row);
-            // Make sure not to touch the left edge
-            if (col == 0)
-                indices.push_back(verts*(col+1) + row-1);
-            else
-                indices.push_back(verts*(col)   + row-1);
-
-            for (size_t i = 0; i < outerStep; ++i)
-            {
-                // Make sure not to touch the left or right edges
-                if (col+i == 0 || col+i == verts-1-1)
-                    continue;
-                indices.push_back(verts*(col+i)         + row-1);
-                indices.push_back(verts*(col+i+1)       + row-1);
-                indices.push_back(verts*(col+outerStep) + row);
-            }
         }
+    }
 
-        // West
-        size_t col = 0;
-        outerStep = 1 << lodDeltas[Terrain::West];
-        for (size_t row = 0; row < verts-1; row += outerStep)
+    // West
+    size_t col = 0;
+    outerStep = 1 << lodDeltas[Terrain::West];
+    for (size_t row = 0; row < verts-1; row += outerStep)
+    {
+        indices.push_back(verts*col + row+outerStep);
+        indices.push_back(verts*col + row);
+        // Make sure not to touch the top edge
+        if (row+outerStep == verts-1)
+            indices.push_back(verts*(col+1) + row+outerStep-1);
+        else
+            indices.push_back(verts*(col+1) + row+outerStep);
+
+        for (size_t i = 0; i < outerStep; ++i)
         {
-            indices.push_back(verts*col + row+outerStep);
-            indices.push_back(verts*col + row);
-            // Make sure not to touch the top edge
-            if (row+outerStep == verts-1)
-                indices.push_back(verts*(col+1) + row+outerStep-1);
-            else
-                indices.push_back(verts*(col+1) + row+outerStep);
-
-            for (size_t i = 0; i < outerStep; ++i)
-            {
-                // Make sure not to touch the top or bottom edges
-                if (row+i == 0 || row+i == verts-1-1)
-                    continue;
-                indices.push_back(verts* col    + row);
-                indices.push_back(verts*(col+1) + row+i);
-                indices.push_back(verts*(col+1) + row+i+1);
-            }
+            // Make sure not to touch the top or bottom edges
+            if (row+i == 0 || row+i == verts-1-1)
+                continue;
+            indices.push_back(verts* col    + row);
+            indices.push_back(verts*(col+1) + row+i);
+            indices.push_back(verts*(col+1) + row+i+1);
         }
+    }
 
-        // East
-        col = verts-1;
-        outerStep = 1 << lodDeltas[Terrain::East];
-        for (size_t row = 0; row < verts-1; row += outerStep)
+    // East
+    col = verts-1;
+    outerStep = 1 << lodDeltas[Terrain::East];
+    for (size_t row = 0; row < verts-1; row += outerStep)
+    {
+        indices.push_back(verts*col + row);
+        indices.push_back(verts*col + row+outerStep);
+        // Make sure not to touch the bottom edge
+        if (row == 0)
+            indices.push_back(verts*(col-1) + row+1);
+        else
+            indices.push_back(verts*(col-1) + row);
+
+        for (size_t i = 0; i < outerStep; ++i)
         {
-            indices.push_back(verts*col + row);
-            indices.push_back(verts*col + row+outerStep);
-            // Make sure not to touch the bottom edge
-            if (row == 0)
-                indices.push_back(verts*(col-1) + row+1);
-            else
-                indices.push_back(verts*(col-1) + row);
-
-            for (size_t i = 0; i < outerStep; ++i)
-            {
-                // Make sure not to touch the top or bottom edges
-                if (row+i == 0 || row+i == verts-1-1)
-                    continue;
-                indices.push_back(verts* col    + row+outerStep);
-                indices.push_back(verts*(col-1) + row+i+1);
-                indices.push_back(verts*(col-1) + row+i);
-            }
+            // Make sure not to touch the top or bottom edges
+            if (row+i == 0 || row+i == verts-1-1)
+                continue;
+            indices.push_back(verts* col    + row+outerStep);
+            indices.push_back(verts*(col-1) + row+i+1);
+            indices.push_back(verts*(col-1) + row+i);
         }
     }
 
-    return new typename ArrayType<IndexType>::type(
-        osg::PrimitiveSet::TRIANGLES, indices.size(), indices.data()
-    );
+    if(optimize)
+        optimizeIndices(indices, verts);
+    return drawElements.release();
 }
 
 }
@@ -176,14 +197,83 @@ osg::PrimitiveSet *createIndexBuffer(unsigned int flags, unsigned int verts)
 namespace Terrain
 {
 
-std::map<unsigned int,osg::ref_ptr<osg::PrimitiveSet>> BufferCache::mPrimitiveMap;
 std::map<unsigned int,osg::ref_ptr<osg::Vec2Array>> BufferCache::mUvBuffers;
 
 
+BufferCache::BufferCache(unsigned int numVerts, bool optimizeOrder)
+  : mNumVerts(numVerts)
+  , mOptimizeOrder(optimizeOrder)
+  , mMaxLodDelta(0)
+  , mNumIndices(0)
+{
+    // A neighbour more than this many LODs coarser has no vertices along our
+    // edge besides the corners, so larger deltas stitch the same way
+    while((2u<<mMaxLodDelta) <= mNumVerts-1)
+        ++mMaxLodDelta;
+
+    if(mNumVerts > 255)
+        createPrimitives<GLuint>();
+    else
+        createPrimitives<GLushort>();
+}
+
 BufferCache::~BufferCache()
 {
 }
 
+template<typename IndexType>
+void BufferCache::createPrimitives()
+{
+    const unsigned int base = mMaxLodDelta+1;
+    const size_t numPermutations = base*base*base*base;
+
+    // The edges are what differs between permutations, and there are quite a
+    // few of them, so spread the work over all cores
+    std::vector<osg::ref_ptr<osg::DrawElements>> edges(numPermutations);
+    std::atomic<size_t> next(1);
+    auto worker = [&]()
+    {
+        size_t perm;
+        while((perm=next++) < numPermutations)
+        {
+            // One digit per edge, in base mMaxLodDelta+1
+            unsigned int lodDeltas[4];
+            size_t digits = perm;
+            for(int i = 0;i < 4;++i)
+            {
+                lodDeltas[i] = digits % base;
+                digits /= base;
+            }
+            edges[perm] = createEdges<IndexType>(lodDeltas, mNumVerts, mOptimizeOrder);
+        }
+    };
+    unsigned int numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    std::vector<std::thread> threads;
+    for(unsigned int i = 1;i < numThreads;++i)
+        threads.push_back(std::thread(worker));
+    worker();
+    for(std::thread &thrd : threads)
+        thrd.join();
+
+    // Put everything into one element buffer, each primitive being a range in it
+    mElementBuffer = new osg::ElementBufferObject();
+    osg::ref_ptr<osg::DrawElements> fullGrid = createGrid<IndexType>(mNumVerts, false, mOptimizeOrder);
+    osg::ref_ptr<osg::DrawElements> interior = createGrid<IndexType>(mNumVerts, true, mOptimizeOrder);
+    fullGrid->setElementBufferObject(mElementBuffer.get());
+    interior->setElementBufferObject(mElementBuffer.get());
+    mNumIndices = fullGrid->getNumIndices() + interior->getNumIndices();
+
+    mPermutations.resize(numPermutations);
+    mPermutations[0].mInterior = fullGrid.get();
+    for(size_t perm = 1;perm < numPermutations;++perm)
+    {
+        edges[perm]->setElementBufferObject(mElementBuffer.get());
+        mNumIndices += edges[perm]->getNumIndices();
+        mPermutations[perm].mInterior = interior.get();
+        mPermutations[perm].mEdges = edges[perm].get();
+    }
+}
+
 osg::Vec2Array *BufferCache::getUVBuffer()
 {
     osg::ref_ptr<osg::Vec2Array> &buffer = mUvBuffers[mNumVerts];
@@ -207,19 +297,18 @@ osg::Vec2Array *BufferCache::getUVBuffer()
     return buffer.get();
 }
 
-osg::PrimitiveSet *BufferCache::getPrimitive(unsigned int flags)
+const BufferCache::Primitives &BufferCache::getPrimitives(unsigned int flags) const
 {
-    unsigned int verts = mNumVerts;
-
-    osg::ref_ptr<osg::PrimitiveSet> &prim = mPrimitiveMap[flags];
-    if(prim.valid()) return prim.get();
-
-    if(verts > 255)
-        prim = createIndexBuffer<unsigned int>((flags&0xffff), verts);
-    else
-        prim = createIndexBuffer<unsigned short>((flags&0xffff), verts);
+    const unsigned int base = mMaxLodDelta+1;
+    size_t perm = 0;
+    for(int i = 3;i >= 0;--i)
+        perm = perm*base + std::min((flags >> (4*i)) & 0xf, mMaxLodDelta);
+    return mPermutations[perm];
+}
 
-    return prim.get();
+size_t BufferCache::getIndexBufferSize() const
+{
+    return mNumIndices * ((mNumVerts > 255) ? sizeof(GLuint) : sizeof(GLushort));
 }
 
 }
@@ -2,14 +2,12 @@
 #define COMPONENTS_TERRAIN_BUFFERCACHE_H
 
 #include <map>
+#include <vector>
 
 #include <osg/ref_ptr>
 #include <osg/Array>
-
-namespace osg
-{
-    class PrimitiveSet;
-}
+#include <osg/PrimitiveSet>
+#include <osg/BufferObject>
 
 namespace Terrain
 {
@@ -18,25 +16,51 @@ namespace Terrain
 class BufferCache
 {
 public:
-    BufferCache(unsigned int numVerts) : mNumVerts(numVerts) {}
+    /// The index ranges to draw a chunk with. They all live in one shared element buffer.
+    struct Primitives
+    {
+        /// The whole grid, or without the outermost ring of cells if mEdges is set
+        osg::ref_ptr<osg::PrimitiveSet> mInterior;
+        /// The outermost ring of cells stitched to coarser neighbours, or null if no edge needs it
+        osg::ref_ptr<osg::PrimitiveSet> mEdges;
+    };
+
+    /// Creates the index ranges for every combination of LOD deltas up front, on all cores.
+    /// @param optimizeOrder Reorder triangles for the post-transform vertex cache. Only worth
+    ///                      turning off to measure the difference.
+    BufferCache(unsigned int numVerts, bool optimizeOrder=true);
     ~BufferCache();
 
-    /// @param flags first 4*4 bits are LOD deltas on each edge, respectively
-    ///              (4 bits each) next 4 bits are LOD level of the index
-    ///              buffer (LOD 0 = don't omit any vertices)
-    osg::PrimitiveSet *getPrimitive(unsigned int flags);
+    /// @param flags 4*4 bits are LOD deltas on each edge, respectively (4 bits each).
+    ///              Deltas the grid can't resolve anymore are clamped.
+    const Primitives &getPrimitives(unsigned int flags) const;
+
+    /// Largest LOD delta with its own stitching, larger ones being clamped to it
+    unsigned int getMaxLodDelta() const { return mMaxLodDelta; }
+
+    /// Size of the shared element buffer, in bytes
+    size_t getIndexBufferSize() const;
 
     osg::Vec2Array *getUVBuffer();
 
 private:
-    // Primitives are shared across terrain batches where possible. There is
-    // one primitive for each combination of LOD deltas and index buffer LOD we
-    // may need.
-    static std::map<unsigned int,osg::ref_ptr<osg::PrimitiveSet>> mPrimitiveMap;
+    template<typename IndexType>
+    void createPrimitives();
+
+    // Every primitive is a range in this buffer, so switching the stitching
+    // of a chunk doesn't need any new buffer objects.
+    osg::ref_ptr<osg::ElementBufferObject> mElementBuffer;
+
+    // One entry for each combination of LOD deltas, each edge being a digit
+    // in base mMaxLodDelta+1
+    std::vector<Primitives> mPermutations;
 
     static std::map<unsigned int,osg::ref_ptr<osg::Vec2Array>> mUvBuffers;
 
     unsigned int mNumVerts;
+    bool mOptimizeOrder;
+    unsigned int mMaxLodDelta;
+    size_t mNumIndices;
 };
 
 }
@@ -0,0 +1,101 @@
+#include "compositemappool.hpp"
+
+#include <cassert>
+
+#include <osg/Texture2DArray>
+
+namespace
+{
+
+osg::Texture2DArray *createPages(int size, unsigned int count)
+{
+    // Allocated empty when first used. Mipmaps are generated after rendering.
+    osg::Texture2DArray *pages = new osg::Texture2DArray();
+    pages->setTextureSize(size, size, count);
+    pages->setSourceFormat(GL_RGBA);
+    pages->setSourceType(GL_UNSIGNED_BYTE);
+    pages->setInternalFormat(GL_RGBA8);
+    pages->setWrap(osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE);
+    pages->setWrap(osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE);
+    pages->setFilter(osg::Texture::MIN_FILTER, osg::Texture::LINEAR_MIPMAP_LINEAR);
+    pages->setFilter(osg::Texture::MAG_FILTER, osg::Texture::LINEAR);
+    return pages;
+}
+
+}
+
+namespace Terrain
+{
+
+CompositeMapPool::CompositeMapPool(int pageSize, unsigned int numPages)
+  : mPageSize(pageSize)
+  , mPages(numPages)
+  , mCompositePages(createPages(pageSize, numPages))
+  , mNormalPages(createPages(pageSize, numPages))
+  , mNumReused(0)
+{
+    for(unsigned int i = 0;i < numPages;++i)
+    {
+        mPages[i].mCode = 0;
+        mPages[i].mLeased = false;
+        mPages[i].mValid = false;
+        mPages[i].mFreeIter = mFree.insert(mFree.end(), i);
+    }
+}
+
+CompositeMapPool::~CompositeMapPool()
+{
+    assert(getNumLeased() == 0 && "Composite map pages still leased when destroying their pool");
+}
+
+int CompositeMapPool::acquire(LocationCode code, bool &valid)
+{
+    auto iter = mPageTable.find(code);
+    if(iter != mPageTable.end())
+    {
+        Page &page = mPages[iter->second];
+        assert(!page.mLeased && "Composite map page leased twice for the same node");
+        mFree.erase(page.mFreeIter);
+        page.mLeased = true;
+        valid = page.mValid;
+        if(valid)
+            ++mNumReused;
+        return iter->second;
+    }
+
+    if(mFree.empty())
+        return -1;
+
+    int index = mFree.front();
+    mFree.pop_front();
+    Page &page = mPages[index];
+    if(page.mCode != 0)
+        mPageTable.erase(page.mCode);
+    page.mCode = code;
+    page.mLeased = true;
+    page.mValid = false;
+    mPageTable[code] = index;
+
+    valid = false;
+    return index;
+}
+
+void CompositeMapPool::release(int index)
+{
+    Page &page = mPages[index];
+    assert(page.mLeased);
+    page.mLeased = false;
+    page.mFreeIter = mFree.insert(mFree.end(), index);
+}
+
+bool CompositeMapPool::isLeasedTo(int index, LocationCode code) const
+{
+    return mPages[index].mLeased && mPages[index].mCode == code;
+}
+
+void CompositeMapPool::setValid(int index)
+{
+    mPages[index].mValid = true;
+}
+
+}
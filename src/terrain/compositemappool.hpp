@@ -0,0 +1,83 @@
+#ifndef COMPONENTS_TERRAIN_COMPOSITEMAPPOOL_H
+#define COMPONENTS_TERRAIN_COMPOSITEMAPPOOL_H
+
+#include <list>
+#include <map>
+#include <vector>
+
+#include <osg/ref_ptr>
+
+#include "linearquadtree.hpp"
+
+namespace osg
+{
+    class Texture2DArray;
+}
+
+namespace Terrain
+{
+
+    /**
+     * @brief A fixed number of composite map pages, the layers of one texture array for the
+     *        composite maps and one for their normal maps, leased to the nodes that need one.
+     *        The page table maps nodes to the pages holding their composite maps. Released
+     *        pages keep their contents until they're recycled for another node, so a node
+     *        that comes back shortly gets its old page without rendering it again.
+     *        Only to be used from the main thread.
+     */
+    class CompositeMapPool
+    {
+    public:
+        /// @param pageSize size of a composite map along one side, in pixels
+        /// @param numPages number of composite maps there is room for
+        CompositeMapPool(int pageSize, unsigned int numPages);
+        ~CompositeMapPool();
+
+        int getPageSize() const { return mPageSize; }
+        size_t getNumPages() const { return mPages.size(); }
+
+        osg::Texture2DArray *getCompositePages() const { return mCompositePages.get(); }
+        osg::Texture2DArray *getNormalPages() const { return mNormalPages.get(); }
+
+        /// Lease a page for the composite map of a node, recycling the least recently
+        /// released page if that node has none.
+        /// @param valid set to whether the page already holds the node's composite map
+        /// @return the page, or -1 if all of them are leased
+        int acquire(LocationCode code, bool &valid);
+        /// Give back a page. Its contents stay valid until it's recycled.
+        void release(int page);
+
+        /// Check if a page is still leased for this node
+        bool isLeasedTo(int page, LocationCode code) const;
+        /// Mark a page as holding its node's composite map
+        void setValid(int page);
+
+        size_t getNumLeased() const { return mPages.size() - mFree.size(); }
+        /// Number of times a node got its old page back
+        size_t getNumReused() const { return mNumReused; }
+
+    private:
+        struct Page
+        {
+            /// Node this page was last leased for, 0 if none
+            LocationCode mCode;
+            bool mLeased;
+            bool mValid;
+            std::list<int>::iterator mFreeIter;
+        };
+
+        int mPageSize;
+        std::vector<Page> mPages;
+        /// Pages not leased, least recently released first
+        std::list<int> mFree;
+        std::map<LocationCode,int> mPageTable;
+
+        osg::ref_ptr<osg::Texture2DArray> mCompositePages;
+        osg::ref_ptr<osg::Texture2DArray> mNormalPages;
+
+        size_t mNumReused;
+    };
+
+}
+
+#endif
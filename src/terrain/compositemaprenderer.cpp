@@ -0,0 +1,264 @@
+#include "compositemaprenderer.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include <osg/Camera>
+#include <osg/Geode>
+#include <osg/Group>
+#include <osg/Image>
+#include <osg/Texture2D>
+#include <osg/Texture2DArray>
+#include <osg/Viewport>
+#include <osg/FrameBufferObject>
+
+#include "compositemappool.hpp"
+
+namespace
+{
+
+// Keeps the atlas within what any GL 3 implementation supports
+const int MaxAtlasSize = 4096;
+
+class CopyTilesCallback : public osg::Camera::DrawCallback
+{
+public:
+    struct Copy
+    {
+        int mPage;
+        int mX, mY;
+        // Null unless the tile is read back
+        osg::ref_ptr<osg::Image> mComposite;
+        osg::ref_ptr<osg::Image> mNormal;
+    };
+
+    CopyTilesCallback(Terrain::CompositeMapRenderer *renderer, Terrain::CompositeMapPool *pool)
+      : mRenderer(renderer)
+      , mCompositePages(pool->getCompositePages())
+      , mNormalPages(pool->getNormalPages())
+      , mTileSize(pool->getPageSize())
+    { }
+
+    void addCopy(int page, int x, int y, osg::Image *composite, osg::Image *normal)
+    {
+        mCopies.push_back(Copy{page, x, y, composite, normal});
+    }
+
+    virtual void operator()(osg::RenderInfo &info) const
+    {
+        // The atlas is still bound, so the tiles can be copied straight out of it
+        osg::State &state = *info.getState();
+        // Nothing else applies the pages before they're first drawn with, and there's
+        // nothing to copy into until their storage is allocated
+        if(!mCompositePages->getTextureObject(state.getContextID()))
+            mCompositePages->apply(state);
+        if(!mNormalPages->getTextureObject(state.getContextID()))
+            mNormalPages->apply(state);
+
+        glReadBuffer(GL_COLOR_ATTACHMENT0_EXT);
+        for(const Copy &copy : mCopies)
+        {
+            mCompositePages->copyTexSubImage2DArray(state, 0, 0, copy.mPage, copy.mX, copy.mY, mTileSize, mTileSize);
+            if(copy.mComposite.valid())
+                glReadPixels(copy.mX, copy.mY, mTileSize, mTileSize, GL_RGBA, GL_UNSIGNED_BYTE, copy.mComposite->data());
+        }
+        mCompositePages->generateMipmap(state);
+        glReadBuffer(GL_COLOR_ATTACHMENT1_EXT);
+        for(const Copy &copy : mCopies)
+        {
+            mNormalPages->copyTexSubImage2DArray(state, 0, 0, copy.mPage, copy.mX, copy.mY, mTileSize, mTileSize);
+            if(copy.mNormal.valid())
+                glReadPixels(copy.mX, copy.mY, mTileSize, mTileSize, GL_RGBA, GL_UNSIGNED_BYTE, copy.mNormal->data());
+        }
+        mNormalPages->generateMipmap(state);
+        // The copies bound the pages behind the state's back
+        state.haveAppliedTextureAttribute(state.getActiveTextureUnit(), mNormalPages.get());
+
+        mRenderer->setPassRan();
+    }
+
+private:
+    Terrain::CompositeMapRenderer *mRenderer;
+    // Kept alive in case the pool is replaced before this runs
+    osg::ref_ptr<osg::Texture2DArray> mCompositePages;
+    osg::ref_ptr<osg::Texture2DArray> mNormalPages;
+    int mTileSize;
+    std::vector<Copy> mCopies;
+};
+
+osg::Image *createReadBackImage(int size)
+{
+    osg::Image *image = new osg::Image();
+    image->allocateImage(size, size, 1, GL_RGBA, GL_UNSIGNED_BYTE);
+    return image;
+}
+
+osg::Texture2D *createAtlas(int size)
+{
+    osg::Texture2D *atlas = new osg::Texture2D();
+    atlas->setTextureSize(size, size);
+    atlas->setSourceFormat(GL_RGBA);
+    atlas->setSourceType(GL_UNSIGNED_BYTE);
+    atlas->setInternalFormat(GL_RGBA8);
+    atlas->setFilter(osg::Texture::MIN_FILTER, osg::Texture::NEAREST);
+    atlas->setFilter(osg::Texture::MAG_FILTER, osg::Texture::NEAREST);
+    return atlas;
+}
+
+}
+
+namespace Terrain
+{
+
+CompositeMapRenderer::CompositeMapRenderer(osg::Group *parent)
+  : mParent(parent)
+  , mPool(nullptr)
+  , mTileSize(128)
+  , mBudget(16)
+  , mTilesPerSide(0)
+  , mPassRan(false)
+  , mNumRendered(0)
+  , mNumPasses(0)
+{
+}
+
+CompositeMapRenderer::~CompositeMapRenderer()
+{
+    if(mCamera.valid())
+        mParent->removeChild(mCamera.get());
+}
+
+void CompositeMapRenderer::setPool(CompositeMapPool *pool)
+{
+    mPool = pool;
+    mTileSize = pool->getPageSize();
+    mPending.clear();
+    // A pass still waiting to be drawn copies into the old pool's pages. Let it.
+    for(Tile &tile : mRendering)
+        tile.mPage = -1;
+}
+
+void CompositeMapRenderer::setBudget(unsigned int tiles)
+{
+    mBudget = std::max(tiles, 1u);
+}
+
+void CompositeMapRenderer::add(int page, LocationCode code, osg::Geode *geode, bool readBack)
+{
+    mPending.push_back(Tile{page, code, geode, readBack, nullptr, nullptr});
+}
+
+bool CompositeMapRenderer::isPending(int page, LocationCode code) const
+{
+    for(const Tile &tile : mRendering)
+    {
+        if(tile.mPage == page && tile.mCode == code)
+            return true;
+    }
+    for(const Tile &tile : mPending)
+    {
+        if(tile.mPage == page && tile.mCode == code)
+            return true;
+    }
+    return false;
+}
+
+void CompositeMapRenderer::createCamera(int tilesPerSide)
+{
+    if(mCamera.valid())
+        mParent->removeChild(mCamera.get());
+
+    mTilesPerSide = tilesPerSide;
+    const int size = mTilesPerSide * mTileSize;
+    mAtlas = createAtlas(size);
+    mNormalAtlas = createAtlas(size);
+
+    mCamera = new osg::Camera();
+    mCamera->setClearMask(GL_NONE);
+
+    mCamera->setReferenceFrame(osg::Transform::ABSOLUTE_RF);
+    mCamera->setProjectionResizePolicy(osg::Camera::FIXED);
+    mCamera->setProjectionMatrix(osg::Matrixd::identity());
+    mCamera->setViewMatrix(osg::Matrixd::identity());
+    mCamera->setViewport(0, 0, size, size);
+
+    mCamera->setRenderOrder(osg::Camera::PRE_RENDER);
+
+    mCamera->setRenderTargetImplementation(osg::Camera::FRAME_BUFFER_OBJECT);
+    mCamera->attach(osg::Camera::COLOR_BUFFER0, mAtlas.get());
+    mCamera->attach(osg::Camera::COLOR_BUFFER1, mNormalAtlas.get());
+
+    mCamera->setNodeMask(0);
+    mParent->addChild(mCamera.get());
+}
+
+void CompositeMapRenderer::update()
+{
+    // Acquire, so the read-back images are complete before they're handed out
+    if(mPassRan.exchange(false, std::memory_order_acquire))
+    {
+        mNumRendered += mRendering.size();
+        ++mNumPasses;
+        for(const Tile &tile : mRendering)
+        {
+            if(tile.mReadBack)
+                mReadBacks.push_back(ReadBack{tile.mCode, tile.mComposite, tile.mNormal});
+        }
+        mRendering.clear();
+        mCamera->removeChildren(0, mCamera->getNumChildren());
+        mCamera->setNodeMask(0);
+    }
+    // Still waiting for the last pass to be drawn
+    if(!mRendering.empty() || mPending.empty())
+        return;
+
+    // Enough room for the budget, in a square atlas
+    int tilesPerSide = int(std::ceil(std::sqrt(float(mBudget))));
+    tilesPerSide = std::max(std::min(tilesPerSide, MaxAtlasSize/mTileSize), 1);
+    if(!mCamera.valid() || tilesPerSide != mTilesPerSide ||
+       mAtlas->getTextureWidth() != tilesPerSide*mTileSize)
+        createCamera(tilesPerSide);
+
+    const size_t maxTiles = std::min<size_t>(mBudget, mTilesPerSide*mTilesPerSide);
+    osg::ref_ptr<CopyTilesCallback> callback = new CopyTilesCallback(this, mPool);
+    while(!mPending.empty() && mRendering.size() < maxTiles)
+    {
+        Tile tile = mPending.front();
+        mPending.pop_front();
+        // The node doesn't need it anymore, and the page may belong to another one by now
+        if(!mPool->isLeasedTo(tile.mPage, tile.mCode))
+            continue;
+
+        const int index = int(mRendering.size());
+        const int x = (index % mTilesPerSide) * mTileSize;
+        const int y = (index / mTilesPerSide) * mTileSize;
+
+        osg::ref_ptr<osg::Group> group = new osg::Group();
+        group->getOrCreateStateSet()->setAttribute(new osg::Viewport(x, y, mTileSize, mTileSize));
+        group->addChild(tile.mGeode.get());
+        mCamera->addChild(group.get());
+
+        if(tile.mReadBack)
+        {
+            tile.mComposite = createReadBackImage(mTileSize);
+            tile.mNormal = createReadBackImage(mTileSize);
+        }
+        callback->addCopy(tile.mPage, x, y, tile.mComposite.get(), tile.mNormal.get());
+        mRendering.push_back(tile);
+        // The pass runs before anything is drawn with the page this frame
+        mPool->setValid(tile.mPage);
+    }
+    if(mRendering.empty())
+        return;
+
+    mCamera->setPostDrawCallback(callback.get());
+    mCamera->setNodeMask(~0u);
+}
+
+void CompositeMapRenderer::takeReadBacks(std::vector<ReadBack> &maps)
+{
+    maps.insert(maps.end(), mReadBacks.begin(), mReadBacks.end());
+    mReadBacks.clear();
+}
+
+}
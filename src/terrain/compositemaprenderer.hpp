@@ -0,0 +1,119 @@
+#ifndef COMPONENTS_TERRAIN_COMPOSITEMAPRENDERER_H
+#define COMPONENTS_TERRAIN_COMPOSITEMAPRENDERER_H
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+#include <osg/ref_ptr>
+
+#include "linearquadtree.hpp"
+
+namespace osg
+{
+    class Group;
+    class Camera;
+    class Geode;
+    class Image;
+    class Texture2D;
+}
+
+namespace Terrain
+{
+
+    class CompositeMapPool;
+
+    /**
+     * @brief Renders the composite maps requested during a frame in one pass. Pending
+     *        composite maps are drawn into the tiles of a shared atlas by a single camera,
+     *        then copied out to their pages while the atlas is still bound, and read back
+     *        if asked to. At most a budget of tiles is rendered per frame, the rest waits
+     *        for later frames.
+     */
+    class CompositeMapRenderer
+    {
+    public:
+        /// A composite map and its normal map read back after rendering, RGBA8 with
+        /// the bottom row first
+        struct ReadBack
+        {
+            LocationCode mCode;
+            osg::ref_ptr<osg::Image> mComposite;
+            osg::ref_ptr<osg::Image> mNormal;
+        };
+
+        /// @param parent group to attach the camera to, for setting up state
+        CompositeMapRenderer(osg::Group *parent);
+        ~CompositeMapRenderer();
+
+        /// Set the pool to render into, dropping anything queued for the previous one.
+        void setPool(CompositeMapPool *pool);
+
+        /// Maximum number of composite maps to render in one frame
+        void setBudget(unsigned int tiles);
+
+        /// Queue rendering a composite map and its normal map into a page leased for a node.
+        /// The geode's quads cover the whole map with normalized device coordinates.
+        /// @param readBack also read the maps back to the CPU, see takeReadBacks
+        void add(int page, LocationCode code, osg::Geode *geode, bool readBack=false);
+
+        /// Check if a page is waiting to be rendered for this node, or being rendered right now.
+        /// Tiles queued for a page's previous owner don't count.
+        bool isPending(int page, LocationCode code) const;
+
+        /// Set up the pass for the next frame, once the last one has been drawn. Call every frame.
+        void update();
+
+        /// Move the maps read back by the passes drawn so far into \a maps
+        void takeReadBacks(std::vector<ReadBack> &maps);
+
+        size_t getNumPending() const { return mPending.size() + mRendering.size(); }
+        size_t getNumRendered() const { return mNumRendered; }
+        size_t getNumPasses() const { return mNumPasses; }
+
+        /// ----INTERNAL----
+        /// Called from the draw thread after the pass ran. Publishes the pixels it read back
+        /// to the update thread.
+        void setPassRan() { mPassRan.store(true, std::memory_order_release); }
+
+    private:
+        struct Tile
+        {
+            int mPage;
+            LocationCode mCode;
+            osg::ref_ptr<osg::Geode> mGeode;
+            bool mReadBack;
+            /// Where the maps are read back to, allocated once the tile is in a pass
+            osg::ref_ptr<osg::Image> mComposite;
+            osg::ref_ptr<osg::Image> mNormal;
+        };
+
+        void createCamera(int tilesPerSide);
+
+        osg::ref_ptr<osg::Group> mParent;
+        CompositeMapPool *mPool;
+        osg::ref_ptr<osg::Camera> mCamera;
+        osg::ref_ptr<osg::Texture2D> mAtlas;
+        osg::ref_ptr<osg::Texture2D> mNormalAtlas;
+
+        int mTileSize;
+        unsigned int mBudget;
+        /// Tiles along a side of the atlas
+        int mTilesPerSide;
+
+        std::deque<Tile> mPending;
+        /// Tiles in the pass that's currently set up
+        std::vector<Tile> mRendering;
+        /// Set by the draw thread, which may run alongside update() depending on the
+        /// viewer's threading model
+        std::atomic<bool> mPassRan;
+        std::vector<ReadBack> mReadBacks;
+
+        size_t mNumRendered;
+        size_t mNumPasses;
+    };
+
+}
+
+#endif
@@ -0,0 +1,320 @@
+#include "compositemapstore.hpp"
+
+#include <cstring>
+#include <cerrno>
+#include <sstream>
+#include <vector>
+
+#include <zlib.h>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+
+const char sMagic[8] = { 'T', 'K', 'C', 'O', 'M', 'P', 'S', '\0' };
+const char sRecordMagic[4] = { 'T', 'K', 'C', 'M' };
+
+// Anything bigger is taken for a damaged record
+const uint32_t sMaxPageSize = 8192;
+
+}
+
+namespace Terrain
+{
+
+struct CompositeMapStore::Header
+{
+    char mMagic[8];
+    uint32_t mVersion;
+    uint32_t mReserved;
+    uint64_t mHash;
+};
+
+struct CompositeMapStore::Record
+{
+    // Marks the start of each record, to catch a damaged file
+    char mMagic[4];
+    uint32_t mPageSize;
+    uint64_t mCode;
+    uint64_t mConfigHash;
+    // Compressed sizes, the data following in this order
+    uint32_t mCompositeBytes;
+    uint32_t mNormalBytes;
+};
+
+
+CompositeMapStore::CompositeMapStore()
+  : mFile(-1)
+  , mSize(0)
+  , mHits(0)
+  , mMisses(0)
+{
+}
+
+CompositeMapStore::~CompositeMapStore()
+{
+    close();
+}
+
+bool CompositeMapStore::contains(LocationCode code, uint64_t configHash, int pageSize) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mIndex.find(Key(code, configHash, uint32_t(pageSize))) != mIndex.end();
+}
+
+size_t CompositeMapStore::getNumMaps() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mIndex.size();
+}
+
+size_t CompositeMapStore::getSize() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mSize;
+}
+
+#ifndef _WIN32
+
+bool CompositeMapStore::create(const std::string &path, uint64_t hash, std::string &error)
+{
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.mMagic, sMagic, sizeof(header.mMagic));
+    header.mVersion = sVersion;
+    header.mHash = hash;
+
+    // Build it on the side and move it into place, so other processes that
+    // still have an old file open aren't disturbed.
+    std::stringstream sstr;
+    sstr<< path<<".tmp"<<getpid();
+    const std::string tmpname = sstr.str();
+
+    int fd = ::open(tmpname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+    {
+        error = "Failed to create "+tmpname+": "+strerror(errno);
+        return false;
+    }
+    bool ok = (pwrite(fd, &header, sizeof(header), 0) == ssize_t(sizeof(header)));
+    if(!ok)
+        error = "Failed to write "+tmpname+": "+strerror(errno);
+    ::close(fd);
+
+    if(ok && rename(tmpname.c_str(), path.c_str()) != 0)
+    {
+        error = "Failed to rename "+tmpname+" to "+path+": "+strerror(errno);
+        ok = false;
+    }
+    if(!ok)
+        unlink(tmpname.c_str());
+    return ok;
+}
+
+bool CompositeMapStore::open(const std::string &path, uint64_t hash, std::string &error)
+{
+    close();
+
+    // If the existing file is unusable, replace it and try once more
+    for(int attempt = 0;attempt < 2;++attempt)
+    {
+        int fd = ::open(path.c_str(), O_RDWR);
+        if(fd < 0)
+        {
+            if(errno != ENOENT)
+            {
+                error = "Failed to open "+path+": "+strerror(errno);
+                return false;
+            }
+            if(!create(path, hash, error))
+                return false;
+            continue;
+        }
+
+        Header header;
+        struct stat status;
+        bool valid = (pread(fd, &header, sizeof(header), 0) == ssize_t(sizeof(header)) &&
+                      fstat(fd, &status) == 0 &&
+                      memcmp(header.mMagic, sMagic, sizeof(sMagic)) == 0 &&
+                      header.mVersion == sVersion &&
+                      header.mHash == hash);
+        if(!valid)
+        {
+            ::close(fd);
+            if(attempt > 0)
+            {
+                error = "Failed to initialize "+path;
+                return false;
+            }
+            if(!create(path, hash, error))
+                return false;
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        mFile = fd;
+        mSize = sizeof(Header);
+        flock(mFile, LOCK_SH);
+        scan(status.st_size);
+        flock(mFile, LOCK_UN);
+        return true;
+    }
+    return false;
+}
+
+void CompositeMapStore::close()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if(mFile >= 0)
+        ::close(mFile);
+    mFile = -1;
+    mIndex.clear();
+    mSize = 0;
+}
+
+void CompositeMapStore::scan(uint64_t fileSize)
+{
+    // Stops at the end, or at a record cut short by a crash. The next write
+    // goes over that one.
+    while(mSize + sizeof(Record) <= fileSize)
+    {
+        Record record;
+        if(pread(mFile, &record, sizeof(record), mSize) != ssize_t(sizeof(record)) ||
+           memcmp(record.mMagic, sRecordMagic, sizeof(sRecordMagic)) != 0 ||
+           record.mPageSize == 0 || record.mPageSize > sMaxPageSize)
+            break;
+        const uint64_t data = mSize + sizeof(Record);
+        const uint64_t end = data + record.mCompositeBytes + record.mNormalBytes;
+        if(end > fileSize)
+            break;
+
+        mIndex[Key(record.mCode, record.mConfigHash, record.mPageSize)] = Entry{data, record.mPageSize,
+                                                               record.mCompositeBytes, record.mNormalBytes};
+        mSize = end;
+    }
+}
+
+bool CompositeMapStore::read(LocationCode code, uint64_t configHash, int pageSize,
+                             unsigned char *composite, unsigned char *normal) const
+{
+    Entry entry;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto iter = mIndex.find(Key(code, configHash, uint32_t(pageSize)));
+        if(iter == mIndex.end())
+        {
+            ++mMisses;
+            return false;
+        }
+        entry = iter->second;
+    }
+
+    // Records are never changed once they're in the index, so no need to hold the lock
+    std::vector<unsigned char> data(entry.mCompositeBytes + entry.mNormalBytes);
+    if(pread(mFile, &data[0], data.size(), entry.mOffset) != ssize_t(data.size()))
+    {
+        ++mMisses;
+        return false;
+    }
+
+    const uLongf bytes = uLongf(pageSize)*pageSize*4;
+    uLongf compositeBytes = bytes;
+    uLongf normalBytes = bytes;
+    if(uncompress(composite, &compositeBytes, &data[0], entry.mCompositeBytes) != Z_OK ||
+       uncompress(normal, &normalBytes, &data[entry.mCompositeBytes], entry.mNormalBytes) != Z_OK ||
+       compositeBytes != bytes || normalBytes != bytes)
+    {
+        ++mMisses;
+        return false;
+    }
+    ++mHits;
+    return true;
+}
+
+void CompositeMapStore::write(LocationCode code, uint64_t configHash, int pageSize,
+                              const unsigned char *composite, const unsigned char *normal)
+{
+    if(mFile < 0 || contains(code, configHash, pageSize))
+        return;
+
+    // Compress before locking, it's the slow part
+    const uLong bytes = uLong(pageSize)*pageSize*4;
+    const uLong bound = compressBound(bytes);
+    std::vector<unsigned char> buffer(sizeof(Record) + bound*2);
+    uLongf compositeBytes = bound;
+    uLongf normalBytes = bound;
+    unsigned char *data = &buffer[sizeof(Record)];
+    if(compress2(data, &compositeBytes, composite, bytes, Z_DEFAULT_COMPRESSION) != Z_OK ||
+       compress2(data + compositeBytes, &normalBytes, normal, bytes, Z_DEFAULT_COMPRESSION) != Z_OK)
+        return;
+
+    Record record;
+    memcpy(record.mMagic, sRecordMagic, sizeof(record.mMagic));
+    record.mPageSize = uint32_t(pageSize);
+    record.mCode = code;
+    record.mConfigHash = configHash;
+    record.mCompositeBytes = uint32_t(compositeBytes);
+    record.mNormalBytes = uint32_t(normalBytes);
+    memcpy(&buffer[0], &record, sizeof(record));
+    const size_t total = sizeof(Record) + compositeBytes + normalBytes;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    if(flock(mFile, LOCK_EX) != 0)
+        return;
+
+    // Pick up what other processes added since, so we append after it
+    struct stat status;
+    if(fstat(mFile, &status) == 0)
+    {
+        scan(status.st_size);
+        if(mIndex.find(Key(code, configHash, record.mPageSize)) == mIndex.end() &&
+           pwrite(mFile, &buffer[0], total, mSize) == ssize_t(total))
+        {
+            mIndex[Key(code, configHash, record.mPageSize)] = Entry{mSize + sizeof(Record), record.mPageSize,
+                                                  record.mCompositeBytes, record.mNormalBytes};
+            mSize += total;
+        }
+    }
+
+    flock(mFile, LOCK_UN);
+}
+
+#else
+
+bool CompositeMapStore::create(const std::string&, uint64_t, std::string &error)
+{
+    error = "Not supported on this platform";
+    return false;
+}
+
+bool CompositeMapStore::open(const std::string &path, uint64_t hash, std::string &error)
+{
+    return create(path, hash, error);
+}
+
+void CompositeMapStore::close()
+{
+}
+
+void CompositeMapStore::scan(uint64_t)
+{
+}
+
+bool CompositeMapStore::read(LocationCode, uint64_t, int, unsigned char*, unsigned char*) const
+{
+    return false;
+}
+
+void CompositeMapStore::write(LocationCode, uint64_t, int, const unsigned char*, const unsigned char*)
+{
+}
+
+#endif
+
+}
@@ -0,0 +1,100 @@
+#ifndef COMPONENTS_TERRAIN_COMPOSITEMAPSTORE_H
+#define COMPONENTS_TERRAIN_COMPOSITEMAPSTORE_H
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <tuple>
+
+#include <stdint.h>
+
+#include "linearquadtree.hpp"
+
+namespace Terrain
+{
+
+    /**
+     * @brief A persistent on-disk cache of rendered composite maps and their normal maps,
+     *        so they don't have to be rendered again on the next run. Maps are keyed by
+     *        their node, their size, and a hash of everything else that went into rendering
+     *        them besides the terrain data, which is covered by the hash of the whole file.
+     *        File layout: a header, then records of a key followed by the zlib-compressed
+     *        composite map and normal map, RGBA8 with the bottom row first. Records are
+     *        only ever appended; the index is built when opening, so maps added by other
+     *        processes afterwards aren't seen.
+     * @note  Not available on Windows; open() always fails there.
+     */
+    class CompositeMapStore
+    {
+    public:
+        /// Bump whenever the file layout, or the way composite maps are rendered, changes.
+        static const uint32_t sVersion = 1;
+
+        CompositeMapStore();
+        ~CompositeMapStore();
+
+        /// Open the store at \a path, creating it if it doesn't exist. An existing
+        /// file made with a different layout or hash is replaced.
+        /// @param hash identifies the terrain data the maps were rendered from
+        /// @return false on failure, with the reason in \a error
+        bool open(const std::string &path, uint64_t hash, std::string &error);
+        void close();
+
+        bool isOpen() const { return mFile >= 0; }
+
+        /// Decompress a composite map and its normal map out of the store. Thread-safe.
+        /// @param configHash identifies the layers and settings the map was rendered with
+        /// @param composite, normal each receive pageSize^2 RGBA8 pixels
+        /// @return false if the map isn't in the store, or is damaged
+        bool read(LocationCode code, uint64_t configHash, int pageSize,
+                  unsigned char *composite, unsigned char *normal) const;
+
+        /// Check if a map is in the store, without affecting the hit/miss counts. Thread-safe.
+        bool contains(LocationCode code, uint64_t configHash, int pageSize) const;
+
+        /// Compress a map into the store, unless it's already there at this size. Thread-safe.
+        void write(LocationCode code, uint64_t configHash, int pageSize,
+                   const unsigned char *composite, const unsigned char *normal);
+
+        size_t getNumMaps() const;
+        /// Size of the file in bytes
+        size_t getSize() const;
+        size_t getNumHits() const { return mHits; }
+        size_t getNumMisses() const { return mMisses; }
+
+    private:
+        struct Header;
+        struct Record;
+
+        struct Entry
+        {
+            /// Where the record's compressed data starts
+            uint64_t mOffset;
+            uint32_t mPageSize;
+            uint32_t mCompositeBytes;
+            uint32_t mNormalBytes;
+        };
+        /// Maps of each size are kept apart, so changing the size doesn't lose the others
+        typedef std::tuple<LocationCode,uint64_t,uint32_t> Key;
+
+        bool create(const std::string &path, uint64_t hash, std::string &error);
+        /// Add the records from the end of those known so far up to \a fileSize to the
+        /// index. Needs the mutex and the file lock held.
+        void scan(uint64_t fileSize);
+
+        int mFile;
+
+        /// Guards the index and the file size, and serializes writers within this
+        /// process. flock() handles other processes.
+        mutable std::mutex mMutex;
+        std::map<Key,Entry> mIndex;
+        uint64_t mSize;
+
+        mutable std::atomic<size_t> mHits;
+        mutable std::atomic<size_t> mMisses;
+    };
+
+}
+
+#endif
@@ -2,6 +2,10 @@
 
 #include <iostream>
 #include <cassert>
+#include <functional>
+#include <cmath>
+#include <algorithm>
+#include <limits>
 
 #include <osgViewer/Viewer>
 #include <osg/MatrixTransform>
@@ -9,9 +13,19 @@
 #include <osg/Depth>
 #include <osg/Material>
 #include <osg/PolygonMode>
+#include <osg/Uniform>
+#include <osg/Math>
+#include <osg/Image>
 
 #include "storage.hpp"
 #include "quadtreenode.hpp"
+#include "tilecache.hpp"
+#include "compositemaprenderer.hpp"
+#include "compositemappool.hpp"
+#include "compositemapstore.hpp"
+#include "blockcompression.hpp"
+#include "material.hpp"
+#include "normals.hpp"
 
 namespace
 {
@@ -30,51 +44,156 @@ int nextPowerOfTwo(int v)
     return v+1;
 }
 
-Terrain::QuadTreeNode* findNode (const osg::Vec2f& center, Terrain::QuadTreeNode* node)
+}
+
+namespace Terrain
 {
-    if(center == node->getCenter())
-        return node;
 
-    if(center.x() > node->getCenter().x() && center.y() > node->getCenter().y())
-        return findNode(center, node->getChild(Terrain::NE));
-    else if(center.x() > node->getCenter().x() && center.y() < node->getCenter().y())
-        return findNode(center, node->getChild(Terrain::SE));
-    else if(center.x() < node->getCenter().x() && center.y() > node->getCenter().y())
-        return findNode(center, node->getChild(Terrain::NW));
-    else //if(center.x() < node->getCenter().x() && center.y() < node->getCenter().y())
-        return findNode(center, node->getChild(Terrain::SW));
-}
+    const unsigned int REQ_ID_CHUNK = 1;
+    const unsigned int REQ_ID_LAYER = 2;
+    // A chunk for the tile cache, no node is waiting for it
+    const unsigned int REQ_ID_PREFETCH = 3;
+    // Composite maps read from, or compressed into, the composite map store
+    const unsigned int REQ_ID_COMPOSITE_LOAD = 4;
+    const unsigned int REQ_ID_COMPOSITE_STORE = 5;
+    // A rendered composite map to block compress, and store if the store is open
+    const unsigned int REQ_ID_COMPOSITE_COMPRESS = 6;
+
+    // How far ahead to predict the camera's position, in seconds
+    const float PrefetchTime = 1.0f;
+    // How much of each frame's camera velocity goes into the smoothed one
+    const float VelocitySmoothing = 0.25f;
+    // Limits the work spent on chunks that may never be needed
+    const int MaxPrefetches = 8;
+    // Loads outside the view count as this much further away
+    const float OutOfViewPriorityScale = 4.0f;
+
+    template<typename ReqT, typename ResT>
+    struct DataRequest : public WorkQueue::Request
+    {
+        ReqT mRequest;
+        ResT mResponse;
+
+        DataRequest(unsigned int type, const WorkQueue::CancelToken &token, float priority, const ReqT &request)
+          : WorkQueue::Request(type, token, priority), mRequest(request)
+        { }
+    };
+    typedef DataRequest<LoadRequestData,LoadResponseData> ChunkRequest;
+    typedef DataRequest<LayerRequestData,LayerResponseData> LayerRequest;
+    struct CompositeMapRequest : public WorkQueue::Request
+    {
+        CompositeMapData mData;
 
-class CompositorRanCallback : public osg::Camera::DrawCallback {
-    Terrain::DefaultWorld *mTerrain;
+        CompositeMapRequest(unsigned int type, const WorkQueue::CancelToken &token, float priority, const CompositeMapData &data)
+          : WorkQueue::Request(type, token, priority), mData(data)
+        { }
+    };
 
-public:
-    CompositorRanCallback(Terrain::DefaultWorld *terrain)
-      : mTerrain(terrain)
-    { }
+    static float getRequestPriority(const WorkQueue::Request *req, const DefaultWorld *terrain)
+    {
+        // Layers are needed before the chunk can be shown properly, so they
+        // get a slight boost.
+        if(req->getType() == REQ_ID_LAYER)
+        {
+            const QuadTreeNode *node = static_cast<const LayerRequest*>(req)->mRequest.mNode;
+            return terrain->getLoadPriority(node->getWorldBoundingBox()) * 0.5f;
+        }
+        // Loading a composite map saves rendering it, so it goes with the layers.
+        // Storing one can wait until there's nothing else to do.
+        if(req->getType() == REQ_ID_COMPOSITE_LOAD)
+            return terrain->getLoadPriority(static_cast<const CompositeMapRequest*>(req)->mData.mWorldBounds) * 0.5f;
+        if(req->getType() == REQ_ID_COMPOSITE_STORE)
+            return std::numeric_limits<float>::max();
+        // The uncompressed page is usable meanwhile, so this only saves memory
+        if(req->getType() == REQ_ID_COMPOSITE_COMPRESS)
+            return terrain->getLoadPriority(static_cast<const CompositeMapRequest*>(req)->mData.mWorldBounds);
+        return terrain->getLoadPriority(static_cast<const ChunkRequest*>(req)->mRequest.mWorldBounds);
+    }
 
-    virtual void operator()(osg::RenderInfo&/*info*/) const
+    static void compressCompositeMap(CompositeMapData &data)
     {
-        mTerrain->setCompositorRan();
+        // Alpha is the specular intensity, and only needs keeping if it varies
+        const unsigned char *composite = data.mComposite->data();
+        const BlockFormat format = isOpaque(composite, data.mPageSize, data.mPageSize) ? Block_BC1 : Block_BC3;
+        data.mComposite = createCompressedImage(data.mComposite.get(), format);
+        // The height in the normal map's alpha isn't used once it's composited, and the
+        // normals are unit length, so two channels are enough
+        data.mNormal = createCompressedImage(data.mNormal.get(), Block_BC5);
     }
-};
 
-}
+    static float getDistance(const osg::BoundingBoxf &bounds, const osg::Vec3f &pos)
+    {
+        osg::Vec3f closest(osg::clampBetween(pos.x(), bounds.xMin(), bounds.xMax()),
+                           osg::clampBetween(pos.y(), bounds.yMin(), bounds.yMax()),
+                           osg::clampBetween(pos.z(), bounds.zMin(), bounds.zMax()));
+        return (closest - pos).length();
+    }
 
-namespace Terrain
-{
+    static void addGeneratedChunk(const QuadTreeNode *node, std::vector<GeneratedChunk> &known)
+    {
+        if(node)
+        {
+            if(node->hasChunk())
+                known.push_back(GeneratedChunk{float(node->getSize()), node->getCenter(),
+                                               node->getChunkPositions(), node->getChunkHeights()});
+        }
+    }
 
-    //const Ogre::uint REQ_ID_CHUNK = 1;
-    //const Ogre::uint REQ_ID_LAYER = 2;
+    static TileKey getTileKey(const LoadRequestData &data)
+    {
+        return TileKey{data.mLodLevel, data.mSize, data.mCenter};
+    }
+
+    // Heights of the parent's surface at each vertex, for morphing. The parent has
+    // every other vertex of ours, and splits its cells from the (x,y) to the
+    // (x+1,y+1) corner like we do. Edge vertices keep their height, so stitched
+    // neighbours still fit.
+    static void computeMorphHeights(const std::vector<float> &heights, int verts, std::vector<float> &morphHeights)
+    {
+        morphHeights = heights;
+        for(int px = 1;px < verts-1;++px)
+        {
+            for(int py = 1;py < verts-1;++py)
+            {
+                const size_t idx = px*verts + py;
+                if(!(px & 1) && !(py & 1))
+                    continue;
+                else if(!(py & 1))
+                    morphHeights[idx] = (heights[idx-verts] + heights[idx+verts]) * 0.5f;
+                else if(!(px & 1))
+                    morphHeights[idx] = (heights[idx-1] + heights[idx+1]) * 0.5f;
+                else
+                    morphHeights[idx] = (heights[idx-verts-1] + heights[idx+verts+1]) * 0.5f;
+            }
+        }
+    }
 
     DefaultWorld::DefaultWorld(osgViewer::Viewer *viewer, osg::Group *rootNode, Storage *storage,
                                int visibilityFlags, bool shaders, Alignment align, int maxBatchSize,
-                               int compmapsize)
+                               int compmapsize, int numThreads, size_t tileCacheSize,
+                               bool compactVertices, unsigned int compositeMapPages, bool compressCompositeMaps)
       : World(viewer, storage, visibilityFlags, shaders, align)
+      , mWorkQueue(nullptr)
+      , mTileCache(new TileCache(tileCacheSize))
+      , mPrefetchesLoading(0)
+      , mPrefetchesDone(0)
       , mVisible(true)
+      , mUpdateBudget(0)
+      , mNodesSplit(0)
+      , mSplitsDeferred(0)
+      , mLastUpdateTime(0)
+      , mErrorDistanceScale(0.0f)
+      , mSceneNodesCreated(0)
+      , mSceneNodesReused(0)
       , mChunksLoading(0)
       , mLayersLoading(0)
-      , mCompositorRan(false)
+      , mCompositeMapRenderer(nullptr)
+      , mCompositeMapPool(nullptr)
+      , mCompositeMapStore(new CompositeMapStore())
+      , mCompositeMapsStoring(0)
+      , mCompressCompositeMaps(compressCompositeMaps && shaders)
+      , mCompositeMapsCompressing(0)
+      , mCompositeMapsCompressed(0)
       , mUpdateIndexBuffers(false)
       , mMinX(0)
       , mMaxX(0)
@@ -82,6 +201,8 @@ namespace Terrain
       , mMaxY(0)
       , mMaxBatchSize(maxBatchSize)
       , mCompositeMapSize(compmapsize)
+      , mCompositeMapPages(std::max(compositeMapPages, 1u))
+      , mCompactVertices(compactVertices && shaders)
     {
         mCompositeMapSize = nextPowerOfTwo(std::max(compmapsize, 1));
 
@@ -92,6 +213,21 @@ namespace Terrain
             state->setMode(GL_BLEND, osg::StateAttribute::OFF);
             state->setMode(GL_DEPTH_TEST, osg::StateAttribute::ON);
             state->setAttribute(new osg::Depth(osg::Depth::LESS));
+
+            if(shaders)
+            {
+                // Rotates terrain space into our alignment, for the vertex shaders
+                osg::Matrix3 alignMtx;
+                for(int i = 0;i < 3;++i)
+                {
+                    float v[3] = { 0.0f, 0.0f, 0.0f };
+                    v[i] = 1.0f;
+                    convertPosition(v[0], v[1], v[2]);
+                    for(int j = 0;j < 3;++j)
+                        alignMtx(i, j) = v[j];
+                }
+                state->addUniform(new osg::Uniform("terrainAlign", alignMtx));
+            }
         }
 
         mCompositorRootSceneNode = new osg::Group();
@@ -121,15 +257,19 @@ namespace Terrain
         float centerX = (mMinX+mMaxX)/2.f + (size-origSizeX)/2.f;
         float centerY = (mMinY+mMaxY)/2.f + (size-origSizeY)/2.f;
 
-        mRootNode = new QuadTreeNode(this, Root, size, osg::Vec2f(centerX, centerY), nullptr);
-        mRootNode->initNeighbours();
+        mLinearQuadTree.setRoot(osg::Vec2f(centerX, centerY), size);
+        mRootNode = createNode(Root, size, osg::Vec2f(centerX, centerY), nullptr);
 
-        //Ogre::WorkQueue* wq = Ogre::Root::getSingleton().getWorkQueue();
-        //mWorkQueueChannel = wq->getChannel("LargeTerrain");
-        //wq->addRequestHandler(mWorkQueueChannel, this);
-        //wq->addResponseHandler(mWorkQueueChannel, this);
+        mWorkQueue = new WorkQueue(this, std::max(numThreads, 0));
 
-        queueLayerLoad(mRootNode);
+        mRootNode->requestLayers();
+
+        mCompositeMapRenderer = new CompositeMapRenderer(mCompositorRootSceneNode.get());
+        if(shaders)
+        {
+            mCompositeMapPool = new CompositeMapPool(mCompositeMapSize, mCompositeMapPages);
+            mCompositeMapRenderer->setPool(mCompositeMapPool);
+        }
 
         rootNode->addChild(mCompositorRootSceneNode.get());
         rootNode->addChild(mRootSceneNode.get());
@@ -137,9 +277,8 @@ namespace Terrain
 
     DefaultWorld::~DefaultWorld()
     {
-        //Ogre::WorkQueue* wq = Ogre::Root::getSingleton().getWorkQueue();
-        //wq->removeRequestHandler(mWorkQueueChannel, this);
-        //wq->removeResponseHandler(mWorkQueueChannel, this);
+        delete mCompositeMapRenderer;
+        mCompositeMapRenderer = nullptr;
         if(mCompositorRootSceneNode.valid())
         {
             while(mCompositorRootSceneNode->getNumParents())
@@ -153,28 +292,103 @@ namespace Terrain
             mRootSceneNode = nullptr;
         }
 
-        delete mRootNode;
+        // Deleting the nodes cancels their outstanding requests, so the queue
+        // can be safely shut down afterward.
+        mPrefetchToken.cancel();
+        mCompositeStoreToken.cancel();
+        destroyNode(mRootNode);
+        mRootNode = nullptr;
+        // Only once the nodes gave back their pages
+        delete mCompositeMapPool;
+        mCompositeMapPool = nullptr;
+        mFreeSceneNodes.clear();
+
+        delete mWorkQueue;
+        delete mTileCache;
+        delete mCompositeMapStore;
     }
 
-    void DefaultWorld::update(const osg::Vec3f &cameraPos)
+    void DefaultWorld::update(const osg::Vec3f &cameraPos, const osg::Polytope &frustum)
     {
-        // FIXME: Only remove children when a render has occured (or better,
-        // make OSG auto-remove compositor cameras right after their children
-        // have finished rendering)
-        if(mCompositorRan)
+        mWorkQueue->processResponses();
+
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        float dt = std::chrono::duration<float>(now - mLastCameraTime).count();
+        if(mLastCameraTime != std::chrono::steady_clock::time_point() && dt > 0.0f)
         {
-            mCompositorRan = false;
-            mCompositorRootSceneNode->removeChildren(
-                0, mCompositorRootSceneNode->getNumChildren()
-            );
+            osg::Vec3f velocity = (cameraPos - mCameraPos) / dt;
+            mCameraVelocity = mCameraVelocity*(1.0f-VelocitySmoothing) + velocity*VelocitySmoothing;
         }
+        mLastCameraTime = now;
+        mCameraPos = cameraPos;
+        mFrustum = frustum;
+
+        // Don't look further ahead than the largest chunk, in case the camera was teleported
+        osg::Vec3f ahead = mCameraVelocity * PrefetchTime;
+        float maxAhead = mMaxBatchSize * mStorage->getCellWorldSize();
+        if(ahead.length() > maxAhead)
+            ahead *= maxAhead / ahead.length();
+        mPredictedCameraPos = cameraPos + ahead;
+
         if(!mVisible) return;
+        mUpdateStart = std::chrono::steady_clock::now();
+        mNodesSplit = 0;
+        mSplitsDeferred = 0;
         mRootNode->update(cameraPos, mStorage->getCellWorldSize());
+        mLastUpdateTime = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - mUpdateStart
+        );
+
+        // Nodes may have moved closer or further since their requests were
+        // queued, or been deleted altogether.
+        mWorkQueue->updatePriorities(std::bind(getRequestPriority, std::placeholders::_1, this));
         if(mUpdateIndexBuffers)
         {
             mUpdateIndexBuffers = false;
             mRootNode->updateIndexBuffers();
         }
+
+        // After the nodes had their say, so composite maps they need are
+        // rendered this frame
+        mCompositeMapRenderer->update();
+
+        // Keep what was rendered for the next run, and compress it for this one
+        mCompositeMapRenderer->takeReadBacks(mReadBacks);
+        for(const CompositeMapRenderer::ReadBack &readBack : mReadBacks)
+        {
+            // The node's layers are needed for the key, and may be gone by now
+            QuadTreeNode *node = mLinearQuadTree.find(readBack.mCode);
+            if(!node || !node->getMaterialGenerator()->hasLayers())
+                continue;
+
+            CompositeMapData data;
+            data.mNode = nullptr;
+            data.mPage = -1;
+            data.mCode = readBack.mCode;
+            data.mConfigHash = node->getMaterialGenerator()->getCompositeMapHash();
+            data.mPageSize = readBack.mComposite->s();
+            data.mComposite = readBack.mComposite;
+            data.mNormal = readBack.mNormal;
+
+            if(mCompressCompositeMaps)
+            {
+                data.mNode = node;
+                data.mPage = node->getCompositePage();
+                data.mWorldBounds = node->getWorldBoundingBox();
+                if(data.mPage < 0)
+                    continue;
+
+                ++mCompositeMapsCompressing;
+                mWorkQueue->addRequest(new CompositeMapRequest(REQ_ID_COMPOSITE_COMPRESS, node->getLayerToken(),
+                                                               getLoadPriority(data.mWorldBounds), data));
+                continue;
+            }
+
+            ++mCompositeMapsStoring;
+            mWorkQueue->addRequest(new CompositeMapRequest(REQ_ID_COMPOSITE_STORE, mCompositeStoreToken,
+                                                           std::numeric_limits<float>::max(), data));
+        }
+        mReadBacks.clear();
     }
 
     osg::BoundingBoxf DefaultWorld::getWorldBoundingBox(const osg::Vec2f& center)
@@ -182,10 +396,92 @@ namespace Terrain
         if(center.x() > mMaxX || center.x() < mMinX ||
            center.y() > mMaxY || center.y() < mMinY)
             return osg::BoundingBoxf();
-        QuadTreeNode* node = findNode(center, mRootNode);
+        LocationCode code;
+        QuadTreeNode* node = mLinearQuadTree.getCodeAt(center, code) ? mLinearQuadTree.find(code) : nullptr;
+        if(!node)
+            return osg::BoundingBoxf();
         return node->getWorldBoundingBox();
     }
 
+    bool DefaultWorld::getChunkHeightAt(const osg::Vec3f &worldPos, float &height) const
+    {
+        const float cellWorldSize = mStorage->getCellWorldSize();
+        const int numVerts = mStorage->getCellVertices();
+
+        // Back to cell units
+        float x = worldPos.x(), y = worldPos.y(), z = worldPos.z();
+        unconvertPosition(mAlign, x, y, z);
+        x /= cellWorldSize;
+        y /= cellWorldSize;
+
+        // Find the smallest node covering the position that has a chunk loaded
+        const QuadTreeNode *found = nullptr;
+        const QuadTreeNode *node = mRootNode;
+        while(node)
+        {
+            const osg::Vec2f &center = node->getCenter();
+            const float halfSize = node->getSize()/2.f;
+            if(!(std::abs(x - center.x()) <= halfSize && std::abs(y - center.y()) <= halfSize))
+                break;
+            if(node->hasChunk())
+                found = node;
+            if(!node->hasChildren())
+                break;
+            if(x < center.x())
+                node = node->getChild((y < center.y()) ? SW : NW);
+            else
+                node = node->getChild((y < center.y()) ? SE : NE);
+        }
+        if(!found)
+            return false;
+
+        const float size = found->getSize();
+        float fx = (x - found->getCenter().x()) / size + 0.5f;
+        float fy = (y - found->getCenter().y()) / size + 0.5f;
+        fx = std::min(std::max(fx, 0.0f), 1.0f) * (numVerts-1);
+        fy = std::min(std::max(fy, 0.0f), 1.0f) * (numVerts-1);
+        const int px = std::min(int(fx), numVerts-2);
+        const int py = std::min(int(fy), numVerts-2);
+        fx -= px;
+        fy -= py;
+
+        // Vertices are stored column by column
+        float h[4];
+        for(int i = 0;i < 4;++i)
+            h[i] = found->getChunkHeight((px + (i&1))*numVerts + py + (i>>1));
+        height = (h[0]*(1.0f-fx) + h[1]*fx)*(1.0f-fy) + (h[2]*(1.0f-fx) + h[3]*fx)*fy;
+        return true;
+    }
+
+    float DefaultWorld::getHeightAt(const osg::Vec3f &worldPos)
+    {
+        float height;
+        if(getChunkHeightAt(worldPos, height))
+            return height;
+        return mStorage->getHeightAt(worldPos);
+    }
+
+    void DefaultWorld::getHeightsAt(const osg::Vec3f *worldPos, size_t count, float *heights)
+    {
+        std::vector<size_t> missing;
+        for(size_t i = 0;i < count;++i)
+        {
+            if(!getChunkHeightAt(worldPos[i], heights[i]))
+                missing.push_back(i);
+        }
+        if(missing.empty())
+            return;
+
+        // Generate the rest in one go
+        std::vector<osg::Vec3f> positions(missing.size());
+        std::vector<float> generated(missing.size());
+        for(size_t i = 0;i < missing.size();++i)
+            positions[i] = worldPos[missing[i]];
+        mStorage->getHeightsAt(&positions[0], positions.size(), &generated[0]);
+        for(size_t i = 0;i < missing.size();++i)
+            heights[missing[i]] = generated[i];
+    }
+
     void DefaultWorld::rebuildCompositeMaps(int mapsize)
     {
         if(mapsize < 0)
@@ -193,45 +489,74 @@ namespace Terrain
         else
             mCompositeMapSize = nextPowerOfTwo(mapsize);
         mRootNode->clearCompositeMaps();
+        // Loads still underway are for the old pages
+        mCompositeMapsLoading.clear();
+        if(mCompositeMapPool)
+        {
+            delete mCompositeMapPool;
+            mCompositeMapPool = new CompositeMapPool(mCompositeMapSize, mCompositeMapPages);
+            mCompositeMapRenderer->setPool(mCompositeMapPool);
+        }
         mRootNode->applyMaterials();
     }
 
-    // FIXME
-    void DefaultWorld::renderCompositeMap(osg::Texture2D *target, osg::Texture2D *normal, osg::Geode *geode)
+    bool DefaultWorld::openCompositeMapStore(const std::string &path, uint64_t hash, std::string &error)
     {
-        target->setTextureSize(mCompositeMapSize, mCompositeMapSize);
-        target->setSourceFormat(GL_RGBA);
-        target->setSourceType(GL_UNSIGNED_BYTE);
-        target->setInternalFormat(GL_RGBA8);
-        target->setUnRefImageDataAfterApply(true);
-
-        normal->setTextureSize(mCompositeMapSize, mCompositeMapSize);
-        normal->setSourceFormat(GL_RGBA);
-        normal->setSourceType(GL_UNSIGNED_BYTE);
-        normal->setInternalFormat(GL_RGBA8);
-        normal->setUnRefImageDataAfterApply(true);
-
-        osg::ref_ptr<osg::Camera> camera = new osg::Camera();
-        camera->setClearMask(GL_NONE);
-
-        camera->setReferenceFrame(osg::Transform::ABSOLUTE_RF);
-        camera->setProjectionResizePolicy(osg::Camera::FIXED);
-        camera->setProjectionMatrix(osg::Matrixd::identity());
-        camera->setViewMatrix(osg::Matrixd::identity());
-        camera->setViewport(0, 0, mCompositeMapSize, mCompositeMapSize);
+        mCompositeMapStore->close();
+        if(!getShadersEnabled())
+        {
+            error = "Composite maps need shaders";
+            return false;
+        }
+        return mCompositeMapStore->open(path, hash, error);
+    }
 
-        camera->setRenderOrder(osg::Camera::PRE_RENDER);
+    void DefaultWorld::renderCompositeMap(int page, LocationCode code, osg::Geode *geode, bool store)
+    {
+        // Compressing needs the map back either way. Loaded ones are compressed straight from the store.
+        mCompositeMapRenderer->add(page, code, geode, (store && mCompositeMapStore->isOpen()) || mCompressCompositeMaps);
+    }
 
-        camera->setRenderTargetImplementation(osg::Camera::FRAME_BUFFER_OBJECT);
-        camera->attach(osg::Camera::COLOR_BUFFER0, target, 0, 0, true);
-        camera->attach(osg::Camera::COLOR_BUFFER1, normal, 0, 0, true);
+    bool DefaultWorld::loadCompositeMap(QuadTreeNode *node)
+    {
+        if(!mCompositeMapStore->isOpen())
+            return false;
+
+        CompositeMapData data;
+        data.mNode = node;
+        data.mPage = node->getCompositePage();
+        data.mWorldBounds = node->getWorldBoundingBox();
+        data.mCode = node->getLocationCode();
+        data.mConfigHash = node->getMaterialGenerator()->getCompositeMapHash();
+        data.mPageSize = mCompositeMapSize;
+        if(!mCompositeMapStore->contains(data.mCode, data.mConfigHash, data.mPageSize))
+            return false;
+
+        CompositeMapRequest *req = new CompositeMapRequest(REQ_ID_COMPOSITE_LOAD, node->getLayerToken(),
+                                                           getLoadPriority(data.mWorldBounds) * 0.5f, data);
+        mCompositeMapsLoading[data.mPage] = req;
+        mWorkQueue->addRequest(req);
+        return true;
+    }
 
-        camera->setPostDrawCallback(new CompositorRanCallback(this));
-        mCompositorRan = false;
+    bool DefaultWorld::isCompositeMapPending(int page, LocationCode code) const
+    {
+        auto iter = mCompositeMapsLoading.find(page);
+        if(iter != mCompositeMapsLoading.end() &&
+           static_cast<const CompositeMapRequest*>(iter->second)->mData.mCode == code)
+            return true;
+        return mCompositeMapRenderer->isPending(page, code);
+    }
 
-        camera->addChild(geode);
+    float DefaultWorld::getKnownGeometricError(LocationCode code) const
+    {
+        auto iter = mGeometricErrors.find(code);
+        return (iter != mGeometricErrors.end()) ? iter->second : -1.0f;
+    }
 
-        mCompositorRootSceneNode->addChild(camera);
+    void DefaultWorld::setCompositeMapBudget(unsigned int tiles)
+    {
+        mCompositeMapRenderer->setBudget(tiles);
     }
 
 
@@ -256,6 +581,41 @@ namespace Terrain
         return mVisible;
     }
 
+    void DefaultWorld::setUpdateBudget(unsigned int microseconds)
+    {
+        mUpdateBudget = std::chrono::microseconds(microseconds);
+    }
+
+    void DefaultWorld::setMaxScreenSpaceError(float pixels, float fovY, int viewportHeight)
+    {
+        // A geometric error e at distance d covers e*h/(2*tan(fov/2))/d pixels
+        float scale = 0.0f;
+        if(pixels > 0.0f && fovY > 0.0f && viewportHeight > 0)
+            scale = viewportHeight / (2.0f * std::tan(osg::DegreesToRadians(fovY) * 0.5f)) / pixels;
+        if(scale == mErrorDistanceScale)
+            return;
+
+        mErrorDistanceScale = scale;
+        // Any LOD decision may be different now
+        if(mRootNode)
+            mRootNode->clearSettled();
+    }
+
+    bool DefaultWorld::mayBuildChildren()
+    {
+        // Always allow one split, so the tree keeps converging however slow
+        // a frame is
+        if(mUpdateBudget.count() > 0 && mNodesSplit > 0 &&
+           std::chrono::steady_clock::now() - mUpdateStart >= mUpdateBudget)
+        {
+            ++mSplitsDeferred;
+            return false;
+        }
+        ++mNodesSplit;
+        return true;
+    }
+
+
     void DefaultWorld::getStatus(std::ostream &status) const
     {
         static std::map<size_t,size_t> chunks;
@@ -277,96 +637,437 @@ namespace Terrain
         }
         status<< "Total chunks: "<<totalchunks <<std::endl;
         status<< "Loaded nodes: "<<nodes <<std::endl;
+        status<< "Last update: "<<mLastUpdateTime.count()<<" us, "<<mNodesSplit<<" splits, "
+              <<mSplitsDeferred<<" deferred" <<std::endl;
+        status<< "Loading chunks: "<<mChunksLoading<<", layers: "<<mLayersLoading
+              << " ("<<mWorkQueue->getNumQueued()<<" queued)" <<std::endl;
+        status<< "Prefetching: "<<mPrefetchesLoading<<" chunks, "<<mPrefetchesDone<<" done, "
+              <<"camera speed "<<mCameraVelocity.length() <<std::endl;
+        status<< "Composite maps: "<<mCompositeMapRenderer->getNumPending()<<" pending, "
+              <<mCompositeMapRenderer->getNumRendered()<<" rendered in "
+              <<mCompositeMapRenderer->getNumPasses()<<" passes" <<std::endl;
+        if(mCompositeMapPool)
+            status<< "Composite pages: "<<mCompositeMapPool->getNumLeased()<<"/"<<mCompositeMapPool->getNumPages()
+                  <<" leased, "<<mCompositeMapPool->getNumReused()<<" reused" <<std::endl;
+        if(mCompositeMapStore->isOpen())
+            status<< "Composite store: "<<mCompositeMapStore->getNumMaps()<<" maps, "
+                  <<(mCompositeMapStore->getSize()>>10)<<" KiB, "<<mCompositeMapStore->getNumHits()<<" hits, "
+                  <<mCompositeMapStore->getNumMisses()<<" misses, "<<mCompositeMapsLoading.size()<<" loading, "
+                  <<mCompositeMapsStoring<<" storing" <<std::endl;
+        if(mCompressCompositeMaps)
+            status<< "Compressed composite maps: "<<mCompositeMapsCompressed<<" done, "
+                  <<mCompositeMapsCompressing<<" compressing" <<std::endl;
+        status<< "Tile cache: "<<mTileCache->getNumTiles()<<" tiles, "
+              <<(mTileCache->getNumBytes()>>10)<<"/"<<(mTileCache->getBudget()>>10)<<" KiB, "
+              <<mTileCache->getNumHits()<<" hits, "<<mTileCache->getNumMisses()<<" misses" <<std::endl;
+        status<< "Node pool: "<<mNodePool.getNumLive()<<"/"<<mNodePool.getCapacity()<<" nodes in "
+              <<mNodePool.getNumBlocks()<<" allocations, "<<mNodePool.getNumCreated()<<" created" <<std::endl;
+        status<< "Material pool: "<<mMaterialGeneratorPool.getNumLive()<<"/"<<mMaterialGeneratorPool.getCapacity()
+              <<" generators in "<<mMaterialGeneratorPool.getNumBlocks()<<" allocations" <<std::endl;
+        status<< "Scene nodes: "<<mSceneNodesCreated<<" allocated, "<<mSceneNodesReused<<" reused, "
+              <<mFreeSceneNodes.size()<<" free" <<std::endl;
+    }
+
+
+    QuadTreeNode *DefaultWorld::createNode(ChildDirection dir, int size, const osg::Vec2f &center, QuadTreeNode *parent)
+    {
+        QuadTreeNode *node = mNodePool.create(this, dir, size, center, parent);
+        mLinearQuadTree.insert(node->getLocationCode(), node);
+        return node;
     }
 
+    void DefaultWorld::destroyNode(QuadTreeNode *node)
+    {
+        if(!node)
+            return;
+        mLinearQuadTree.remove(node->getLocationCode());
+        mNodePool.destroy(node);
+    }
+
+    MaterialGenerator *DefaultWorld::createMaterialGenerator()
+    {
+        return mMaterialGeneratorPool.create(mStorage);
+    }
+
+    void DefaultWorld::destroyMaterialGenerator(MaterialGenerator *generator)
+    {
+        mMaterialGeneratorPool.destroy(generator);
+    }
+
+    osg::ref_ptr<osg::MatrixTransform> DefaultWorld::createSceneNode()
+    {
+        if(mFreeSceneNodes.empty())
+        {
+            ++mSceneNodesCreated;
+            return new osg::MatrixTransform();
+        }
+
+        ++mSceneNodesReused;
+        osg::ref_ptr<osg::MatrixTransform> node = mFreeSceneNodes.back();
+        mFreeSceneNodes.pop_back();
+        return node;
+    }
+
+    void DefaultWorld::recycleSceneNode(osg::MatrixTransform *node)
+    {
+        while(node->getNumParents())
+            node->getParent(0)->removeChild(node);
+        node->removeChildren(0, node->getNumChildren());
+        node->setMatrix(osg::Matrix::identity());
+        mFreeSceneNodes.push_back(node);
+    }
 
     void DefaultWorld::syncLoad()
     {
-        //while (mChunksLoading || mLayersLoading)
-        //{
-        //    OGRE_THREAD_SLEEP(0);
-        //    Ogre::Root::getSingleton().getWorkQueue()->processResponses();
-        //}
+        while(mChunksLoading || mLayersLoading)
+        {
+            while(mChunksLoading || mLayersLoading)
+                mWorkQueue->waitResponses();
+            // With screen space error LOD, loaded chunks can turn out too
+            // coarse, which starts loading their children
+            update(mCameraPos, mFrustum);
+        }
+    }
+
+    void DefaultWorld::waitForResponses()
+    {
+        mWorkQueue->waitResponses();
     }
 
-#if 0 // FIXME
-    Ogre::WorkQueue::Response* DefaultWorld::handleRequest(const Ogre::WorkQueue::Request *req, const Ogre::WorkQueue *srcQ)
+    void DefaultWorld::handleRequest(WorkQueue::Request *req)
     {
-        if (req->getType() == REQ_ID_CHUNK)
+        if(req->getType() == REQ_ID_CHUNK || req->getType() == REQ_ID_PREFETCH)
         {
-            const LoadRequestData data = Ogre::any_cast<LoadRequestData>(req->getData());
-            LoadResponseData* responseData = new LoadResponseData();
+            ChunkRequest *chunkreq = static_cast<ChunkRequest*>(req);
+            const LoadRequestData &data = chunkreq->mRequest;
+            LoadResponseData &responseData = chunkreq->mResponse;
 
             getStorage()->fillVertexBuffers(
-                data.mNode->getNativeLodLevel(), data.mNode->getSize(), data.mNode->getCenter(), getAlign(),
-                responseData->mPositions, responseData->mNormals, responseData->mColours
+                data.mLodLevel, data.mSize, data.mCenter, getAlign(), data.mKnown,
+                responseData.mPositions, responseData.mNormals, responseData.mColours,
+                responseData.mGeometricError
             );
-            return OGRE_NEW Ogre::WorkQueue::Response(req, true, Ogre::Any(responseData));
+
+            if(mCompactVertices)
+            {
+                // Keep just the heights and the normals in terrain space, packed
+                const size_t numVerts = responseData.mPositions.size();
+                responseData.mHeights.resize(numVerts);
+                responseData.mPackedNormals.resize(numVerts);
+                for(size_t i = 0;i < numVerts;++i)
+                {
+                    const osg::Vec3f &pos = responseData.mPositions[i];
+                    responseData.mHeights[i] = getConvertedHeight(mAlign, pos.x(), pos.y(), pos.z());
+
+                    osg::Vec3f normal = responseData.mNormals[i];
+                    unconvertPosition(mAlign, normal.x(), normal.y(), normal.z());
+                    responseData.mPackedNormals[i] = packOctahedral(normal);
+                }
+                std::vector<osg::Vec3f>().swap(responseData.mPositions);
+                std::vector<osg::Vec3f>().swap(responseData.mNormals);
+                std::vector<osg::Vec4ub>().swap(responseData.mColours);
+            }
+
+            if(getShadersEnabled())
+            {
+                std::vector<float> heights;
+                if(!mCompactVertices)
+                {
+                    heights.resize(responseData.mPositions.size());
+                    for(size_t i = 0;i < heights.size();++i)
+                    {
+                        const osg::Vec3f &pos = responseData.mPositions[i];
+                        heights[i] = getConvertedHeight(mAlign, pos.x(), pos.y(), pos.z());
+                    }
+                }
+                computeMorphHeights(mCompactVertices ? responseData.mHeights : heights,
+                                    getStorage()->getCellVertices(), responseData.mMorphHeights);
+            }
+        }
+        else if(req->getType() == REQ_ID_COMPOSITE_LOAD)
+        {
+            CompositeMapData &data = static_cast<CompositeMapRequest*>(req)->mData;
+            data.mComposite = new osg::Image();
+            data.mComposite->allocateImage(data.mPageSize, data.mPageSize, 1, GL_RGBA, GL_UNSIGNED_BYTE);
+            data.mNormal = new osg::Image();
+            data.mNormal->allocateImage(data.mPageSize, data.mPageSize, 1, GL_RGBA, GL_UNSIGNED_BYTE);
+            if(!mCompositeMapStore->read(data.mCode, data.mConfigHash, data.mPageSize,
+                                         data.mComposite->data(), data.mNormal->data()))
+            {
+                data.mComposite = nullptr;
+                data.mNormal = nullptr;
+            }
+            else if(mCompressCompositeMaps)
+                compressCompositeMap(data);
+        }
+        else if(req->getType() == REQ_ID_COMPOSITE_STORE)
+        {
+            const CompositeMapData &data = static_cast<CompositeMapRequest*>(req)->mData;
+            mCompositeMapStore->write(data.mCode, data.mConfigHash, data.mPageSize,
+                                      data.mComposite->data(), data.mNormal->data());
+        }
+        else if(req->getType() == REQ_ID_COMPOSITE_COMPRESS)
+        {
+            CompositeMapData &data = static_cast<CompositeMapRequest*>(req)->mData;
+            mCompositeMapStore->write(data.mCode, data.mConfigHash, data.mPageSize,
+                                      data.mComposite->data(), data.mNormal->data());
+            compressCompositeMap(data);
         }
         else // REQ_ID_LAYER
         {
-            const LayerRequestData data = Ogre::any_cast<LayerRequestData>(req->getData());
-            LayerResponseData* responseData = new LayerResponseData();
+            LayerRequest *layerreq = static_cast<LayerRequest*>(req);
+            const LayerRequestData &data = layerreq->mRequest;
+            LayerResponseData &responseData = layerreq->mResponse;
 
-            getStorage()->getBlendmaps(data.mNode->getSize(), data.mNode->getCenter(), data.mPack,
-                                       responseData->mBlendmaps, responseData->mLayers);
-
-            return OGRE_NEW Ogre::WorkQueue::Response(req, true, Ogre::Any(responseData));
+            getStorage()->getBlendmaps(data.mSize, data.mCenter, data.mPack,
+                                       responseData.mBlendmaps, responseData.mLayers);
         }
     }
 
-    void DefaultWorld::handleResponse(const Ogre::WorkQueue::Response *res, const Ogre::WorkQueue *srcQ)
+    void DefaultWorld::handleResponse(WorkQueue::Request *req)
     {
-        assert(res->succeeded() && "Response failure not handled");
+        if(req->getType() == REQ_ID_PREFETCH)
+        {
+            ChunkRequest *chunkreq = static_cast<ChunkRequest*>(req);
+            if(req->succeeded())
+            {
+                mTileCache->insert(getTileKey(chunkreq->mRequest), chunkreq->mResponse);
+                ++mPrefetchesDone;
+            }
+            --mPrefetchesLoading;
+            return;
+        }
+        if(req->getType() == REQ_ID_COMPOSITE_STORE)
+        {
+            --mCompositeMapsStoring;
+            return;
+        }
+        if(req->getType() == REQ_ID_COMPOSITE_LOAD)
+        {
+            const CompositeMapData &data = static_cast<CompositeMapRequest*>(req)->mData;
+            auto iter = mCompositeMapsLoading.find(data.mPage);
+            // Superseded by another load, or by rebuilding the composite maps
+            if(iter == mCompositeMapsLoading.end() || iter->second != req)
+                return;
+            mCompositeMapsLoading.erase(iter);
+            // The node went away, or gave up the page
+            if(req->isCancelled() || data.mNode->getCompositePage() != data.mPage)
+                return;
+
+            if(req->succeeded() && data.mComposite.valid())
+            {
+                if(mCompressCompositeMaps)
+                {
+                    data.mNode->setCompressedCompositeMap(data.mComposite.get(), data.mNormal.get());
+                    ++mCompositeMapsCompressed;
+                }
+                else
+                    data.mNode->loadCompositeMap(data.mComposite.get(), data.mNormal.get());
+            }
+            else
+                data.mNode->renderCompositeMap();
+            return;
+        }
+        if(req->getType() == REQ_ID_COMPOSITE_COMPRESS)
+        {
+            --mCompositeMapsCompressing;
+            const CompositeMapData &data = static_cast<CompositeMapRequest*>(req)->mData;
+            // The node went away or gave up the page, or the maps were rebuilt at another size
+            if(req->isCancelled() || !req->succeeded() || data.mNode->getCompositePage() != data.mPage ||
+               data.mPageSize != mCompositeMapSize)
+                return;
+
+            data.mNode->setCompressedCompositeMap(data.mComposite.get(), data.mNormal.get());
+            ++mCompositeMapsCompressed;
+            return;
+        }
 
-        if (res->getRequest()->getType() == REQ_ID_CHUNK)
+        if(req->isCancelled())
         {
-            LoadResponseData* data = Ogre::any_cast<LoadResponseData*>(res->getData());
-            const LoadRequestData requestData = Ogre::any_cast<LoadRequestData>(res->getRequest()->getData());
+            // The node went away or no longer wants this data
+            if(req->getType() == REQ_ID_CHUNK)
+            {
+                // Though if it was already generated, hang on to it in case
+                // the node comes back
+                ChunkRequest *chunkreq = static_cast<ChunkRequest*>(req);
+                if(req->succeeded())
+                    mTileCache->insert(getTileKey(chunkreq->mRequest), chunkreq->mResponse);
+                --mChunksLoading;
+            }
+            else
+                --mLayersLoading;
+            return;
+        }
 
-            requestData.mNode->load(*data);
+        if(!req->succeeded())
+        {
+            // Nothing to show, and nothing worth caching. The node tries again later.
+            if(req->getType() == REQ_ID_CHUNK)
+            {
+                static_cast<ChunkRequest*>(req)->mRequest.mNode->chunkLoadFailed();
+                --mChunksLoading;
+            }
+            else
+            {
+                static_cast<LayerRequest*>(req)->mRequest.mNode->layerLoadFailed();
+                --mLayersLoading;
+            }
+            return;
+        }
+
+        if(req->getType() == REQ_ID_CHUNK)
+        {
+            ChunkRequest *chunkreq = static_cast<ChunkRequest*>(req);
 
-            delete data;
+            chunkreq->mRequest.mNode->load(chunkreq->mResponse);
+            mTileCache->insert(getTileKey(chunkreq->mRequest), chunkreq->mResponse);
 
             --mChunksLoading;
         }
         else // REQ_ID_LAYER
         {
-            LayerResponseData* data = Ogre::any_cast<LayerResponseData*>(res->getData());
-            const LayerRequestData requestData = Ogre::any_cast<LayerRequestData>(res->getRequest()->getData());
+            LayerRequest *layerreq = static_cast<LayerRequest*>(req);
 
-            requestData.mNode->loadLayers(data->mBlendmaps, data->mLayers);
-
-            delete data;
+            layerreq->mRequest.mNode->loadLayers(layerreq->mResponse.mBlendmaps,
+                                                 layerreq->mResponse.mLayers);
 
             --mLayersLoading;
         }
     }
-#endif
 
     void DefaultWorld::queueChunkLoad(QuadTreeNode *node)
     {
-        LoadResponseData responseData;
+        LoadRequestData data;
+        data.mNode = node;
+        data.mLodLevel = node->getNativeLodLevel();
+        data.mSize = node->getSize();
+        data.mCenter = node->getCenter();
+        data.mWorldBounds = node->getWorldBoundingBox();
+
+        if(const LoadResponseData *cached = mTileCache->find(getTileKey(data)))
+        {
+            node->load(*cached);
+            return;
+        }
+
+        // Share vertices with the parent when splitting, the children when
+        // merging, and neighbours along the edges.
+        addGeneratedChunk(node->getParent(), data.mKnown);
+        if(node->hasChildren())
+        {
+            for(int i = 0;i < 4;++i)
+                addGeneratedChunk(node->getChild((ChildDirection)i), data.mKnown);
+        }
+        for(int i = 0;i < 4;++i)
+            addGeneratedChunk(node->getNeighbour((Direction)i), data.mKnown);
 
         ++mChunksLoading;
-        getStorage()->fillVertexBuffers(
-            node->getNativeLodLevel(), node->getSize(), node->getCenter(), getAlign(),
-            responseData.mPositions, responseData.mNormals, responseData.mColours
-        );
+        mWorkQueue->addRequest(new ChunkRequest(REQ_ID_CHUNK, node->getChunkToken(),
+                                                getLoadPriority(data.mWorldBounds), data));
+    }
+
+    bool DefaultWorld::isInView(const osg::BoundingBoxf &worldBounds) const
+    {
+        // With a bit of margin, so turning a little doesn't reveal anything missing
+        const float margin = mStorage->getCellWorldSize();
+        osg::BoundingBoxf bounds(worldBounds._min - osg::Vec3f(margin, margin, margin),
+                                 worldBounds._max + osg::Vec3f(margin, margin, margin));
+        if(mFrustum.contains(bounds))
+            return true;
+
+        // Moving the bounds back is the same as moving the view ahead
+        const osg::Vec3f ahead = mPredictedCameraPos - mCameraPos;
+        bounds._min -= ahead;
+        bounds._max -= ahead;
+        return mFrustum.contains(bounds);
+    }
 
-        node->load(responseData);
-        --mChunksLoading;
+    float DefaultWorld::getLoadPriority(const osg::BoundingBoxf &worldBounds) const
+    {
+        // Closer is more important, and so is whatever we're heading toward
+        float dist = std::min(getDistance(worldBounds, mCameraPos), getDistance(worldBounds, mPredictedCameraPos));
+        if(!isInView(worldBounds))
+            dist *= OutOfViewPriorityScale;
+        return dist;
+    }
+
+    bool DefaultWorld::prefetchChunk(const QuadTreeNode *node)
+    {
+        if(mTileCache->getBudget() == 0 || mPrefetchesLoading >= MaxPrefetches)
+            return false;
+        if(!isInView(node->getWorldBoundingBox()))
+            return false;
+
+        LoadRequestData data;
+        data.mNode = nullptr;
+        data.mLodLevel = node->getNativeLodLevel();
+        data.mSize = node->getSize();
+        data.mCenter = node->getCenter();
+        data.mWorldBounds = node->getWorldBoundingBox();
+        if(mTileCache->contains(getTileKey(data)))
+            return true;
+
+        // Being merged, so the children's chunks are likely there
+        for(int i = 0;i < 4 && node->hasChildren();++i)
+            addGeneratedChunk(node->getChild((ChildDirection)i), data.mKnown);
+
+        ++mPrefetchesLoading;
+        mWorkQueue->addRequest(new ChunkRequest(REQ_ID_PREFETCH, mPrefetchToken,
+                                                getLoadPriority(data.mWorldBounds), data));
+        return true;
+    }
+
+    bool DefaultWorld::prefetchChildChunks(const QuadTreeNode *node)
+    {
+        if(node->getSize() <= 1 || mTileCache->getBudget() == 0 || mPrefetchesLoading+4 > MaxPrefetches)
+            return false;
+
+        const float cellWorldSize = mStorage->getCellWorldSize();
+        const int childSize = node->getSize()/2;
+        const float halfSize = childSize/2.f;
+        for(int i = 0;i < 4;++i)
+        {
+            LoadRequestData data;
+            data.mNode = nullptr;
+            data.mLodLevel = node->getNativeLodLevel()-1;
+            data.mSize = childSize;
+            data.mCenter = node->getCenter() + osg::Vec2f((i & 1) ? halfSize : -halfSize,
+                                                          (i & 2) ? halfSize : -halfSize);
+
+            // Same as QuadTreeNode::initAabb
+            float minZ, maxZ;
+            if(!mStorage->getMinMaxHeights(childSize, data.mCenter, minZ, maxZ))
+                continue;
+            osg::BoundingBoxf bounds(-halfSize*cellWorldSize, -halfSize*cellWorldSize, minZ,
+                                      halfSize*cellWorldSize,  halfSize*cellWorldSize, maxZ);
+            convertBounds(bounds);
+            osg::Vec3f offset(data.mCenter*cellWorldSize, 0.0f);
+            convertPosition(offset);
+            data.mWorldBounds = osg::BoundingBoxf(bounds._min+offset, bounds._max+offset);
+
+            if(!isInView(data.mWorldBounds) || mTileCache->contains(getTileKey(data)))
+                continue;
+
+            // The children will share vertices with this node
+            addGeneratedChunk(node, data.mKnown);
+
+            ++mPrefetchesLoading;
+            mWorkQueue->addRequest(new ChunkRequest(REQ_ID_PREFETCH, mPrefetchToken,
+                                                    getLoadPriority(data.mWorldBounds), data));
+        }
+        return true;
     }
 
     void DefaultWorld::queueLayerLoad(QuadTreeNode *node)
     {
-        LayerResponseData responseData;
+        LayerRequestData data;
+        data.mNode = node;
+        data.mSize = node->getSize();
+        data.mCenter = node->getCenter();
+        data.mPack = getShadersEnabled();
 
         ++mLayersLoading;
-        getStorage()->getBlendmaps(node->getSize(), node->getCenter(), getShadersEnabled(),
-                                   responseData.mBlendmaps, responseData.mLayers);
-
-        node->loadLayers(responseData.mBlendmaps, responseData.mLayers);
-        --mLayersLoading;
+        mWorkQueue->addRequest(new LayerRequest(REQ_ID_LAYER, node->getLayerToken(),
+                                                getLoadPriority(node->getWorldBoundingBox()) * 0.5f, data));
     }
 }
@@ -1,9 +1,23 @@
 #ifndef COMPONENTS_TERRAIN_H
 #define COMPONENTS_TERRAIN_H
 
+#include <chrono>
 #include <vector>
+#include <map>
+#include <unordered_map>
+#include <string>
+
+#include <osg/Vec2f>
+#include <osg/Vec2s>
+#include <osg/Vec3f>
+#include <osg/Polytope>
 
 #include "world.hpp"
+#include "storage.hpp"
+#include "workqueue.hpp"
+#include "objectpool.hpp"
+#include "linearquadtree.hpp"
+#include "compositemaprenderer.hpp"
 
 namespace osg
 {
@@ -12,6 +26,8 @@ namespace osg
     class Texture2D;
     class Group;
     class Geode;
+    class Image;
+    class MatrixTransform;
 }
 
 namespace Terrain
@@ -19,6 +35,11 @@ namespace Terrain
 
     class QuadTreeNode;
     class Storage;
+    class TileCache;
+    class CompositeMapRenderer;
+    class CompositeMapPool;
+    class CompositeMapStore;
+    class MaterialGenerator;
 
     /**
      * @brief A quadtree-based terrain implementation suitable for large data sets. \n
@@ -27,7 +48,7 @@ namespace Terrain
      *        Cracks at LOD transitions are avoided using stitching.
      * @note  Multiple cameras are not supported yet
      */
-    class DefaultWorld : public World
+    class DefaultWorld : public World, public WorkQueue::Handler
     {
     public:
         /// @note takes ownership of \a storage
@@ -38,19 +59,36 @@ namespace Terrain
         ///         faster so this is just here for compatibility.
         /// @param align The align of the terrain, see Alignment enum
         /// @param maxBatchSize Maximum size of a terrain batch along one side (in cell units). Used when traversing the quad tree.
+        /// @param numThreads Number of background threads to load terrain data with, or 0 to pick automatically.
+        /// @param tileCacheSize Number of bytes of generated chunk data to keep around for reuse, or 0 to disable.
+        /// @param compactVertices Store only heights and packed normals per vertex, and rebuild the rest in the
+        ///         vertex shader. Ignored without shaders.
+        /// @param compositeMapPages Number of composite maps to keep in video memory. Chunks that find no room
+        ///         for theirs splat their layers directly. Composite maps need shaders.
+        /// @param compressCompositeMaps Block compress composite maps in the background once they're rendered,
+        ///         and draw with the compressed copies instead of the pages.
         DefaultWorld(osgViewer::Viewer *viewer, osg::Group *rootNode, Storage* storage,
                      int visibilityFlags, bool shaders, Alignment align,
-                     int maxBatchSize, int compmapsize);
+                     int maxBatchSize, int compmapsize, int numThreads=0,
+                     size_t tileCacheSize=0, bool compactVertices=false,
+                     unsigned int compositeMapPages=128, bool compressCompositeMaps=false);
         ~DefaultWorld();
 
-        /// Update chunk LODs according to this camera position
+        /// Update chunk LODs according to this camera position. Loads outside the frustum come last,
+        /// and chunks needed where the camera is headed are generated ahead of time.
         /// @note Calling this method might lead to composite textures being rendered, so it is best
         /// not to call it when render commands are still queued, since that would cause a flush.
-        virtual void update (const osg::Vec3f& cameraPos);
+        virtual void update (const osg::Vec3f& cameraPos, const osg::Polytope& frustum);
 
         /// Get the world bounding box of a chunk of terrain centered at \a center
         virtual osg::BoundingBoxf getWorldBoundingBox (const osg::Vec2f& center);
 
+        /// Get terrain heights, sampled from the most detailed loaded chunk
+        /// covering each position. Falls back to the storage where nothing
+        /// is loaded. Must be called from the main thread.
+        virtual float getHeightAt (const osg::Vec3f& worldPos);
+        virtual void getHeightsAt (const osg::Vec3f* worldPos, size_t count, float* heights);
+
         osg::Group *getRootSceneNode() { return mRootSceneNode.get(); }
 
         /// Show or hide the whole terrain
@@ -67,27 +105,90 @@ namespace Terrain
 
         virtual void rebuildCompositeMaps(int compmapsize);
 
+        virtual bool openCompositeMapStore(const std::string &path, uint64_t hash, std::string &error);
+
+        virtual void setUpdateBudget(unsigned int microseconds);
+
+        virtual void setCompositeMapBudget(unsigned int maps);
+
+        virtual void setMaxScreenSpaceError(float pixels, float fovY, int viewportHeight);
+
+        /// Distance per unit of geometric error at which a chunk's error projects to the
+        /// allowed number of pixels, or 0 to pick LODs by distance alone
+        float getErrorDistanceScale() const { return mErrorDistanceScale; }
+
         int getMaxBatchSize() const { return mMaxBatchSize; }
 
+        /// Are chunks using the compact vertex format?
+        bool getCompactVertices() const { return mCompactVertices; }
+
         float getMinX() const { return mMinX; }
         float getMaxX() const { return mMaxX; }
         float getMinY() const { return mMinY; }
         float getMaxY() const { return mMaxY; }
 
-        /// Wait until all background loading is complete.
+        /// Wait until all background loading is complete, updating again at the
+        /// last camera position until that doesn't start any more loads.
         virtual void syncLoad();
 
         virtual void getStatus(std::ostream &status) const;
 
     private:
         // Called from a background worker thread
-        //virtual Ogre::WorkQueue::Response* handleRequest(const Ogre::WorkQueue::Request* req, const Ogre::WorkQueue* srcQ);
+        virtual void handleRequest(WorkQueue::Request *req);
         // Called from the main thread
-        //virtual void handleResponse(const Ogre::WorkQueue::Response* res, const Ogre::WorkQueue* srcQ);
-        //Ogre::uint16 mWorkQueueChannel;
+        virtual void handleResponse(WorkQueue::Request *req);
+
+        // Bilinearly sample the most detailed loaded chunk at the given position.
+        // Returns false if no chunk covering it is loaded.
+        bool getChunkHeightAt(const osg::Vec3f &worldPos, float &height) const;
+
+        WorkQueue *mWorkQueue;
+
+        /// Recently generated chunks, so merging or splitting nodes back doesn't regenerate them
+        TileCache *mTileCache;
+
+        /// Camera position and view of the last update, used to prioritize requests.
+        /// Polytope::contains isn't const.
+        osg::Vec3f mCameraPos;
+        mutable osg::Polytope mFrustum;
+
+        /// Smoothed camera velocity, and where it will take the camera shortly
+        osg::Vec3f mCameraVelocity;
+        osg::Vec3f mPredictedCameraPos;
+        std::chrono::steady_clock::time_point mLastCameraTime;
+
+        /// Chunks being generated into the tile cache ahead of time
+        int mPrefetchesLoading;
+        size_t mPrefetchesDone;
+        WorkQueue::CancelToken mPrefetchToken;
 
         bool mVisible;
 
+        /// Time the current update may spend splitting nodes, 0 for no limit
+        std::chrono::microseconds mUpdateBudget;
+        std::chrono::steady_clock::time_point mUpdateStart;
+        /// Splits done and put off during the last update
+        size_t mNodesSplit;
+        size_t mSplitsDeferred;
+        std::chrono::microseconds mLastUpdateTime;
+
+        float mErrorDistanceScale;
+
+        /// Quad tree nodes are created and destroyed all the time while moving around, so
+        /// they and their material generators are pooled, and their scene nodes recycled
+        ObjectPool<QuadTreeNode> mNodePool;
+        ObjectPool<MaterialGenerator> mMaterialGeneratorPool;
+        std::vector<osg::ref_ptr<osg::MatrixTransform>> mFreeSceneNodes;
+        size_t mSceneNodesCreated;
+        size_t mSceneNodesReused;
+
+        /// Every live node by location code, for constant time lookups
+        LinearQuadTree mLinearQuadTree;
+        /// Geometric errors of every chunk loaded so far, so nodes know theirs as soon as
+        /// they're created again
+        std::unordered_map<LocationCode,float> mGeometricErrors;
+
         QuadTreeNode* mRootNode;
         osg::ref_ptr<osg::Group> mRootSceneNode;
 
@@ -99,7 +200,24 @@ namespace Terrain
 
         //Ogre::SceneManager* mCompositeMapSceneMgr;
         osg::ref_ptr<osg::Group> mCompositorRootSceneNode;
-        bool mCompositorRan;
+        CompositeMapRenderer *mCompositeMapRenderer;
+        /// nullptr without shaders
+        CompositeMapPool *mCompositeMapPool;
+
+        /// Composite maps rendered in earlier runs
+        CompositeMapStore *mCompositeMapStore;
+        /// Pages being loaded from the store, with the request loading each. A page's
+        /// entry is replaced if it's recycled for another node in the meantime.
+        std::map<int,const WorkQueue::Request*> mCompositeMapsLoading;
+        /// Rendered maps being compressed into the store
+        int mCompositeMapsStoring;
+        WorkQueue::CancelToken mCompositeStoreToken;
+        std::vector<CompositeMapRenderer::ReadBack> mReadBacks;
+
+        bool mCompressCompositeMaps;
+        /// Rendered maps being block compressed, and the number of nodes that switched to theirs
+        int mCompositeMapsCompressing;
+        size_t mCompositeMapsCompressed;
 
         bool mUpdateIndexBuffers;
 
@@ -111,21 +229,72 @@ namespace Terrain
 
         /// Composite map size
         int mCompositeMapSize;
+        unsigned int mCompositeMapPages;
+
+        bool mCompactVertices;
 
     public:
         // ----INTERNAL----
         //Ogre::SceneManager* getCompositeMapSceneManager() { return mCompositeMapSceneMgr; }
 
-        void renderCompositeMap(osg::Texture2D *target, osg::Texture2D *normalmap, osg::Geode *geode);
-        void setCompositorRan() { mCompositorRan = true; }
+        /// Pages for nodes' composite maps, or nullptr if composite maps aren't used
+        CompositeMapPool *getCompositeMapPool() { return mCompositeMapPool; }
+        /// Queue rendering a composite map into a page leased for a node. It's done within the
+        /// next few frames, together with the other composite maps queued by then.
+        /// @param store add the result to the composite map store, if one is open
+        void renderCompositeMap(int page, LocationCode code, osg::Geode *geode, bool store);
+        /// Queue loading a node's composite map from the store into its page in the background,
+        /// and rendering it from there.
+        /// @return false if the map isn't stored, so it needs to be rendered from scratch
+        bool loadCompositeMap(QuadTreeNode *node);
+        /// Whether a page was queued for loading or rendering for this node but isn't rendered yet
+        bool isCompositeMapPending(int page, LocationCode code) const;
 
         void setUpdateIndexBuffers() { mUpdateIndexBuffers = true; }
 
+        const LinearQuadTree& getLinearQuadTree() const { return mLinearQuadTree; }
+
+        /// Geometric error of the chunk of the node with this location code, or negative if
+        /// it was never loaded
+        float getKnownGeometricError(LocationCode code) const;
+        void setKnownGeometricError(LocationCode code, float error) { mGeometricErrors[code] = error; }
+
+        // Whether a node may create its children now, or should wait for a
+        // later update because this one ran out of time. Counts the split.
+        bool mayBuildChildren();
+
+        // Pooled replacements for new/delete of quad tree nodes and their parts
+        QuadTreeNode *createNode(ChildDirection dir, int size, const osg::Vec2f &center, QuadTreeNode *parent);
+        void destroyNode(QuadTreeNode *node);
+        MaterialGenerator *createMaterialGenerator();
+        void destroyMaterialGenerator(MaterialGenerator *generator);
+        // Get a detached scene node with no children and an identity transform
+        osg::ref_ptr<osg::MatrixTransform> createSceneNode();
+        // Detach a scene node and keep it for reuse
+        void recycleSceneNode(osg::MatrixTransform *node);
+
+        // Where the camera is expected to be shortly, going by its recent velocity
+        const osg::Vec3f& getPredictedCameraPos() const { return mPredictedCameraPos; }
+
+        // Whether the given world bounds are in or near the view, or will be shortly
+        bool isInView(const osg::BoundingBoxf &worldBounds) const;
+        // Priority of loading data for the given world bounds, lower values first
+        float getLoadPriority(const osg::BoundingBoxf &worldBounds) const;
+
         // Adds a WorkQueue request to load a chunk for this node in the background.
         void queueChunkLoad(QuadTreeNode* node);
+        // Generate this node's chunk, or those of the children it doesn't have yet,
+        // into the tile cache, so they're ready by the time the camera gets there.
+        // Returns false if that isn't possible right now.
+        bool prefetchChunk(const QuadTreeNode* node);
+        bool prefetchChildChunks(const QuadTreeNode* node);
         // Adds a WorkQueue request to load layers for this node in the background.
         void queueLayerLoad(QuadTreeNode* leaf);
 
+        // Blocks until at least one background request finishes, and handles
+        // any completed requests.
+        void waitForResponses();
+
     private:
         //Ogre::RenderTarget* mCompositeMapRenderTarget;
         //Ogre::TexturePtr mCompositeMapRenderTexture;
@@ -134,6 +303,14 @@ namespace Terrain
     struct LoadRequestData
     {
         QuadTreeNode* mNode;
+        // Copied from the node, so the worker thread doesn't need to touch it
+        size_t mLodLevel;
+        int mSize;
+        osg::Vec2f mCenter;
+        // For prioritizing. Prefetches have no node.
+        osg::BoundingBoxf mWorldBounds;
+        // Resident chunks the storage may reuse vertices from
+        std::vector<GeneratedChunk> mKnown;
 
         friend std::ostream& operator<<(std::ostream& o, const LoadRequestData& r)
         { return o; }
@@ -141,10 +318,22 @@ namespace Terrain
 
     struct LoadResponseData
     {
+        LoadResponseData() : mGeometricError(0.0f) { }
+
         std::vector<osg::Vec3f> mPositions;
         std::vector<osg::Vec3f> mNormals;
         std::vector<osg::Vec4ub> mColours;
 
+        // Compact vertex format, used instead of the above
+        std::vector<float> mHeights;
+        std::vector<osg::Vec2s> mPackedNormals;
+
+        /// Height of each vertex at the next coarser LOD level, for geomorphing. Only with shaders.
+        std::vector<float> mMorphHeights;
+
+        /// See Storage::fillVertexBuffers
+        float mGeometricError;
+
         friend std::ostream& operator<<(std::ostream& o, const LoadResponseData& r)
         { return o; }
     };
@@ -152,6 +341,8 @@ namespace Terrain
     struct LayerRequestData
     {
         QuadTreeNode *mNode;
+        int mSize;
+        osg::Vec2f mCenter;
         bool mPack;
 
         friend std::ostream& operator<<(std::ostream& o, const LayerRequestData& r)
@@ -168,6 +359,26 @@ namespace Terrain
         { return o; }
     };
 
+    struct CompositeMapData
+    {
+        // Loading and compressing only
+        QuadTreeNode *mNode;
+        int mPage;
+        // For prioritizing loads
+        osg::BoundingBoxf mWorldBounds;
+
+        LocationCode mCode;
+        uint64_t mConfigHash;
+        int mPageSize;
+        // Read from the store when loading, null if that failed. Written to the store when storing.
+        // Replaced with block compressed copies when compressing.
+        osg::ref_ptr<osg::Image> mComposite;
+        osg::ref_ptr<osg::Image> mNormal;
+
+        friend std::ostream& operator<<(std::ostream& o, const CompositeMapData& r)
+        { return o; }
+    };
+
 }
 
 #endif
@@ -47,6 +47,38 @@ namespace Terrain
         }
     }
 
+    /// Undo convertPosition
+    inline void unconvertPosition(Alignment align, float &x, float &y, float &z)
+    {
+        switch (align)
+        {
+        case Align_XY:
+            return;
+        case Align_XZ:
+            z *= -1;
+            std::swap(y, z);
+            return;
+        case Align_YZ:
+            std::swap(y, z);
+            std::swap(x, y);
+            return;
+        }
+    }
+
+    /// Get the height back out of a position converted with convertPosition
+    inline float getConvertedHeight(Alignment align, float x, float y, float z)
+    {
+        switch (align)
+        {
+        case Align_XY:
+            return z;
+        case Align_XZ:
+        case Align_YZ:
+            return y;
+        }
+        return z;
+    }
+
     enum Direction
     {
         North = 0,
@@ -0,0 +1,243 @@
+#include "linearquadtree.hpp"
+
+#include <cassert>
+#include <cmath>
+
+namespace
+{
+
+const uint64_t EvenBits = 0x5555555555555555ull;
+const uint64_t OddBits  = 0xAAAAAAAAAAAAAAAAull;
+
+// Spread the bits of a 32-bit value out to the even bits of a 64-bit value
+uint64_t dilate(uint32_t value)
+{
+    uint64_t x = value;
+    x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+    x = (x | (x <<  8)) & 0x00FF00FF00FF00FFull;
+    x = (x | (x <<  4)) & 0x0F0F0F0F0F0F0F0Full;
+    x = (x | (x <<  2)) & 0x3333333333333333ull;
+    x = (x | (x <<  1)) & 0x5555555555555555ull;
+    return x;
+}
+
+int countTrailingZeros(uint64_t value)
+{
+    assert(value != 0);
+#ifdef __GNUC__
+    return __builtin_ctzll(value);
+#else
+    int count = 0;
+    while(!(value & 1))
+    {
+        value >>= 1;
+        ++count;
+    }
+    return count;
+#endif
+}
+
+int getHighestBit(uint64_t value)
+{
+    assert(value != 0);
+#ifdef __GNUC__
+    return 63 - __builtin_clzll(value);
+#else
+    int bit = 0;
+    while(value >>= 1)
+        ++bit;
+    return bit;
+#endif
+}
+
+// Morton digit of a child, x in the low bit and y in the high bit
+const uint64_t ChildDigits[4] = {
+    2, // NW: x 0, y 1
+    3, // NE: x 1, y 1
+    0, // SW: x 0, y 0
+    1  // SE: x 1, y 0
+};
+
+}
+
+namespace Terrain
+{
+
+LocationCode getChildCode(LocationCode parent, ChildDirection dir)
+{
+    assert(dir != Root);
+    assert(getDepth(parent) < MaxQuadTreeDepth);
+    return (parent << 2) | ChildDigits[dir];
+}
+
+int getDepth(LocationCode code)
+{
+    return getHighestBit(code) / 2;
+}
+
+bool getNeighbourCode(LocationCode code, Direction dir, LocationCode &neighbour)
+{
+    const int depth = getDepth(code);
+    const uint64_t sentinel = uint64_t(1) << (2*depth);
+    const uint64_t morton = code & (sentinel-1);
+    const uint64_t xBits = EvenBits & (sentinel-1);
+    const uint64_t yBits = OddBits & (sentinel-1);
+
+    // Dilated integer arithmetic: filling the gaps between the bits of one
+    // axis with ones lets carries run straight through them
+    uint64_t x = morton & xBits;
+    uint64_t y = morton & yBits;
+    switch(dir)
+    {
+    case East:
+        if(x == xBits) return false;
+        x = ((x | yBits) + 1) & xBits;
+        break;
+    case West:
+        if(x == 0) return false;
+        x = (x - 1) & xBits;
+        break;
+    case North:
+        if(y == yBits) return false;
+        y = ((y | xBits) + 1) & yBits;
+        break;
+    case South:
+        if(y == 0) return false;
+        y = (y - 1) & yBits;
+        break;
+    }
+    neighbour = sentinel | x | y;
+    return true;
+}
+
+
+LinearQuadTree::LinearQuadTree()
+  : mEntries(64, Entry{0, nullptr})
+  , mNumNodes(0)
+  , mMaxDepth(0)
+{
+}
+
+void LinearQuadTree::setRoot(const osg::Vec2f &center, int size)
+{
+    assert(size > 0 && (size & (size-1)) == 0);
+    mMaxDepth = 0;
+    while((1<<mMaxDepth) < size)
+        ++mMaxDepth;
+    assert(mMaxDepth <= MaxQuadTreeDepth);
+    mRootOrigin = center - osg::Vec2f(size/2.f, size/2.f);
+}
+
+size_t LinearQuadTree::getSlot(LocationCode code) const
+{
+    // Fibonacci hashing, the table size being a power of two
+    return size_t((code * 0x9E3779B97F4A7C15ull) >> 32) & (mEntries.size()-1);
+}
+
+void LinearQuadTree::grow()
+{
+    std::vector<Entry> entries(mEntries.size()*2, Entry{0, nullptr});
+    entries.swap(mEntries);
+    mNumNodes = 0;
+    for(const Entry &entry : entries)
+    {
+        if(entry.mCode != 0)
+            insert(entry.mCode, entry.mNode);
+    }
+}
+
+void LinearQuadTree::insert(LocationCode code, QuadTreeNode *node)
+{
+    assert(code != 0);
+    // Keep probe sequences short
+    if((mNumNodes+1)*2 > mEntries.size())
+        grow();
+
+    size_t slot = getSlot(code);
+    while(mEntries[slot].mCode != 0 && mEntries[slot].mCode != code)
+        slot = (slot+1) & (mEntries.size()-1);
+    if(mEntries[slot].mCode == 0)
+        ++mNumNodes;
+    mEntries[slot].mCode = code;
+    mEntries[slot].mNode = node;
+}
+
+void LinearQuadTree::remove(LocationCode code)
+{
+    const size_t mask = mEntries.size()-1;
+    size_t slot = getSlot(code);
+    while(mEntries[slot].mCode != code)
+    {
+        if(mEntries[slot].mCode == 0)
+            return;
+        slot = (slot+1) & mask;
+    }
+    mEntries[slot] = Entry{0, nullptr};
+    --mNumNodes;
+
+    // Move following entries of the same probe sequence back into the hole,
+    // so lookups don't need tombstones
+    size_t hole = slot;
+    for(size_t next = (slot+1) & mask;mEntries[next].mCode != 0;next = (next+1) & mask)
+    {
+        size_t home = getSlot(mEntries[next].mCode);
+        // Can the entry move to the hole without ending up before its home slot?
+        if(((next - home) & mask) >= ((next - hole) & mask))
+        {
+            mEntries[hole] = mEntries[next];
+            mEntries[next] = Entry{0, nullptr};
+            hole = next;
+        }
+    }
+}
+
+QuadTreeNode *LinearQuadTree::find(LocationCode code) const
+{
+    const size_t mask = mEntries.size()-1;
+    for(size_t slot = getSlot(code);mEntries[slot].mCode != 0;slot = (slot+1) & mask)
+    {
+        if(mEntries[slot].mCode == code)
+            return mEntries[slot].mNode;
+    }
+    return nullptr;
+}
+
+QuadTreeNode *LinearQuadTree::findNeighbour(LocationCode code, Direction dir) const
+{
+    LocationCode neighbour;
+    if(!getNeighbourCode(code, dir, neighbour))
+        return nullptr;
+
+    // If the neighbour isn't split that far, one of its ancestors covers it.
+    // Up to the root (code 1), which may not be registered yet.
+    for(;neighbour != 0;neighbour >>= 2)
+    {
+        if(QuadTreeNode *node = find(neighbour))
+            return node;
+    }
+    return nullptr;
+}
+
+bool LinearQuadTree::getCodeAt(const osg::Vec2f &center, LocationCode &code) const
+{
+    // In half cells from the root's corner, a node at depth d has its center
+    // at an odd multiple of 2^(maxDepth-d)
+    const float limit = float(uint64_t(2) << mMaxDepth);
+    const float fx = (center.x() - mRootOrigin.x()) * 2.f;
+    const float fy = (center.y() - mRootOrigin.y()) * 2.f;
+    if(!(fx > 0.f && fx < limit && fy > 0.f && fy < limit) ||
+       fx != std::floor(fx) || fy != std::floor(fy))
+        return false;
+
+    const uint64_t x = uint64_t(fx);
+    const uint64_t y = uint64_t(fy);
+    const int shift = countTrailingZeros(x);
+    if(countTrailingZeros(y) != shift)
+        return false;
+
+    const int depth = mMaxDepth - shift;
+    code = (uint64_t(1) << (2*depth)) | dilate(uint32_t(x >> (shift+1))) | (dilate(uint32_t(y >> (shift+1))) << 1);
+    return true;
+}
+
+}
@@ -0,0 +1,84 @@
+#ifndef COMPONENTS_TERRAIN_LINEARQUADTREE_H
+#define COMPONENTS_TERRAIN_LINEARQUADTREE_H
+
+#include <cstdint>
+#include <vector>
+
+#include <osg/Vec2f>
+
+#include "defs.hpp"
+
+namespace Terrain
+{
+
+    class QuadTreeNode;
+
+    /// Identifies a quad tree node by its depth and position: a 1 bit marking the
+    /// depth, followed by the Morton code of the node's position at that depth
+    /// (x in the even bits, y in the odd ones). The root is 1.
+    typedef uint64_t LocationCode;
+
+    /// Deepest level location codes can represent
+    const int MaxQuadTreeDepth = 31;
+
+    /// Location code of a child
+    LocationCode getChildCode(LocationCode parent, ChildDirection dir);
+
+    /// Number of levels below the root
+    int getDepth(LocationCode code);
+
+    /// Location code of the node of the same size next to the one given, in constant time.
+    /// @return false if that would be outside of the root node
+    bool getNeighbourCode(LocationCode code, Direction dir, LocationCode &neighbour);
+
+    /// @brief Index of the live quad tree nodes by location code, kept in one flat
+    ///        open-addressing table, so finding a node or its neighbours doesn't
+    ///        involve walking the tree.
+    class LinearQuadTree
+    {
+    public:
+        LinearQuadTree();
+
+        /// @param center center of the root node in cell units
+        /// @param size size of the root node in cell units, a power of two
+        void setRoot(const osg::Vec2f &center, int size);
+
+        void insert(LocationCode code, QuadTreeNode *node);
+        void remove(LocationCode code);
+
+        /// Get the node with this location code, or nullptr if it doesn't exist.
+        QuadTreeNode *find(LocationCode code) const;
+
+        /// Get the node of the same size next to the node with the given location code, or if
+        /// that isn't part of the tree, the smallest larger node covering its place.
+        /// @return nullptr for nodes at the edge of the root, or if no node covers the place
+        QuadTreeNode *findNeighbour(LocationCode code, Direction dir) const;
+
+        /// Get the location code of the node with this center.
+        /// @return false if no node could have this center
+        bool getCodeAt(const osg::Vec2f &center, LocationCode &code) const;
+
+        size_t getNumNodes() const { return mNumNodes; }
+
+    private:
+        struct Entry
+        {
+            /// 0 for unused entries
+            LocationCode mCode;
+            QuadTreeNode *mNode;
+        };
+
+        size_t getSlot(LocationCode code) const;
+        void grow();
+
+        std::vector<Entry> mEntries;
+        size_t mNumNodes;
+
+        osg::Vec2f mRootOrigin;
+        /// Depth of nodes with a size of one cell
+        int mMaxDepth;
+    };
+
+}
+
+#endif
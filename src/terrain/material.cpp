@@ -12,9 +12,12 @@
 #include <osg/Depth>
 #include <osg/CullFace>
 #include <osg/Texture2D>
+#include <osg/Texture2DArray>
 
 #include <osgDB/ReadFile>
 
+#include "tilestore.hpp"
+
 #if TERRAIN_USE_SHADER
 #include <boost/functional/hash.hpp>
 
@@ -115,6 +118,46 @@ void getShaderForLayer(std::ostream &stream, const Terrain::LayerInfo &layer, si
     stream<<"\n";
 }
 
+// Sample a block compressed composite normal map, which only has x and y
+const char *sCompressedNormalFunc =
+    "vec4 sampleCompressedNormal(sampler2D tex, vec2 uv)\n"
+    "{\n"
+    "    vec2 xy = texture(tex, uv).rg*2.0 - vec2(1.0);\n"
+    "    float z = sqrt(max(1.0 - dot(xy, xy), 0.0));\n"
+    "    return vec4(vec3(xy, z)*0.5 + vec3(0.5), 1.0);\n"
+    "}\n";
+
+void getCompositeShaderHeader(std::ostream &stream, bool compressed)
+{
+    if(compressed)
+    {
+        // Textures of their own, swapped in once compressed
+        stream<<
+            "uniform sampler2D compositeTex;\n"<<
+            "uniform sampler2D compositeNormalTex;\n"<<
+            "\n"<<
+            sCompressedNormalFunc<<
+            "\n"<<
+            "void main()\n"<<
+            "{\n"<<
+            "    vec4 color = texture(compositeTex, TexCoords.xy);\n"<<
+            "    vec4 nn = sampleCompressedNormal(compositeNormalTex, TexCoords.xy);\n"<<
+            "\n";
+        return;
+    }
+    // The composite map and its normal map are layers of the composite map pool
+    stream<<
+        "uniform sampler2DArray compositeTex;\n"<<
+        "uniform sampler2DArray compositeNormalTex;\n"<<
+        "uniform float compositePage;\n"<<
+        "\n"<<
+        "void main()\n"<<
+        "{\n"<<
+        "    vec4 color = texture(compositeTex, vec3(TexCoords.xy, compositePage));\n"<<
+        "    vec4 nn = texture(compositeNormalTex, vec3(TexCoords.xy, compositePage));\n"<<
+        "\n";
+}
+
 void getShaderFooter(std::ostream &stream)
 {
     // Declare the normal rotation matrix to convert the calculated surface-
@@ -194,11 +237,15 @@ public:
 };
 
 
-std::map<LayerIdentifier,osg::ref_ptr<osg::Program>> MaterialGenerator::mPrograms;
+std::map<std::pair<LayerIdentifier,bool>,osg::ref_ptr<osg::Program>> MaterialGenerator::mPrograms;
+osg::ref_ptr<osg::Program> MaterialGenerator::mCompositePrograms[2][2];
+osg::ref_ptr<osg::Program> MaterialGenerator::mDownsamplePrograms[2];
+osg::ref_ptr<osg::Program> MaterialGenerator::mUploadProgram;
 
 
 MaterialGenerator::MaterialGenerator(Storage *storage)
     : mShaders(true)
+    , mCompactVertices(false)
     , mShadows(false)
     , mSplitShadows(false)
     , mNormalMapping(true)
@@ -211,44 +258,185 @@ osg::StateSet *MaterialGenerator::generate()
 {
     assert(!mLayerList.empty() && "Can't create material with no layers");
 
-    return create(false, nullptr, nullptr, 0);
+    return create(false, nullptr, nullptr, -1, 0);
 }
 
 osg::StateSet *MaterialGenerator::generateForCompositeMapRTT(int lodLevel)
 {
     assert(!mLayerList.empty() && "Can't create material with no layers");
 
-    return create(true, nullptr, nullptr, lodLevel);
+    return create(true, nullptr, nullptr, -1, lodLevel);
+}
+
+osg::StateSet *MaterialGenerator::generateForCompositeMap(osg::Texture2DArray *compositePages, osg::Texture2DArray *normalPages, int page)
+{
+    return create(false, compositePages, normalPages, page, 0);
 }
 
-osg::StateSet *MaterialGenerator::generateForCompositeMap(osg::Texture2D *compositeMap, osg::Texture2D *normalMap)
+osg::StateSet *MaterialGenerator::generateForCompositeMap(osg::Texture2D *composite, osg::Texture2D *normal)
 {
-    return create(false, compositeMap, normalMap, 0);
+    return create(false, composite, normal, -1, 0);
 }
 
-osg::StateSet *MaterialGenerator::create(bool renderCompositeMap, osg::Texture2D *compositeMap, osg::Texture2D *normalMap, int lodLevel)
+osg::StateSet *MaterialGenerator::generateForCompositeMapDownsample(osg::Texture2DArray *compositePages, osg::Texture2DArray *normalPages, int page)
+{
+    return createDownsample(compositePages, normalPages, page);
+}
+
+osg::StateSet *MaterialGenerator::generateForCompositeMapDownsample(osg::Texture2D *composite, osg::Texture2D *normal)
+{
+    return createDownsample(composite, normal, -1);
+}
+
+osg::StateSet *MaterialGenerator::createDownsample(osg::Texture *compositeMap, osg::Texture *normalMap, int page)
+{
+    assert(mShaders && "Composite map pages need shaders");
+
+    const bool compressed = (page < 0);
+    osg::ref_ptr<osg::StateSet> state = new osg::StateSet();
+    osg::ref_ptr<osg::Program> &prog = mDownsamplePrograms[compressed];
+    if(!prog.valid())
+    {
+        // The maps are already in the composite's format, and the quad's
+        // texture coordinates put them the right way up
+        std::stringstream sstr;
+        sstr<< "#version 130\n"
+               "\n";
+        if(compressed)
+            sstr<< "uniform sampler2D compositeTex;\n"
+                   "uniform sampler2D compositeNormalTex;\n"
+                   "\n"<<
+                   sCompressedNormalFunc;
+        else
+            sstr<< "uniform sampler2DArray compositeTex;\n"
+                   "uniform sampler2DArray compositeNormalTex;\n"
+                   "uniform float compositePage;\n";
+        sstr<< "\n"
+               "in vec4 TexCoord0;\n"
+               "\n"
+               "out vec4 ColorData;\n"
+               "out vec4 NormalData;\n"
+               "\n"
+               "void main()\n"
+               "{\n";
+        if(compressed)
+            sstr<< "    ColorData  = texture(compositeTex, TexCoord0.xy);\n"
+                   "    NormalData = sampleCompressedNormal(compositeNormalTex, TexCoord0.xy);\n";
+        else
+            sstr<< "    ColorData  = texture(compositeTex, vec3(TexCoord0.xy, compositePage));\n"
+                   "    NormalData = texture(compositeNormalTex, vec3(TexCoord0.xy, compositePage));\n";
+        sstr<< "}\n";
+
+        prog = new osg::Program();
+        prog->addShader(osgDB::readShaderFile(osg::Shader::VERTEX, "shaders/quad_2d.vert"));
+        prog->addShader(new osg::Shader(osg::Shader::FRAGMENT, sstr.str()));
+    }
+    state->setAttributeAndModes(prog.get());
+
+    // Sampled from their mipmaps when shrinking, so the result is filtered
+    state->setTextureAttribute(0, compositeMap);
+    state->setTextureAttribute(1, normalMap);
+    state->addUniform(new osg::Uniform("compositeTex", 0));
+    state->addUniform(new osg::Uniform("compositeNormalTex", 1));
+    if(!compressed)
+        state->addUniform(new osg::Uniform("compositePage", float(page)));
+    return state.release();
+}
+
+osg::StateSet *MaterialGenerator::generateForCompositeMapUpload(osg::Image *composite, osg::Image *normal)
+{
+    assert(mShaders && "Composite map pages need shaders");
+
+    osg::ref_ptr<osg::StateSet> state = new osg::StateSet();
+    if(!mUploadProgram.valid())
+    {
+        mUploadProgram = new osg::Program();
+        mUploadProgram->addShader(osgDB::readShaderFile(osg::Shader::VERTEX, "shaders/quad_2d.vert"));
+        mUploadProgram->addShader(new osg::Shader(osg::Shader::FRAGMENT,
+            "#version 130\n"
+            "\n"
+            "uniform sampler2D compositeTex;\n"
+            "uniform sampler2D compositeNormalTex;\n"
+            "\n"
+            "in vec4 TexCoord0;\n"
+            "\n"
+            "out vec4 ColorData;\n"
+            "out vec4 NormalData;\n"
+            "\n"
+            "void main()\n"
+            "{\n"
+            "    ColorData  = texture(compositeTex, TexCoord0.xy);\n"
+            "    NormalData = texture(compositeNormalTex, TexCoord0.xy);\n"
+            "}\n"
+        ));
+    }
+    state->setAttributeAndModes(mUploadProgram.get());
+
+    // Read back the same way they're laid out in the pages, so drawing them
+    // texel for texel reproduces the original
+    osg::Image *images[2] = { composite, normal };
+    for(int i = 0;i < 2;++i)
+    {
+        osg::ref_ptr<osg::Texture2D> tex = new osg::Texture2D(images[i]);
+        tex->setWrap(osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE);
+        tex->setWrap(osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE);
+        tex->setFilter(osg::Texture::MIN_FILTER, osg::Texture::NEAREST);
+        tex->setFilter(osg::Texture::MAG_FILTER, osg::Texture::NEAREST);
+        tex->setResizeNonPowerOfTwoHint(false);
+        tex->setUnRefImageDataAfterApply(true);
+        state->setTextureAttribute(i, tex.get());
+    }
+    state->addUniform(new osg::Uniform("compositeTex", 0));
+    state->addUniform(new osg::Uniform("compositeNormalTex", 1));
+    return state.release();
+}
+
+uint64_t MaterialGenerator::getCompositeMapHash() const
+{
+    const bool flags[] = { mNormalMapping, mParallaxMapping };
+    uint64_t hash = TileStore::hashBytes(flags, sizeof(flags));
+    for(const LayerInfo &layer : mLayerList)
+    {
+        const bool layerFlags[] = { layer.mParallax, layer.mSpecular };
+        // Include the terminators, so names can't run into each other
+        hash = TileStore::hashBytes(layer.mDiffuseMap.c_str(), layer.mDiffuseMap.size()+1, hash);
+        hash = TileStore::hashBytes(layer.mNormalMap.c_str(), layer.mNormalMap.size()+1, hash);
+        hash = TileStore::hashBytes(layerFlags, sizeof(layerFlags), hash);
+    }
+    return hash;
+}
+
+osg::StateSet *MaterialGenerator::create(bool renderCompositeMap, osg::Texture *compositeMap, osg::Texture *normalMap,
+                                         int page, int lodLevel)
 {
     assert(!renderCompositeMap || !compositeMap);
+    assert(!compositeMap || mShaders);
 
     osg::ref_ptr<osg::StateSet> state = new osg::StateSet();
     if(mShaders)
     {
+        // The composite map is rendered with a plain quad, not a terrain chunk
+        const bool compact = mCompactVertices && !renderCompositeMap;
+        const char *vertexShader = compact ? "shaders/terrain_compact.vert" : "shaders/terrain.vert";
+
         if(compositeMap)
         {
-            std::vector<Terrain::LayerInfo> layerList;
-            layerList.push_back(Terrain::LayerInfo{"dummy", "dummy", true, true});
-
-            osg::ref_ptr<osg::Program> &prog = mPrograms[LayerIdentifier(layerList)];
+            const bool compressed = (page < 0);
+            osg::ref_ptr<osg::Program> &prog = mCompositePrograms[compact][compressed];
             if(!prog.valid())
             {
                 prog = new osg::Program();
-                prog->addShader(osgDB::readShaderFile(osg::Shader::VERTEX, "shaders/terrain.vert"));
+                prog->addShader(osgDB::readShaderFile(osg::Shader::VERTEX, vertexShader));
+                prog->addBindAttribLocation("morphHeight", Attrib_MorphHeight);
+                if(compact)
+                {
+                    prog->addBindAttribLocation("height", Attrib_Height);
+                    prog->addBindAttribLocation("packedNormal", Attrib_PackedNormal);
+                }
 
                 std::stringstream sstr;
-                getShaderPreamble(sstr, layerList);
-                getShaderHeader(sstr, layerList);
-                for(size_t i = 1;i < layerList.size();++i)
-                    getShaderForLayer(sstr, layerList[i], i);
+                getShaderPreamble(sstr, std::vector<Terrain::LayerInfo>());
+                getCompositeShaderHeader(sstr, compressed);
                 getShaderFooter(sstr);
 
                 prog->addShader(new osg::Shader(osg::Shader::FRAGMENT, sstr.str()));
@@ -257,8 +445,10 @@ osg::StateSet *MaterialGenerator::create(bool renderCompositeMap, osg::Texture2D
 
             state->setTextureAttribute(0, compositeMap);
             state->setTextureAttribute(1, normalMap);
-            state->addUniform(new osg::Uniform("diffuseTex0", 0));
-            state->addUniform(new osg::Uniform("normalTex0", 1));
+            state->addUniform(new osg::Uniform("compositeTex", 0));
+            state->addUniform(new osg::Uniform("compositeNormalTex", 1));
+            if(!compressed)
+                state->addUniform(new osg::Uniform("compositePage", float(page)));
             state->addUniform(new osg::Uniform("diffuseTexMtx", osg::Matrixf::identity()));
             state->addUniform(new osg::Uniform("blendTexMtx", osg::Matrixf::identity()));
         }
@@ -266,11 +456,17 @@ osg::StateSet *MaterialGenerator::create(bool renderCompositeMap, osg::Texture2D
         {
             assert(mLayerList.size() == mBlendmapList.size()+1);
 
-            osg::ref_ptr<osg::Program> &prog = mPrograms[LayerIdentifier(mLayerList)];
+            osg::ref_ptr<osg::Program> &prog = mPrograms[std::make_pair(LayerIdentifier(mLayerList), compact)];
             if(!prog.valid())
             {
                 prog = new osg::Program();
-                prog->addShader(osgDB::readShaderFile(osg::Shader::VERTEX, "shaders/terrain.vert"));
+                prog->addShader(osgDB::readShaderFile(osg::Shader::VERTEX, vertexShader));
+                prog->addBindAttribLocation("morphHeight", Attrib_MorphHeight);
+                if(compact)
+                {
+                    prog->addBindAttribLocation("height", Attrib_Height);
+                    prog->addBindAttribLocation("packedNormal", Attrib_PackedNormal);
+                }
 
                 std::stringstream sstr;
                 getShaderPreamble(sstr, mLayerList);
@@ -332,8 +528,6 @@ osg::StateSet *MaterialGenerator::create(bool renderCompositeMap, osg::Texture2D
             state->addUniform(new osg::Uniform("blendTexMtx", osg::Matrixf::scale(scale, scale, 1.0f)));
         }
     }
-    else if(compositeMap)
-        state->setTextureAttributeAndModes(0, compositeMap);
     else
     {
         assert(mLayerList.size() == mBlendmapList.size()+1);
@@ -9,7 +9,10 @@
 namespace osg
 {
     class StateSet;
+    class Image;
+    class Texture;
     class Texture2D;
+    class Texture2DArray;
 }
 
 namespace Terrain
@@ -17,17 +20,31 @@ namespace Terrain
 
 class LayerIdentifier;
 
+/// Generic vertex attribute locations used by terrain chunks
+enum CompactVertexAttrib
+{
+    /// Height the vertex would have at the next coarser LOD level, as a float
+    Attrib_MorphHeight = 1,
+    /// Vertex height, as a float (compact vertex format only)
+    Attrib_Height = 6,
+    /// Octahedral-encoded normal, as two normalized shorts (compact vertex format only)
+    Attrib_PackedNormal = 7
+};
+
 class MaterialGenerator
 {
 public:
     MaterialGenerator(Storage *storage);
 
     void setLayerList(const std::vector<LayerInfo>& layerList) { mLayerList = layerList; }
+    const std::vector<LayerInfo>& getLayerList() const { return mLayerList; }
     bool hasLayers() const { return !mLayerList.empty(); }
     void setBlendmapList(const std::vector<osg::ref_ptr<osg::Image>>& blendmapList) { mBlendmapList = blendmapList; }
     const std::vector<osg::ref_ptr<osg::Image>>& getBlendmapList() const { return mBlendmapList; }
 
     void enableShaders(bool shaders) { mShaders = shaders; }
+    /// Use the compact vertex format for chunks (requires shaders).
+    void enableCompactVertices(bool compact) { mCompactVertices = compact; }
     void enableShadows(bool shadows) { mShadows = shadows; }
     void enableNormalMapping(bool normalMapping) { mNormalMapping = normalMapping; }
     void enableParallaxMapping(bool parallaxMapping) { mParallaxMapping = parallaxMapping; }
@@ -36,19 +53,40 @@ public:
     /// Creates a StateSet suitable for displaying a chunk of terrain.
     osg::StateSet *generate();
 
-    /// Creates a StateSet suitable for displaying a chunk of terrain using a ready-made composite map and normal map.
-    osg::StateSet *generateForCompositeMap(osg::Texture2D *compositeMap, osg::Texture2D *normalMap);
+    /// Creates a StateSet suitable for displaying a chunk of terrain using a ready-made composite map and normal map,
+    /// found in a page of the composite map pool. Requires shaders.
+    osg::StateSet *generateForCompositeMap(osg::Texture2DArray *compositePages, osg::Texture2DArray *normalPages, int page);
+    /// Same, for a block compressed composite map with textures of its own. The normal map has only x and y.
+    osg::StateSet *generateForCompositeMap(osg::Texture2D *composite, osg::Texture2D *normal);
 
     /// Creates a StateSet suitable for rendering composite maps, i.e. for "baking" several layer textures
     /// into one. The main difference compared to a normal StateSet is that no shading is applied at this point.
     osg::StateSet *generateForCompositeMapRTT(int lodLevel);
 
+    /// Creates a StateSet for rendering a composite map from a more detailed node's composite map
+    /// and normal map, copying them as they are into part of the new one. Requires shaders.
+    osg::StateSet *generateForCompositeMapDownsample(osg::Texture2DArray *compositePages, osg::Texture2DArray *normalPages, int page);
+    osg::StateSet *generateForCompositeMapDownsample(osg::Texture2D *composite, osg::Texture2D *normal);
+
+    /// Creates a StateSet for rendering a composite map from a copy of it and its normal map read back
+    /// earlier, e.g. from a CompositeMapStore. Requires shaders.
+    osg::StateSet *generateForCompositeMapUpload(osg::Image *composite, osg::Image *normal);
+
+    /// Hash of the layers and settings that go into rendering a composite map, for recognizing
+    /// stored ones. The blendmaps are not included.
+    uint64_t getCompositeMapHash() const;
+
 private:
-    osg::StateSet *create(bool renderCompositeMap, osg::Texture2D *compositeMap, osg::Texture2D *normalMap, int lodLevel);
+    /// @param page layer of the composite map pool holding the composite map, or -1 for
+    ///        block compressed maps with textures of their own
+    osg::StateSet *create(bool renderCompositeMap, osg::Texture *compositeMap, osg::Texture *normalMap,
+                          int page, int lodLevel);
+    osg::StateSet *createDownsample(osg::Texture *compositeMap, osg::Texture *normalMap, int page);
 
     std::vector<LayerInfo> mLayerList;
     std::vector<osg::ref_ptr<osg::Image>> mBlendmapList;
     bool mShaders;
+    bool mCompactVertices;
     bool mShadows;
     bool mSplitShadows;
     bool mNormalMapping;
@@ -56,7 +94,14 @@ private:
 
     Storage *mStorage;
 
-    static std::map<LayerIdentifier,osg::ref_ptr<osg::Program>> mPrograms;
+    // Keyed by the layer configuration, and whether they're for the compact vertex format
+    static std::map<std::pair<LayerIdentifier,bool>,osg::ref_ptr<osg::Program>> mPrograms;
+    // For chunks using a composite map, by whether they're for the compact vertex format,
+    // then by whether the composite map is block compressed
+    static osg::ref_ptr<osg::Program> mCompositePrograms[2][2];
+    // By whether the composite map is block compressed
+    static osg::ref_ptr<osg::Program> mDownsamplePrograms[2];
+    static osg::ref_ptr<osg::Program> mUploadProgram;
 };
 
 }
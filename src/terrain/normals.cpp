@@ -0,0 +1,66 @@
+#include "normals.hpp"
+
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+
+// Calculate a row of normals into separate x/y/z arrays. center points at
+// the first height of the row, with the border samples around it.
+void computeNormalRow(const float *center, int stride, int width, float scale,
+                      float *nx, float *ny, float *nz)
+{
+    const float *up = center + stride;
+    const float *down = center - stride;
+
+    int x = 0;
+#ifdef __SSE2__
+    const __m128 vscale = _mm_set1_ps(scale);
+    const __m128 one = _mm_set1_ps(1.0f);
+    for(;x+4 <= width;x += 4)
+    {
+        __m128 dx = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(center+x-1), _mm_loadu_ps(center+x+1)), vscale);
+        __m128 dy = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(down+x), _mm_loadu_ps(up+x)), vscale);
+        __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), one));
+        __m128 inv = _mm_div_ps(one, len);
+        _mm_storeu_ps(nx+x, _mm_mul_ps(dx, inv));
+        _mm_storeu_ps(ny+x, _mm_mul_ps(dy, inv));
+        _mm_storeu_ps(nz+x, inv);
+    }
+#endif
+    for(;x < width;++x)
+    {
+        float dx = (center[x-1] - center[x+1]) * scale;
+        float dy = (down[x] - up[x]) * scale;
+        float inv = 1.0f / std::sqrt(dx*dx + dy*dy + 1.0f);
+        nx[x] = dx * inv;
+        ny[x] = dy * inv;
+        nz[x] = inv;
+    }
+}
+
+}
+
+namespace Terrain
+{
+
+void computeNormals(const float *heights, int width, int height, float scale, osg::Vec3f *normals)
+{
+    const int stride = width+2;
+    std::vector<float> row(width*3);
+    float *nx = &row[0];
+    float *ny = nx + width;
+    float *nz = ny + width;
+    for(int y = 0;y < height;++y)
+    {
+        computeNormalRow(heights + (y+1)*stride + 1, stride, width, scale, nx, ny, nz);
+        for(int x = 0;x < width;++x)
+            normals[x*height + y] = osg::Vec3f(nx[x], ny[x], nz[x]);
+    }
+}
+
+}
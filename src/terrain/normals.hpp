@@ -0,0 +1,49 @@
+#ifndef COMPONENTS_TERRAIN_NORMALS_H
+#define COMPONENTS_TERRAIN_NORMALS_H
+
+#include <cmath>
+
+#include <osg/Vec2f>
+#include <osg/Vec2s>
+#include <osg/Vec3f>
+
+namespace Terrain
+{
+
+    /// Calculate vertex normals from a grid of heights using central differences.
+    /// @param heights row-major grid of (width+2) x (height+2) heights, including a border
+    ///        of one sample on each side
+    /// @param width number of normals to calculate along x
+    /// @param height number of normals to calculate along y
+    /// @param scale factor applied to height differences before normalizing, i.e. the
+    ///        reciprocal of the horizontal distance the differences are taken over
+    /// @param normals receives width*height unit normals, column by column (x*height + y)
+    void computeNormals(const float *heights, int width, int height, float scale, osg::Vec3f *normals);
+
+    /// Map a unit vector onto the octahedron, unfolded into -1...+1 on each axis.
+    inline osg::Vec2f encodeOctahedral(const osg::Vec3f &normal)
+    {
+        float len = std::abs(normal.x()) + std::abs(normal.y()) + std::abs(normal.z());
+        float x = normal.x() / len;
+        float y = normal.y() / len;
+        if(normal.z() < 0.0f)
+        {
+            float foldedX = (1.0f - std::abs(y)) * ((x >= 0.0f) ? 1.0f : -1.0f);
+            float foldedY = (1.0f - std::abs(x)) * ((y >= 0.0f) ? 1.0f : -1.0f);
+            x = foldedX;
+            y = foldedY;
+        }
+        return osg::Vec2f(x, y);
+    }
+
+    /// Octahedral-encode a unit vector into two signed normalized 16-bit components.
+    inline osg::Vec2s packOctahedral(const osg::Vec3f &normal)
+    {
+        osg::Vec2f encoded = encodeOctahedral(normal);
+        return osg::Vec2s(short(std::floor(encoded.x()*32767.0f + 0.5f)),
+                          short(std::floor(encoded.y()*32767.0f + 0.5f)));
+    }
+
+}
+
+#endif
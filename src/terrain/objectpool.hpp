@@ -0,0 +1,106 @@
+#ifndef COMPONENTS_TERRAIN_OBJECTPOOL_H
+#define COMPONENTS_TERRAIN_OBJECTPOOL_H
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace Terrain
+{
+
+    /// @brief Allocates objects of one type from blocks of slots, reusing the slots of
+    ///        destroyed objects. Memory is only returned when the pool goes away.
+    /// @note Not thread safe.
+    template<typename T>
+    class ObjectPool
+    {
+    public:
+        /// @param blockSize number of objects to allocate memory for at once
+        ObjectPool(size_t blockSize=256)
+          : mBlockSize(blockSize)
+          , mFreeList(nullptr)
+          , mNumLive(0)
+          , mNumCreated(0)
+        { }
+
+        ~ObjectPool()
+        {
+            assert(mNumLive == 0 && "Objects still alive when destroying their pool");
+        }
+
+        template<typename... Args>
+        T *create(Args&&... args)
+        {
+            if(!mFreeList)
+                allocateBlock();
+
+            Slot *slot = mFreeList;
+            mFreeList = slot->mNext;
+            T *obj;
+            try {
+                obj = new(&slot->mStorage) T(std::forward<Args>(args)...);
+            }
+            catch(...) {
+                slot->mNext = mFreeList;
+                mFreeList = slot;
+                throw;
+            }
+            ++mNumLive;
+            ++mNumCreated;
+            return obj;
+        }
+
+        void destroy(T *obj)
+        {
+            if(!obj)
+                return;
+            obj->~T();
+
+            Slot *slot = reinterpret_cast<Slot*>(obj);
+            slot->mNext = mFreeList;
+            mFreeList = slot;
+            --mNumLive;
+        }
+
+        /// Number of objects currently alive
+        size_t getNumLive() const { return mNumLive; }
+        /// Number of objects ever created
+        size_t getNumCreated() const { return mNumCreated; }
+        /// Number of objects there is memory for
+        size_t getCapacity() const { return mBlocks.size() * mBlockSize; }
+        /// Number of heap allocations made for the objects
+        size_t getNumBlocks() const { return mBlocks.size(); }
+
+    private:
+        union Slot
+        {
+            Slot *mNext;
+            typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type mStorage;
+        };
+
+        void allocateBlock()
+        {
+            mBlocks.push_back(std::unique_ptr<Slot[]>(new Slot[mBlockSize]));
+            Slot *block = mBlocks.back().get();
+            for(size_t i = mBlockSize;i > 0;--i)
+            {
+                block[i-1].mNext = mFreeList;
+                mFreeList = &block[i-1];
+            }
+        }
+
+        size_t mBlockSize;
+        std::vector<std::unique_ptr<Slot[]>> mBlocks;
+        Slot *mFreeList;
+
+        size_t mNumLive;
+        size_t mNumCreated;
+    };
+
+}
+
+#endif
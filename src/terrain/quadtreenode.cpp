@@ -1,18 +1,24 @@
 #include "quadtreenode.hpp"
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <limits>
 
 #include <osg/MatrixTransform>
 #include <osg/Drawable>
 #include <osg/Geometry>
 #include <osg/Geode>
-#include <osg/FrameBufferObject>
+#include <osg/Image>
 #include <osg/Texture2D>
+#include <osg/FrameBufferObject>
+#include <osg/Uniform>
 
 #include "defaultworld.hpp"
 #include "storage.hpp"
 #include "buffercache.hpp"
 #include "material.hpp"
+#include "compositemappool.hpp"
 
 
 namespace
@@ -25,56 +31,6 @@ namespace
         return targetlevel;
     }
 
-    // Utility functions for neighbour finding algorithm
-    Terrain::ChildDirection reflect(Terrain::ChildDirection dir, Terrain::Direction dir2)
-    {
-        assert(dir != Root);
-
-        const Terrain::ChildDirection lookupTable[4][4] =
-        {
-            // NW  NE  SW  SE
-            {  Terrain::SW, Terrain::SE, Terrain::NW, Terrain::NE }, // N
-            {  Terrain::NE, Terrain::NW, Terrain::SE, Terrain::SW }, // E
-            {  Terrain::SW, Terrain::SE, Terrain::NW, Terrain::NE }, // S
-            {  Terrain::NE, Terrain::NW, Terrain::SE, Terrain::SW }  // W
-        };
-        return lookupTable[dir2][dir];
-    }
-
-    bool adjacent(Terrain::ChildDirection dir, Terrain::Direction dir2)
-    {
-        assert(dir != Terrain::Root);
-        const bool lookupTable[4][4] =
-        {
-            // NW    NE    SW     SE
-            {  true, true, false, false }, // N
-            {  false, true, false, true }, // E
-            {  false, false, true, true }, // S
-            {  true, false, true, false }  // W
-        };
-        return lookupTable[dir2][dir];
-    }
-
-    // Algorithm described by Hanan Samet - 'Neighbour Finding in Quadtrees'
-    // http://www.cs.umd.edu/~hjs/pubs/SametPRIP81.pdf
-    Terrain::QuadTreeNode* searchNeighbourRecursive(Terrain::QuadTreeNode* currentNode, Terrain::Direction dir)
-    {
-        if(!currentNode->getParent())
-            return NULL; // Arrived at root node, the root node does not have neighbours
-
-        Terrain::QuadTreeNode* nextNode;
-        if(adjacent(currentNode->getDirection(), dir))
-        {
-            nextNode = searchNeighbourRecursive(currentNode->getParent(), dir);
-            if (nextNode && nextNode->hasChildren())
-                return nextNode->getChild(reflect(currentNode->getDirection(), dir));
-            return nextNode;
-        }
-
-        nextNode = currentNode->getParent();
-        return nextNode->getChild(reflect(currentNode->getDirection(), dir));
-    }
-
     float distanceBetween(const osg::BoundingBoxf &bbox, const osg::Vec3f &pos)
     {
         if(bbox.contains(pos))
@@ -135,6 +91,19 @@ namespace
 
         return geom.release();
     }
+
+    osg::Texture2D *createCompressedTexture(osg::Image *image)
+    {
+        osg::Texture2D *texture = new osg::Texture2D(image);
+        texture->setFilter(osg::Texture::MIN_FILTER, osg::Texture::LINEAR_MIPMAP_LINEAR);
+        texture->setFilter(osg::Texture::MAG_FILTER, osg::Texture::LINEAR);
+        texture->setWrap(osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE);
+        texture->setWrap(osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE);
+        // The mipmaps came with the image
+        texture->setUseHardwareMipMapGeneration(false);
+        texture->setUnRefImageDataAfterApply(true);
+        return texture;
+    }
 }
 
 inline std::ostream& operator<<(std::ostream& out, const osg::Vec3f &vec)
@@ -162,13 +131,18 @@ QuadTreeNode::QuadTreeNode(DefaultWorld* terrain, ChildDirection dir, int size,
     , mCenter(center)
     , mParent(parent)
     , mTerrain(terrain)
+    , mCompositePage(-1)
+    , mSettledRadius(0.0f)
+    , mGeometricError(-1.0f)
+    , mGeometricErrorEstimated(false)
+    , mChunkPrefetched(false)
+    , mChildrenPrefetched(false)
 {
     for(int i=0; i<4; ++i)
         mChildren[i] = nullptr;
-    for(int i=0; i<4; ++i)
-        mNeighbours[i] = nullptr;
+    mLocationCode = mParent ? getChildCode(mParent->getLocationCode(), dir) : 1;
 
-    mSceneNode = new osg::MatrixTransform();
+    mSceneNode = mTerrain->createSceneNode();
 
     osg::Vec2f pos = mCenter;
     if(mParent)
@@ -181,27 +155,36 @@ QuadTreeNode::QuadTreeNode(DefaultWorld* terrain, ChildDirection dir, int size,
     mSceneNode->setReferenceFrame(osg::Transform::RELATIVE_RF);
     mSceneNode->setMatrix(osg::Matrix::translate(sceneNodePos));
 
-    mMaterialGenerator = new MaterialGenerator(mTerrain->getStorage());
+    mMaterialGenerator = mTerrain->createMaterialGenerator();
     mMaterialGenerator->enableShaders(mTerrain->getShadersEnabled());
+    mMaterialGenerator->enableCompactVertices(mTerrain->getCompactVertices());
 
     (mParent ? mParent->getSceneNode() : mTerrain->getRootSceneNode())->addChild(mSceneNode.get());
 
     initAabb();
+    initGeometricError();
 }
 
 QuadTreeNode::~QuadTreeNode()
 {
     for(int i = 0;i < 4;++i)
     {
-        delete mChildren[i];
+        mTerrain->destroyNode(mChildren[i]);
         mChildren[i] = nullptr;
     }
 
+    // Pending requests reference this node, make sure they don't get delivered
+    mChunkToken.cancel();
+    mLayerToken.cancel();
+
     unload();
     unloadLayers();
 
-    delete mMaterialGenerator;
+    mTerrain->destroyMaterialGenerator(mMaterialGenerator);
     mMaterialGenerator = nullptr;
+
+    mTerrain->recycleSceneNode(mSceneNode.get());
+    mSceneNode = nullptr;
 }
 
 
@@ -221,37 +204,12 @@ void QuadTreeNode::getInfo(std::map<size_t,size_t> &chunks, size_t &nodes) const
 
 void QuadTreeNode::createChild(ChildDirection id, int size, const osg::Vec2f &center)
 {
-    mChildren[id] = new QuadTreeNode(mTerrain, id, size, center, this);
+    mChildren[id] = mTerrain->createNode(id, size, center, this);
 }
 
-void QuadTreeNode::initNeighbours(bool childrenOnly)
+QuadTreeNode *QuadTreeNode::getNeighbour(Direction dir) const
 {
-    if(!childrenOnly)
-    {
-        for(int i = 0;i < 4;++i)
-            mNeighbours[i] = searchNeighbourRecursive(this, (Direction)i);
-    }
-    if(hasChildren())
-    {
-        for(int i = 0;i < 4;++i)
-            mChildren[i]->initNeighbours();
-    }
-}
-
-void QuadTreeNode::updateNeighbour(Direction dir, QuadTreeNode *node)
-{
-    mNeighbours[dir] = node;
-    if(hasChildren())
-    {
-        const ChildDirection child_dirs[][2] = {
-            { NW, NE }, // North
-            { NE, SE }, // East
-            { SE, SW }, // South
-            { SW, NW }, // West
-        };
-        mChildren[child_dirs[dir][0]]->updateNeighbour(dir, node);
-        mChildren[child_dirs[dir][1]]->updateNeighbour(dir, node);
-    }
+    return mTerrain->getLinearQuadTree().findNeighbour(mLocationCode, dir);
 }
 
 void QuadTreeNode::initAabb()
@@ -275,46 +233,14 @@ void QuadTreeNode::initAabb()
 
 void QuadTreeNode::syncLoad()
 {
-    //while(mChunkLoadState == LS_Loading || mLayerLoadState == LS_Loading)
-    //{
-    //    OGRE_THREAD_SLEEP(0);
-    //    Ogre::Root::getSingleton().getWorkQueue()->processResponses();
-    //}
+    while(mChunkLoadState == LS_Loading || mLayerLoadState == LS_Loading)
+        mTerrain->waitForResponses();
 }
 
-void QuadTreeNode::buildQuadTree(const osg::Vec3f &cameraPos, float cellWorldSize)
+void QuadTreeNode::buildChildren()
 {
-    // Simple LOD selection
-    /// \todo use error metrics?
-    size_t wantedLod = 0;
-
-    float dist = distanceBetween(mWorldBounds, cameraPos) - cellWorldSize*0.25f;
-    if(dist > cellWorldSize)
-        wantedLod = Log2(dist/cellWorldSize)+1;
-
-    bool isLeaf = mSize <= 1 || (mSize <= mTerrain->getMaxBatchSize() && mLodLevel <= wantedLod);
-    if(isLeaf)
-    {
-        // We arrived at a leaf
-        Terrain::Storage *storage = mTerrain->getStorage();
-        float minZ,maxZ;
-        if(!storage->getMinMaxHeights(mSize, mCenter, minZ, maxZ))
-            markAsDummy(); // no data available for this node, skip it
-        else
-        {
-            float halfSize = mSize/2.f;
-            osg::BoundingBoxf bounds(-halfSize*cellWorldSize, -halfSize*cellWorldSize, minZ,
-                                      halfSize*cellWorldSize,  halfSize*cellWorldSize, maxZ);
-            mTerrain->convertBounds(bounds);
-            mBounds = bounds;
-            if(mLayerLoadState == LS_Unloaded)
-            {
-                mLayerLoadState = LS_Loading;
-                mTerrain->queueLayerLoad(this);
-            }
-        }
+    if(mSize <= 1)
         return;
-    }
 
     float halfSize = mSize/2.f;
     if(mCenter.x() - halfSize > mTerrain->getMaxX()
@@ -324,60 +250,131 @@ void QuadTreeNode::buildQuadTree(const osg::Vec3f &cameraPos, float cellWorldSiz
     {
         // Out of bounds of the actual terrain - this will happen because
         // we rounded the size up to the next power of two
-        markAsDummy();
         return;
     }
 
-    // Not a leaf, create its children
+    // Only one level at a time. The children split further when they're
+    // updated, which may be spread over several frames.
     int childSize = mSize>>1;
     createChild(SW, childSize, mCenter + osg::Vec2f(-halfSize/2.f, -halfSize/2.f));
     createChild(SE, childSize, mCenter + osg::Vec2f( halfSize/2.f, -halfSize/2.f));
     createChild(NW, childSize, mCenter + osg::Vec2f(-halfSize/2.f,  halfSize/2.f));
     createChild(NE, childSize, mCenter + osg::Vec2f( halfSize/2.f,  halfSize/2.f));
-    mChildren[SW]->buildQuadTree(cameraPos, cellWorldSize);
-    mChildren[SE]->buildQuadTree(cameraPos, cellWorldSize);
-    mChildren[NW]->buildQuadTree(cameraPos, cellWorldSize);
-    mChildren[NE]->buildQuadTree(cameraPos, cellWorldSize);
 
     for(int i = 0;i < 4;++i)
     {
-        if(!getChild((ChildDirection)i)->isDummy())
-        {
-            // Only valid if we have at least one non-dummy child
-            if(mLayerLoadState == LS_Unloaded)
-            {
-                mLayerLoadState = LS_Loading;
-                mTerrain->queueLayerLoad(this);
-            }
-            return;
-        }
+        // initAabb only finds bounds where there's data
+        if(mChildren[i]->getBoundingBox().valid())
+            mChildren[i]->requestLayers();
+        else
+            mChildren[i]->markAsDummy();
     }
-    // if all children are dummy, we are also dummy and have no need for children
-    markAsDummy();
-    for(int i = 0;i < 4;++i)
+}
+
+void QuadTreeNode::initGeometricError()
+{
+    mGeometricError = mTerrain->getKnownGeometricError(mLocationCode);
+    if(mGeometricError >= 0.0f)
     {
-        delete mChildren[i];
-        mChildren[i] = nullptr;
+        mGeometricErrorEstimated = false;
+        propagateGeometricError();
+    }
+    else if(mParent && mParent->mGeometricError >= 0.0f)
+    {
+        // The noise halves in amplitude with each octave, and so does the detail
+        // each level adds, give or take. Close enough to split on without first
+        // loading every level along the way.
+        mGeometricError = mParent->mGeometricError * 0.5f;
+        mGeometricErrorEstimated = true;
     }
 }
 
+void QuadTreeNode::propagateGeometricError()
+{
+    for(QuadTreeNode *node = mParent;node && node->mGeometricError < mGeometricError;node = node->mParent)
+        node->mGeometricError = mGeometricError;
+}
 
-bool QuadTreeNode::update(const osg::Vec3f &cameraPos, float cellWorldSize)
+float QuadTreeNode::getDisplayDistance(float cellWorldSize) const
 {
-    if(isDummy())
-        return true;
-    if(!mBounds.valid())
-        return true;
+    // Nodes that are too large always delegate, and LOD 0 nodes always display
+    if(mSize > mTerrain->getMaxBatchSize())
+        return std::numeric_limits<float>::max();
+    if(mLodLevel == 0)
+        return 0.0f;
+
+    float errorScale = mTerrain->getErrorDistanceScale();
+    if(errorScale > 0.0f)
+    {
+        // Where our geometric error shrinks to the allowed number of pixels.
+        // Without an error to go by, we have to load our chunk to learn it.
+        if(mGeometricError < 0.0f)
+            return 0.0f;
+        return mGeometricError * errorScale;
+    }
+
+    // Otherwise, one LOD level per doubling of distance
+    return float(1 << (mLodLevel-1)) * cellWorldSize + cellWorldSize*0.25f;
+}
+
+void QuadTreeNode::updateMorphRange(float cellWorldSize)
+{
+    if(!mMorphRange.valid())
+        return;
+
+    // We're shown until our parent's display distance, so be fully morphed to
+    // its surface by then. Morphing over the second half of our range leaves
+    // the first half as it was, for our children to morph into.
+    float parentDist = mParent ? mParent->getDisplayDistance(cellWorldSize) : std::numeric_limits<float>::max();
+    if(parentDist == std::numeric_limits<float>::max())
+    {
+        mMorphRange->set(osg::Vec2f(0.0f, 0.0f));
+        return;
+    }
+    float displayDist = getDisplayDistance(cellWorldSize);
+    float start = std::min(displayDist + (parentDist - displayDist)*0.5f, parentDist);
+    float length = std::max(parentDist - start, cellWorldSize*0.01f);
+    mMorphRange->set(osg::Vec2f(start, 1.0f/length));
+}
 
-    // Simple LOD selection
-    /// \todo use error metrics?
-    size_t wantedLod = 0;
+void QuadTreeNode::clearSettled()
+{
+    mSettledRadius = 0.0f;
+    if(hasChildren())
+    {
+        for(int i = 0;i < 4;++i)
+            mChildren[i]->clearSettled();
+    }
+}
 
-    float dist = distanceBetween(mWorldBounds, cameraPos) - cellWorldSize*0.25f;
-    if(dist > cellWorldSize)
-        wantedLod = Log2(dist/cellWorldSize)+1;
 
-    bool wantToDisplay = mSize <= mTerrain->getMaxBatchSize() && mLodLevel <= wantedLod;
+bool QuadTreeNode::update(const osg::Vec3f &cameraPos, float cellWorldSize)
+{
+    if(isDummy() || !mBounds.valid())
+    {
+        mSettledRadius = std::numeric_limits<float>::max();
+        return true;
+    }
+
+    // Distances to the camera can't change by more than the camera moved, so
+    // while it stays close enough, no LOD decision in this subtree changes
+    const osg::Vec3f &predictedPos = mTerrain->getPredictedCameraPos();
+    if(mSettledRadius > 0.0f && (cameraPos - mSettledCameraPos).length() < mSettledRadius &&
+       (predictedPos - mSettledPredictedPos).length() < mSettledRadius)
+        return true;
+    mSettledRadius = 0.0f;
+    mSettledCameraPos = cameraPos;
+    mSettledPredictedPos = predictedPos;
+
+    float dist = distanceBetween(mWorldBounds, cameraPos);
+    float predictedDist = distanceBetween(mWorldBounds, predictedPos);
+    float displayDist = getDisplayDistance(cellWorldSize);
+    // How far the distances can change before we'd decide differently
+    float margin = std::numeric_limits<float>::max();
+    if(displayDist > 0.0f && displayDist < std::numeric_limits<float>::max())
+        margin = std::min(std::abs(dist - displayDist), std::abs(predictedDist - displayDist));
+
+    bool wantToDisplay = dist >= displayDist;
     if(wantToDisplay)
     {
         // Wanted LOD is small enough to render this node in one chunk
@@ -386,49 +383,54 @@ bool QuadTreeNode::update(const osg::Vec3f &cameraPos, float cellWorldSize)
             mChunkLoadState = LS_Loading;
             mTerrain->queueChunkLoad(this);
         }
+        // In case an earlier attempt failed
+        requestLayers();
 
         if(mChunkLoadState == LS_Loaded)
         {
+            updateMorphRange(cellWorldSize);
             if(hasChildren())
             {
                 for(int i = 0;i < 4;++i)
                 {
-                    delete mChildren[i];
+                    mTerrain->destroyNode(mChildren[i]);
                     mChildren[i] = nullptr;
                 }
-                // Children went away. Make sure our neighbours' children know
-                if(mNeighbours[North]) mNeighbours[North]->updateNeighbour(South, this);
-                if(mNeighbours[East ]) mNeighbours[East ]->updateNeighbour(West,  this);
-                if(mNeighbours[South]) mNeighbours[South]->updateNeighbour(North, this);
-                if(mNeighbours[West ]) mNeighbours[West ]->updateNeighbour(East,  this);
 
                 mSceneNode->removeChildren(0, mSceneNode->getNumChildren());
                 mSceneNode->addChild(mGeode.get());
             }
+            else if(!mChildrenPrefetched && predictedDist < displayDist)
+            {
+                // Heading toward where we'll need splitting
+                mChildrenPrefetched = mTerrain->prefetchChildChunks(this);
+            }
 
+            mSettledRadius = margin;
             return true;
         }
         return false; // LS_Loading
     }
 
     // We do not want to display this node - delegate to children if they are already loaded
+    if(mChunkLoadState == LS_Loading)
+        cancelChunkLoad();
     if(!hasChildren())
     {
-        buildQuadTree(cameraPos, cellWorldSize);
+        if(!mTerrain->mayBuildChildren())
+        {
+            // Out of time for this frame. Keep showing what we have, if anything.
+            return mGeode.valid();
+        }
+        buildChildren();
         if(!hasChildren())
         {
             markAsDummy();
             return false;
         }
-        initNeighbours(true);
-        // Inform our neighbours that their children may have new neighbours
-        for(int i=0; i<4; ++i)
-        {
-            if(mNeighbours[i])
-                mNeighbours[i]->initNeighbours(true);
-        }
     }
 
+    float childRadius = std::numeric_limits<float>::max();
     if(mGeode.valid())
     {
         // Are children already loaded?
@@ -437,25 +439,46 @@ bool QuadTreeNode::update(const osg::Vec3f &cameraPos, float cellWorldSize)
         {
             if(!mChildren[i]->update(cameraPos, cellWorldSize))
                 childrenLoaded = false;
+            childRadius = std::min(childRadius, mChildren[i]->mSettledRadius);
         }
 
         if(childrenLoaded)
         {
             // Delegation went well, we can unload now
             unload();
+            for(int i = 0;i < 4;++i)
+            {
+                if(!mSceneNode->containsNode(mChildren[i]->getSceneNode()))
+                    mSceneNode->addChild(mChildren[i]->getSceneNode());
+            }
+            mSettledRadius = std::min(margin, childRadius);
         }
         else
         {
-            //mChunk->setVisible(true);
-            // Make sure child scene nodes are detached until all children are loaded
-            //mSceneNode->removeAllChildren();
+            // Make sure child scene nodes are detached until all children are
+            // loaded, and that we're displaying in their place
+            for(int i = 0;i < 4;++i)
+                mSceneNode->removeChild(mChildren[i]->getSceneNode());
+            if(!mSceneNode->containsNode(mGeode.get()))
+                mSceneNode->addChild(mGeode.get());
         }
         return true;
     }
 
+    if(mChunkLoadState == LS_Unloaded && !mChunkPrefetched && predictedDist >= displayDist)
+    {
+        // Heading away, so our children will be merged into us soon
+        mChunkPrefetched = mTerrain->prefetchChunk(this);
+    }
+
     bool success = true;
     for(int i = 0;i < 4;++i)
+    {
         success = mChildren[i]->update(cameraPos, cellWorldSize) && success;
+        childRadius = std::min(childRadius, mChildren[i]->mSettledRadius);
+    }
+    if(success)
+        mSettledRadius = std::min(margin, childRadius);
     return success;
 }
 
@@ -463,19 +486,75 @@ void QuadTreeNode::load(const LoadResponseData &data)
 {
     assert(!mGeode.valid());
 
+    mTerrain->setKnownGeometricError(mLocationCode, data.mGeometricError);
+    mGeometricError = data.mGeometricError;
+    mGeometricErrorEstimated = false;
+    if(hasChildren())
+    {
+        for(int i = 0;i < 4;++i)
+        {
+            if(!mChildren[i]->mGeometricErrorEstimated)
+                mGeometricError = std::max(mGeometricError, mChildren[i]->mGeometricError);
+        }
+    }
+    propagateGeometricError();
+    mChunkPrefetched = false;
+    mChildrenPrefetched = false;
+
     osg::ref_ptr<osg::Geometry> geom = new osg::Geometry();
-    geom->setVertexArray(new osg::Vec3Array(data.mPositions.size(), data.mPositions.data()));
-    geom->setNormalArray(new osg::Vec3Array(data.mNormals.size(), data.mNormals.data()), osg::Array::BIND_PER_VERTEX);
-    geom->setColorArray(new osg::Vec4ubArray(data.mColours.size(), data.mColours.data()), osg::Array::BIND_PER_VERTEX);
+    if(mTerrain->getCompactVertices())
+    {
+        // The vertex shader rebuilds positions from the shared UV grid, so
+        // only the heights and packed normals are per-chunk
+        geom->setVertexAttribArray(Attrib_Height, new osg::FloatArray(data.mHeights.size(), data.mHeights.data()),
+                                   osg::Array::BIND_PER_VERTEX);
+        osg::ref_ptr<osg::Vec2sArray> normals = new osg::Vec2sArray(data.mPackedNormals.size(), data.mPackedNormals.data());
+        normals->setNormalize(true);
+        geom->setVertexAttribArray(Attrib_PackedNormal, normals.get(), osg::Array::BIND_PER_VERTEX);
+
+        float cellWorldSize = mTerrain->getStorage()->getCellWorldSize();
+        geom->getOrCreateStateSet()->addUniform(new osg::Uniform("chunkSize", mSize*cellWorldSize));
+
+        // Without a vertex array, the bounds can't be computed from the geometry
+        float minZ = std::numeric_limits<float>::max();
+        float maxZ = -std::numeric_limits<float>::max();
+        for(float height : data.mHeights)
+        {
+            minZ = std::min(minZ, height);
+            maxZ = std::max(maxZ, height);
+        }
+        float halfSize = mSize/2.f;
+        osg::BoundingBoxf bounds(-halfSize*cellWorldSize, -halfSize*cellWorldSize, minZ,
+                                  halfSize*cellWorldSize,  halfSize*cellWorldSize, maxZ);
+        mTerrain->convertBounds(bounds);
+        geom->setInitialBound(bounds);
+    }
+    else
+    {
+        geom->setVertexArray(new osg::Vec3Array(data.mPositions.size(), data.mPositions.data()));
+        geom->setNormalArray(new osg::Vec3Array(data.mNormals.size(), data.mNormals.data()), osg::Array::BIND_PER_VERTEX);
+        geom->setColorArray(new osg::Vec4ubArray(data.mColours.size(), data.mColours.data()), osg::Array::BIND_PER_VERTEX);
+        geom->getColorArray()->setNormalize(true);
+    }
+    if(!data.mMorphHeights.empty())
+    {
+        geom->setVertexAttribArray(Attrib_MorphHeight, new osg::FloatArray(data.mMorphHeights.size(), data.mMorphHeights.data()),
+                                   osg::Array::BIND_PER_VERTEX);
+        mMorphRange = new osg::Uniform("morphRange", osg::Vec2f(0.0f, 0.0f));
+        geom->getOrCreateStateSet()->addUniform(mMorphRange.get());
+        updateMorphRange(mTerrain->getStorage()->getCellWorldSize());
+    }
     geom->setTexCoordArray(0, mTerrain->getBufferCache().getUVBuffer(), osg::Array::BIND_PER_VERTEX);
-    geom->getColorArray()->setNormalize(true);
-    geom->addPrimitiveSet(getPrimitive());
+    setPrimitives(geom.get());
     geom->setUseDisplayList(false);
     geom->setUseVertexBufferObjects(true);
 
     mGeode = new osg::Geode();
     mGeode->addDrawable(geom.get());
-    mSceneNode->addChild(mGeode.get());
+    // If we're currently delegating to children, update() will attach the
+    // chunk once it decides to merge them.
+    if(!hasChildren())
+        mSceneNode->addChild(mGeode.get());
 
     mMaterialGenerator->enableShadows(mTerrain->getShadowsEnabled());
     mMaterialGenerator->enableSplitShadows(mTerrain->getSplitShadowsEnabled());
@@ -492,22 +571,46 @@ void QuadTreeNode::unload()
     {
         mSceneNode->removeChild(mGeode.get());
         mGeode = nullptr;
+        mMorphRange = nullptr;
 
-        mCompositeMap = nullptr;
-        mNormalMap = nullptr;
+        releaseCompositeMap();
 
         // Do *not* set this when we are still loading!
         mChunkLoadState = LS_Unloaded;
     }
 }
 
+void QuadTreeNode::chunkLoadFailed()
+{
+    assert(mChunkLoadState == LS_Loading);
+    mChunkLoadState = LS_Unloaded;
+}
+
+void QuadTreeNode::layerLoadFailed()
+{
+    assert(mLayerLoadState == LS_Loading);
+    mLayerLoadState = LS_Unloaded;
+}
+
+void QuadTreeNode::cancelChunkLoad()
+{
+    assert(mChunkLoadState == LS_Loading);
+    mChunkToken.cancel();
+    mChunkToken.reset();
+    mChunkLoadState = LS_Unloaded;
+}
+
+float QuadTreeNode::getDistanceTo(const osg::Vec3f &pos) const
+{
+    return distanceBetween(mWorldBounds, pos);
+}
+
 void QuadTreeNode::updateIndexBuffers()
 {
     if(hasChunk())
     {
         osg::Geometry *geom = mGeode->getDrawable(0)->asGeometry();
-        geom->removePrimitiveSet(0, geom->getNumPrimitiveSets());
-        geom->addPrimitiveSet(getPrimitive());
+        setPrimitives(geom);
     }
     else if(hasChildren())
     {
@@ -516,13 +619,13 @@ void QuadTreeNode::updateIndexBuffers()
     }
 }
 
-osg::PrimitiveSet *QuadTreeNode::getPrimitive() const
+void QuadTreeNode::setPrimitives(osg::Geometry *geom) const
 {
-    // Fetch a suitable Primitive for drawing (which may be shared)
-    unsigned int flags = mLodLevel << (4*4);
+    // Fetch suitable Primitives for drawing (which are shared)
+    unsigned int flags = 0;
     for(int i = 0;i < 4;++i)
     {
-        QuadTreeNode* neighbour = mNeighbours[i];
+        QuadTreeNode* neighbour = getNeighbour((Direction)i);
 
         // If the neighbour isn't currently rendering itself,
         // go up until we find one. NOTE: We don't need to go down,
@@ -546,7 +649,11 @@ osg::PrimitiveSet *QuadTreeNode::getPrimitive() const
         }
     }
 
-    return mTerrain->getBufferCache().getPrimitive(flags);
+    const BufferCache::Primitives &prims = mTerrain->getBufferCache().getPrimitives(flags);
+    geom->removePrimitiveSet(0, geom->getNumPrimitiveSets());
+    geom->addPrimitiveSet(prims.mInterior.get());
+    if(prims.mEdges.valid())
+        geom->addPrimitiveSet(prims.mEdges.get());
 }
 
 
@@ -555,6 +662,30 @@ bool QuadTreeNode::hasChunk() const
     return mGeode.valid();
 }
 
+const osg::Vec3Array *QuadTreeNode::getChunkPositions() const
+{
+    if(!hasChunk() || mTerrain->getCompactVertices())
+        return nullptr;
+    const osg::Geometry *geom = mGeode->getDrawable(0)->asGeometry();
+    return static_cast<const osg::Vec3Array*>(geom->getVertexArray());
+}
+
+const osg::FloatArray *QuadTreeNode::getChunkHeights() const
+{
+    if(!hasChunk() || !mTerrain->getCompactVertices())
+        return nullptr;
+    const osg::Geometry *geom = mGeode->getDrawable(0)->asGeometry();
+    return static_cast<const osg::FloatArray*>(geom->getVertexAttribArray(Attrib_Height));
+}
+
+float QuadTreeNode::getChunkHeight(size_t index) const
+{
+    if(const osg::FloatArray *heights = getChunkHeights())
+        return (*heights)[index];
+    const osg::Vec3f &pos = (*getChunkPositions())[index];
+    return getConvertedHeight(mTerrain->getAlign(), pos.x(), pos.y(), pos.z());
+}
+
 
 void QuadTreeNode::loadLayers(const std::vector<osg::ref_ptr<osg::Image>> &blendmaps, const std::vector<LayerInfo> &layerList)
 {
@@ -568,6 +699,15 @@ void QuadTreeNode::loadLayers(const std::vector<osg::ref_ptr<osg::Image>> &blend
     mLayerLoadState = LS_Loaded;
 }
 
+void QuadTreeNode::requestLayers()
+{
+    if(mLayerLoadState == LS_Unloaded)
+    {
+        mLayerLoadState = LS_Loading;
+        mTerrain->queueLayerLoad(this);
+    }
+}
+
 void QuadTreeNode::unloadLayers()
 {
     mMaterialGenerator->setBlendmapList(std::vector<osg::ref_ptr<osg::Image>>());
@@ -580,13 +720,10 @@ void QuadTreeNode::loadMaterials()
 {
     if(mGeode.valid() && mMaterialGenerator->hasLayers())
     {
-        if(mSize <= 1)
+        if(mSize <= 1 || !ensureCompositeMap())
             mGeode->setStateSet(mMaterialGenerator->generate());
         else
-        {
-            ensureCompositeMap();
-            mGeode->setStateSet(mMaterialGenerator->generateForCompositeMap(mCompositeMap.get(), mNormalMap.get()));
-        }
+            mGeode->setStateSet(createCompositeMapMaterial());
     }
 }
 
@@ -605,6 +742,23 @@ void QuadTreeNode::prepareForCompositeMap(osg::Geode *geode, osg::Vec4f area)
         geode->addDrawable(makeQuad(area[0], area[1], area[2], area[3], mMaterial.get()));
         return;
     }
+    if(mCompressedCompositeMap.valid())
+    {
+        osg::ref_ptr<osg::StateSet> state = mMaterialGenerator->generateForCompositeMapDownsample(
+            mCompressedCompositeMap.get(), mCompressedNormalMap.get());
+        geode->addDrawable(makeQuad(area[0], area[1], area[2], area[3], state.get()));
+        return;
+    }
+    if(mCompositePage >= 0 && !mTerrain->isCompositeMapPending(mCompositePage, mLocationCode))
+    {
+        // Already splatted for our own chunk, so there's no need to go
+        // through our layers (or our children's) again
+        CompositeMapPool *pool = mTerrain->getCompositeMapPool();
+        osg::ref_ptr<osg::StateSet> state = mMaterialGenerator->generateForCompositeMapDownsample(
+            pool->getCompositePages(), pool->getNormalPages(), mCompositePage);
+        geode->addDrawable(makeQuad(area[0], area[1], area[2], area[3], state.get()));
+        return;
+    }
     if(hasChildren())
     {
         // 0,0 -------- 1,0
@@ -627,51 +781,118 @@ void QuadTreeNode::prepareForCompositeMap(osg::Geode *geode, osg::Vec4f area)
     }
 }
 
-void QuadTreeNode::ensureCompositeMap()
+bool QuadTreeNode::ensureCompositeMap()
 {
-    if(mCompositeMap.valid())
-        return;
+    if(mCompositePage >= 0 || mCompressedCompositeMap.valid())
+        return true;
+    CompositeMapPool *pool = mTerrain->getCompositeMapPool();
+    if(!pool)
+        return false;
+
+    bool valid;
+    int page = pool->acquire(mLocationCode, valid);
+    if(page < 0)
+        return false;
+    // Still there from before, or on its way
+    if(valid || mTerrain->isCompositeMapPending(page, mLocationCode))
+    {
+        mCompositePage = page;
+        return true;
+    }
 
-    mCompositeMap = new osg::Texture2D();
-    mCompositeMap->setWrap(osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE);
-    mCompositeMap->setWrap(osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE);
+    mCompositePage = page;
+    // Stored by an earlier run, hopefully
+    if(!mTerrain->loadCompositeMap(this))
+        renderCompositeMap();
+    return true;
+}
 
-    mNormalMap = new osg::Texture2D();
-    mNormalMap->setWrap(osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE);
-    mNormalMap->setWrap(osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE);
+void QuadTreeNode::renderCompositeMap()
+{
+    assert(mCompositePage >= 0);
 
-    // Create quads for each cell part of this node
+    // Create quads for each cell part of this node, or rather for each child
+    // that has a composite map to reuse. Not with our own page, that's what
+    // we're filling.
+    const int page = mCompositePage;
+    mCompositePage = -1;
     osg::ref_ptr<osg::Geode> geode = new osg::Geode();
     prepareForCompositeMap(geode.get(), osg::Vec4f(0.0f, 0.0f, 1.0f, 1.0f));
-    if(geode->getNumDrawables() > 0)
-        mTerrain->renderCompositeMap(mCompositeMap.get(), mNormalMap.get(), geode.get());
+    mCompositePage = page;
+
+    mTerrain->renderCompositeMap(mCompositePage, mLocationCode, geode.get(), true);
+}
+
+void QuadTreeNode::loadCompositeMap(osg::Image *composite, osg::Image *normal)
+{
+    assert(mCompositePage >= 0);
+
+    osg::ref_ptr<osg::StateSet> state = mMaterialGenerator->generateForCompositeMapUpload(composite, normal);
+    osg::ref_ptr<osg::Geode> geode = new osg::Geode();
+    geode->addDrawable(makeQuad(0.0f, 0.0f, 1.0f, 1.0f, state.get()));
+
+    // Already stored, no need to read it back
+    mTerrain->renderCompositeMap(mCompositePage, mLocationCode, geode.get(), false);
+}
+
+void QuadTreeNode::setCompressedCompositeMap(osg::Image *composite, osg::Image *normal)
+{
+    mCompressedCompositeMap = createCompressedTexture(composite);
+    mCompressedNormalMap = createCompressedTexture(normal);
+    // Left for the pool to hand out again, or back to us if we lose the compressed copy
+    releaseCompositePage();
+
+    if(mGeode.valid() && mMaterialGenerator->hasLayers() && mSize > 1)
+        mGeode->setStateSet(createCompositeMapMaterial());
+}
+
+osg::StateSet *QuadTreeNode::createCompositeMapMaterial()
+{
+    if(mCompressedCompositeMap.valid())
+        return mMaterialGenerator->generateForCompositeMap(mCompressedCompositeMap.get(), mCompressedNormalMap.get());
+
+    CompositeMapPool *pool = mTerrain->getCompositeMapPool();
+    return mMaterialGenerator->generateForCompositeMap(pool->getCompositePages(), pool->getNormalPages(), mCompositePage);
+}
+
+void QuadTreeNode::releaseCompositePage()
+{
+    if(mCompositePage >= 0)
+    {
+        mTerrain->getCompositeMapPool()->release(mCompositePage);
+        mCompositePage = -1;
+    }
+}
+
+void QuadTreeNode::releaseCompositeMap()
+{
+    releaseCompositePage();
+    mCompressedCompositeMap = nullptr;
+    mCompressedNormalMap = nullptr;
 }
 
 void QuadTreeNode::applyMaterials()
 {
+    // Children first, so their composite maps can be reused for ours
+    if(hasChildren())
+    {
+        for(int i = 0;i < 4;++i)
+            mChildren[i]->applyMaterials();
+    }
     if(mGeode.valid())
     {
         mMaterialGenerator->enableShadows(mTerrain->getShadowsEnabled());
         mMaterialGenerator->enableSplitShadows(mTerrain->getSplitShadowsEnabled());
-        if(mSize <= 1)
+        if(mSize <= 1 || !ensureCompositeMap())
             mGeode->setStateSet(mMaterialGenerator->generate());
         else
-        {
-            ensureCompositeMap();
-            mGeode->setStateSet(mMaterialGenerator->generateForCompositeMap(mCompositeMap.get(), mNormalMap.get()));
-        }
-    }
-    if(hasChildren())
-    {
-        for(int i = 0;i < 4;++i)
-            mChildren[i]->applyMaterials();
+            mGeode->setStateSet(createCompositeMapMaterial());
     }
 }
 
 void QuadTreeNode::clearCompositeMaps()
 {
-    mCompositeMap = nullptr;
-    mNormalMap = nullptr;
+    releaseCompositeMap();
     if(hasChildren())
     {
         for(int i = 0;i < 4;++i)
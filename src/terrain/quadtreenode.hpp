@@ -5,8 +5,12 @@
 
 #include <osg/ref_ptr>
 #include <osg/BoundingBox>
+#include <osg/Array>
+#include <osg/Vec3f>
 
 #include "defs.hpp"
+#include "workqueue.hpp"
+#include "linearquadtree.hpp"
 
 namespace osg
 {
@@ -19,10 +23,12 @@ namespace osg
     class Geode;
 
     class StateSet;
+    class Image;
     class Texture2D;
 
     class Geometry;
     class PrimitiveSet;
+    class Uniform;
 }
 
 namespace Terrain
@@ -58,17 +64,10 @@ namespace Terrain
         /// Rebuild all materials
         void applyMaterials();
 
-        /// Initialize neighbours - do this after the quadtree is (re)constructed
-        void initNeighbours(bool childrenOnly=false);
         /// Initialize bounding boxes of non-leafs by merging children bounding boxes.
         /// Do this after the quadtree is (re)constructed
         void initAabb();
 
-        /// Updates the neighbour bordering the given direction with the given
-        /// node, and updates the descendants on the same border (e.g. if
-        /// dir=East, all NE and SE children will be updated too).
-        void updateNeighbour(Direction dir, QuadTreeNode *node);
-
         /// @note takes ownership of \a child
         void createChild(ChildDirection id, int size, const osg::Vec2f& center);
 
@@ -80,6 +79,13 @@ namespace Terrain
 
         QuadTreeNode* getParent() { return mParent; }
 
+        /// Get the node of our size bordering the given direction, or if there isn't one,
+        /// the smallest larger node in its place. Nullptr at the edge of the terrain.
+        QuadTreeNode* getNeighbour(Direction dir) const;
+
+        /// Our depth and position in the quad tree, see LocationCode
+        LocationCode getLocationCode() const { return mLocationCode; }
+
         osg::MatrixTransform* getSceneNode() { return mSceneNode.get(); }
 
         int getSize() const { return mSize; }
@@ -98,12 +104,19 @@ namespace Terrain
 
         DefaultWorld* getTerrain() const { return mTerrain; }
 
-        void buildQuadTree(const osg::Vec3f &cameraPos, float cellWorldSize);
+        /// Create our four children, without splitting them any further. Children without
+        /// any terrain data are marked as dummies.
+        void buildChildren();
 
         /// Adjust LODs for the given camera position, possibly splitting up chunks or merging them.
+        /// Subtrees whose LOD can't have changed since the camera was last near are skipped,
+        /// and splitting is limited by DefaultWorld::mayBuildChildren.
         /// @return Did we (or all of our children) choose to render?
         bool update(const osg::Vec3f &cameraPos, float cellWorldSize);
 
+        /// Make the next update revisit this subtree, e.g. after the LOD settings changed.
+        void clearSettled();
+
         /// Adjust index buffers of chunks to stitch together chunks of different LOD, so that cracks are avoided.
         /// Call after QuadTreeNode::update!
         void updateIndexBuffers();
@@ -112,24 +125,66 @@ namespace Terrain
         /// with Storage::getCellVertices^2 vertices
         size_t getNativeLodLevel() const { return mLodLevel; }
 
+        /// Get the geometric error of our chunk, see Storage::fillVertexBuffers, raised to our
+        /// children's. Estimated from our parent's until our chunk was loaded once, and
+        /// negative if that isn't possible either.
+        float getGeometricError() const { return mGeometricError; }
+
         /// Is this node currently configured to render itself?
         bool hasChunk() const;
 
+        /// Get the vertex positions of our chunk, or nullptr if we don't have one
+        /// or it uses the compact vertex format.
+        const osg::Vec3Array *getChunkPositions() const;
+
+        /// Get the vertex heights of our chunk, or nullptr if we don't have one
+        /// or it doesn't use the compact vertex format.
+        const osg::FloatArray *getChunkHeights() const;
+
+        /// Get the height of a vertex of our chunk, in the order written by
+        /// Storage::fillVertexBuffers. Only valid if we have a chunk.
+        float getChunkHeight(size_t index) const;
+
         /// Add a textured quad to a specific 2d area in the composite map scenemanager.
-        /// Only nodes with size <= 1 can be rendered with alpha blending, so larger nodes will simply
-        /// call this method on their children.
+        /// Nodes that already have a composite map of their own add that, downsampled. Otherwise
+        /// nodes with children call this method on them, and childless ones splat their layers.
         /// @note Do not call this before World::areLayersLoaded() == true
         /// @param area area in image space to put the quad
         void prepareForCompositeMap(osg::Geode *geode, osg::Vec4f area);
 
         void clearCompositeMaps();
 
+        /// Page of the composite map pool holding our composite map, or -1
+        int getCompositePage() const { return mCompositePage; }
+        MaterialGenerator *getMaterialGenerator() const { return mMaterialGenerator; }
+
+        /// Queue rendering our composite map into our page, from our layers or our children's maps
+        void renderCompositeMap();
+        /// Queue rendering our composite map into our page from a stored copy of it
+        void loadCompositeMap(osg::Image *composite, osg::Image *normal);
+        /// Switch over to a block compressed copy of our composite map, giving back our page
+        void setCompressedCompositeMap(osg::Image *composite, osg::Image *normal);
+
         /// Create a chunk for this node from the given data.
         void load(const LoadResponseData& data);
         void unload();
         void loadLayers(const std::vector<osg::ref_ptr<osg::Image>> &blendmaps, const std::vector<LayerInfo> &layerList);
         void unloadLayers();
 
+        /// Queue a background load of this node's layers, if not already loaded or loading.
+        void requestLayers();
+
+        /// Forget about a background load that failed, so it's tried again on a later update
+        void chunkLoadFailed();
+        void layerLoadFailed();
+
+        /// Tokens used to cancel outstanding requests for this node's data
+        const WorkQueue::CancelToken& getChunkToken() const { return mChunkToken; }
+        const WorkQueue::CancelToken& getLayerToken() const { return mLayerToken; }
+
+        /// Get the distance from \a pos to the closest point of our world bounds.
+        float getDistanceTo(const osg::Vec3f &pos) const;
+
         void getInfo(std::map<size_t,size_t> &chunks, size_t &nodes) const;
 
     private:
@@ -151,19 +206,66 @@ namespace Terrain
 
         QuadTreeNode* mParent;
         QuadTreeNode* mChildren[4];
-        QuadTreeNode* mNeighbours[4];
+        LocationCode mLocationCode;
 
         osg::ref_ptr<osg::Geode> mGeode;//Chunk* mChunk;
 
         DefaultWorld* mTerrain;
 
         osg::ref_ptr<osg::StateSet> mMaterial;
-        osg::ref_ptr<osg::Texture2D> mCompositeMap;
-        osg::ref_ptr<osg::Texture2D> mNormalMap;
-
-        osg::PrimitiveSet *getPrimitive() const;
-
-        void ensureCompositeMap();
+        /// Page of the composite map pool holding our composite map, or -1
+        int mCompositePage;
+        /// Our composite map once it's block compressed, after which we no longer need a page
+        osg::ref_ptr<osg::Texture2D> mCompressedCompositeMap;
+        osg::ref_ptr<osg::Texture2D> mCompressedNormalMap;
+
+        WorkQueue::CancelToken mChunkToken;
+        WorkQueue::CancelToken mLayerToken;
+
+        /// Camera position at our last full update, and how far the camera can move from it
+        /// without any LOD decision in our subtree changing. 0 if we need updating every frame.
+        /// The same goes for the predicted camera position, which decides prefetching.
+        osg::Vec3f mSettledCameraPos;
+        osg::Vec3f mSettledPredictedPos;
+        float mSettledRadius;
+
+        /// Largest vertical deviation of our chunk from the next more detailed level,
+        /// in world units, or negative if unknown. Never less than our children's, so
+        /// we don't stop splitting where they'd still want to.
+        float mGeometricError;
+        /// Whether mGeometricError is a guess, to be replaced once our chunk is loaded
+        bool mGeometricErrorEstimated;
+        void initGeometricError();
+        /// Raise our ancestors' errors to ours where they're lower
+        void propagateGeometricError();
+
+        /// Whether our own chunk, or our children's, were already asked to be
+        /// prefetched into the tile cache
+        bool mChunkPrefetched;
+        bool mChildrenPrefetched;
+
+        /// Distance to the camera from which on we render ourselves rather than
+        /// delegating to our children
+        float getDisplayDistance(float cellWorldSize) const;
+
+        /// Where our chunk blends toward the parent's surface, see terrain.vert.
+        /// Null if the chunk has no morph heights.
+        osg::ref_ptr<osg::Uniform> mMorphRange;
+        void updateMorphRange(float cellWorldSize);
+
+        /// Set up the index ranges to draw our chunk with, stitched to the current neighbours
+        void setPrimitives(osg::Geometry *geom) const;
+
+        /// Abandon the pending chunk request, if any
+        void cancelChunkLoad();
+
+        /// Lease a page for our composite map, and load or render it unless the page still has it.
+        /// @return false if there's no composite map to be had, so we need to splat our layers directly
+        bool ensureCompositeMap();
+        void releaseCompositePage();
+        void releaseCompositeMap();
+        /// Material drawing our chunk with our composite map, wherever it's kept
+        osg::StateSet *createCompositeMapMaterial();
 
         void loadMaterials();
 
@@ -3,6 +3,9 @@
 
 #include <vector>
 
+#include <osg/Vec2f>
+#include <osg/Array>
+
 #include "defs.hpp"
 
 namespace osg
@@ -16,6 +19,30 @@ namespace osg
 
 namespace Terrain
 {
+    /// Vertex data of a chunk that has already been generated, which may be
+    /// reused when generating an overlapping chunk
+    struct GeneratedChunk
+    {
+        /// size of the chunk in cell units
+        float mSize;
+        /// center of the chunk in cell units
+        osg::Vec2f mCenter;
+        /// positions as written by Storage::fillVertexBuffers, or null if the
+        /// chunk uses the compact vertex format
+        osg::ref_ptr<const osg::Vec3Array> mPositions;
+        /// heights of a chunk using the compact vertex format, otherwise null
+        osg::ref_ptr<const osg::FloatArray> mHeights;
+
+        /// Get the height of a vertex, in the same order as fillVertexBuffers
+        float getHeight(Alignment align, size_t index) const
+        {
+            if(mHeights.valid())
+                return (*mHeights)[index];
+            const osg::Vec3f &pos = (*mPositions)[index];
+            return getConvertedHeight(align, pos.x(), pos.y(), pos.z());
+        }
+    };
+
     /// We keep storage of terrain data abstract here since we need different implementations for game and editor
     class Storage
     {
@@ -41,12 +68,18 @@ namespace Terrain
         /// @param lodLevel LOD level, 0 = most detailed
         /// @param size size of the terrain chunk in cell units
         /// @param center center of the chunk in cell units
+        /// @param known previously generated chunks overlapping this one (e.g. its parent,
+        ///        children or neighbours), whose vertices need not be generated again
         /// @param positions buffer to write vertices
         /// @param normals buffer to write vertex normals
         /// @param colours buffer to write vertex colours
+        /// @param geometricError receives the largest vertical distance, in world units, between the
+        ///        chunk's triangles and the vertices the next more detailed LOD level adds.
+        ///        May be 0 for LOD level 0.
         virtual void fillVertexBuffers(int lodLevel, float size, const osg::Vec2f& center, Terrain::Alignment align,
+                                       const std::vector<GeneratedChunk>& known,
                                        std::vector<osg::Vec3f>& positions, std::vector<osg::Vec3f>& normals,
-                                       std::vector<osg::Vec4ub>& colours) = 0;
+                                       std::vector<osg::Vec4ub>& colours, float& geometricError) = 0;
 
         /// Create textures holding layer blend values for a terrain chunk.
         /// @note The terrain chunk shouldn't be larger than one cell since otherwise we might
@@ -79,6 +112,14 @@ namespace Terrain
 
         virtual float getHeightAt (const osg::Vec3f& worldPos) = 0;
 
+        /// Get the heights at \a count positions at once. By default this just calls
+        /// getHeightAt for each of them.
+        virtual void getHeightsAt (const osg::Vec3f* worldPos, size_t count, float* heights)
+        {
+            for(size_t i = 0;i < count;++i)
+                heights[i] = getHeightAt(worldPos[i]);
+        }
+
         virtual LayerInfo getDefaultLayer() = 0;
 
         /// Get the transformation factor for mapping cell units to world units.
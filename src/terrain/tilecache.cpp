@@ -0,0 +1,101 @@
+#include "tilecache.hpp"
+
+namespace
+{
+
+template<typename T>
+size_t getVectorBytes(const std::vector<T> &vec)
+{
+    return vec.capacity() * sizeof(T);
+}
+
+}
+
+namespace Terrain
+{
+
+TileCache::TileCache(size_t budget)
+  : mBudget(budget)
+  , mBytes(0)
+  , mHits(0)
+  , mMisses(0)
+{
+}
+
+const LoadResponseData *TileCache::find(const TileKey &key)
+{
+    auto iter = mLookup.find(key);
+    if(iter == mLookup.end())
+    {
+        ++mMisses;
+        return nullptr;
+    }
+    ++mHits;
+
+    mTiles.splice(mTiles.begin(), mTiles, iter->second);
+    return &iter->second->mData;
+}
+
+void TileCache::insert(const TileKey &key, LoadResponseData &data)
+{
+    if(mBudget == 0)
+        return;
+
+    auto iter = mLookup.find(key);
+    if(iter != mLookup.end())
+    {
+        // Replace the existing data
+        mBytes -= iter->second->mBytes;
+        mTiles.erase(iter->second);
+        mLookup.erase(iter);
+    }
+
+    size_t bytes = sizeof(Tile) + getVectorBytes(data.mPositions) +
+                   getVectorBytes(data.mNormals) + getVectorBytes(data.mColours) +
+                   getVectorBytes(data.mHeights) + getVectorBytes(data.mPackedNormals) +
+                   getVectorBytes(data.mMorphHeights);
+    if(bytes > mBudget)
+        return;
+    evict(mBudget - bytes);
+
+    mTiles.push_front(Tile());
+    Tile &tile = mTiles.front();
+    tile.mKey = key;
+    tile.mData.mPositions.swap(data.mPositions);
+    tile.mData.mNormals.swap(data.mNormals);
+    tile.mData.mColours.swap(data.mColours);
+    tile.mData.mHeights.swap(data.mHeights);
+    tile.mData.mPackedNormals.swap(data.mPackedNormals);
+    tile.mData.mMorphHeights.swap(data.mMorphHeights);
+    tile.mData.mGeometricError = data.mGeometricError;
+    tile.mBytes = bytes;
+
+    mLookup[key] = mTiles.begin();
+    mBytes += bytes;
+}
+
+void TileCache::setBudget(size_t budget)
+{
+    mBudget = budget;
+    evict(mBudget);
+}
+
+void TileCache::clear()
+{
+    mTiles.clear();
+    mLookup.clear();
+    mBytes = 0;
+}
+
+void TileCache::evict(size_t budget)
+{
+    while(mBytes > budget && !mTiles.empty())
+    {
+        const Tile &tile = mTiles.back();
+        mBytes -= tile.mBytes;
+        mLookup.erase(tile.mKey);
+        mTiles.pop_back();
+    }
+}
+
+}
@@ -0,0 +1,87 @@
+#ifndef COMPONENTS_TERRAIN_TILECACHE_H
+#define COMPONENTS_TERRAIN_TILECACHE_H
+
+#include <list>
+#include <map>
+
+#include <osg/Vec2f>
+
+#include "defaultworld.hpp"
+
+namespace Terrain
+{
+
+    /// Identifies the chunk a quad tree node generates.
+    struct TileKey
+    {
+        size_t mLodLevel;
+        int mSize;
+        osg::Vec2f mCenter;
+
+        bool operator<(const TileKey &rhs) const
+        {
+            if(mLodLevel != rhs.mLodLevel) return mLodLevel < rhs.mLodLevel;
+            if(mSize != rhs.mSize) return mSize < rhs.mSize;
+            return mCenter < rhs.mCenter;
+        }
+    };
+
+    /**
+     * @brief Keeps recently generated chunk data in memory, so nodes that get
+     *        merged or split again shortly afterward don't need to regenerate it.
+     *        The least recently used tiles are evicted once the byte budget is
+     *        exceeded. Only to be used from the main thread.
+     */
+    class TileCache
+    {
+    public:
+        /// @param budget maximum number of bytes of tile data to keep, or 0 to disable
+        TileCache(size_t budget);
+
+        /// Look up a tile, marking it as most recently used.
+        /// @return the cached data, or nullptr if not present. Only valid until the
+        ///         next call to insert or setBudget.
+        const LoadResponseData *find(const TileKey &key);
+
+        /// Check if a tile is present, without counting a hit or miss or marking it as used.
+        bool contains(const TileKey &key) const { return mLookup.count(key) != 0; }
+
+        /// Add a tile, evicting older ones as needed to stay within the budget.
+        /// @note \a data is moved from
+        void insert(const TileKey &key, LoadResponseData &data);
+
+        void setBudget(size_t budget);
+        size_t getBudget() const { return mBudget; }
+
+        void clear();
+
+        size_t getNumTiles() const { return mTiles.size(); }
+        size_t getNumBytes() const { return mBytes; }
+        size_t getNumHits() const { return mHits; }
+        size_t getNumMisses() const { return mMisses; }
+
+    private:
+        struct Tile
+        {
+            TileKey mKey;
+            LoadResponseData mData;
+            size_t mBytes;
+        };
+        typedef std::list<Tile> TileList;
+
+        void evict(size_t budget);
+
+        // Most recently used first
+        TileList mTiles;
+        std::map<TileKey,TileList::iterator> mLookup;
+
+        size_t mBudget;
+        size_t mBytes;
+
+        size_t mHits;
+        size_t mMisses;
+    };
+
+}
+
+#endif
@@ -0,0 +1,389 @@
+#include "tilestore.hpp"
+
+#include <cstring>
+#include <cerrno>
+#include <sstream>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+
+const char sMagic[8] = { 'T', 'K', 'T', 'I', 'L', 'E', 'S', '\0' };
+
+const size_t sPageSize = 4096;
+
+size_t alignUp(size_t value, size_t alignment)
+{
+    return (value + alignment-1) / alignment * alignment;
+}
+
+// The index is shared with other processes, so slots are published with
+// release/acquire ordering on the tile number.
+uint32_t loadAcquire(const uint32_t *ptr)
+{
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+void storeRelease(uint32_t *ptr, uint32_t value)
+{
+    __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+}
+
+// Heights, then normals, then the geometric error
+size_t getTileStride(size_t numVerts)
+{
+    return alignUp(alignUp(numVerts*sizeof(float), 16) + numVerts*sizeof(osg::Vec3f) + sizeof(float), sPageSize);
+}
+
+uint32_t floatBits(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+}
+
+namespace Terrain
+{
+
+struct TileStore::Header
+{
+    char mMagic[8];
+    uint32_t mVersion;
+    uint32_t mVertsPerSide;
+    uint64_t mHash;
+    uint32_t mIndexSlots;
+    uint32_t mMaxTiles;
+    uint64_t mIndexOffset;
+    uint64_t mDataOffset;
+    uint64_t mTileStride;
+    // Number of tiles allocated so far. Only changed while holding the file lock.
+    uint32_t mNumTiles;
+};
+
+struct TileStore::IndexSlot
+{
+    // Tile number + 1, or 0 if the slot is empty. Written last, so once it's
+    // non-zero the rest of the slot and the tile data are valid.
+    uint32_t mTile;
+    uint32_t mLodLevel;
+    float mCenterX;
+    float mCenterY;
+};
+
+
+TileStore::TileStore()
+  : mFile(-1)
+  , mMapping(nullptr)
+  , mMappingSize(0)
+  , mTileHeightBytes(0)
+  , mHits(0)
+  , mMisses(0)
+{
+}
+
+TileStore::~TileStore()
+{
+    close();
+}
+
+uint64_t TileStore::hashBytes(const void *data, size_t size, uint64_t hash)
+{
+    const unsigned char *bytes = static_cast<const unsigned char*>(data);
+    for(size_t i = 0;i < size;++i)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+#ifndef _WIN32
+
+bool TileStore::create(const std::string &path, uint64_t hash, int vertsPerSide,
+                       unsigned int maxTiles, std::string &error)
+{
+    const size_t numVerts = vertsPerSide*vertsPerSide;
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.mMagic, sMagic, sizeof(header.mMagic));
+    header.mVersion = sVersion;
+    header.mVertsPerSide = vertsPerSide;
+    header.mHash = hash;
+    header.mIndexSlots = 1;
+    while(header.mIndexSlots < maxTiles*2)
+        header.mIndexSlots <<= 1;
+    header.mMaxTiles = maxTiles;
+    header.mIndexOffset = sPageSize;
+    header.mDataOffset = alignUp(header.mIndexOffset + header.mIndexSlots*sizeof(IndexSlot), sPageSize);
+    header.mTileStride = getTileStride(numVerts);
+    header.mNumTiles = 0;
+
+    // Build it on the side and move it into place, so other processes that
+    // still have an old file open aren't disturbed.
+    std::stringstream sstr;
+    sstr<< path<<".tmp"<<getpid();
+    const std::string tmpname = sstr.str();
+
+    int fd = ::open(tmpname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+    {
+        error = "Failed to create "+tmpname+": "+strerror(errno);
+        return false;
+    }
+    bool ok = (pwrite(fd, &header, sizeof(header), 0) == ssize_t(sizeof(header)) &&
+               ftruncate(fd, header.mDataOffset) == 0);
+    if(!ok)
+        error = "Failed to write "+tmpname+": "+strerror(errno);
+    ::close(fd);
+
+    if(ok && rename(tmpname.c_str(), path.c_str()) != 0)
+    {
+        error = "Failed to rename "+tmpname+" to "+path+": "+strerror(errno);
+        ok = false;
+    }
+    if(!ok)
+        unlink(tmpname.c_str());
+    return ok;
+}
+
+bool TileStore::open(const std::string &path, uint64_t hash, int vertsPerSide,
+                     unsigned int maxTiles, std::string &error)
+{
+    close();
+
+    const size_t numVerts = vertsPerSide*vertsPerSide;
+    const size_t heightBytes = alignUp(numVerts*sizeof(float), 16);
+    const size_t tileStride = getTileStride(numVerts);
+
+    // If the existing file is unusable, replace it and try once more
+    for(int attempt = 0;attempt < 2;++attempt)
+    {
+        int fd = ::open(path.c_str(), O_RDWR);
+        if(fd < 0)
+        {
+            if(errno != ENOENT)
+            {
+                error = "Failed to open "+path+": "+strerror(errno);
+                return false;
+            }
+            if(!create(path, hash, vertsPerSide, maxTiles, error))
+                return false;
+            continue;
+        }
+
+        Header header;
+        struct stat status;
+        bool valid = (pread(fd, &header, sizeof(header), 0) == ssize_t(sizeof(header)) &&
+                      fstat(fd, &status) == 0 &&
+                      memcmp(header.mMagic, sMagic, sizeof(sMagic)) == 0 &&
+                      header.mVersion == sVersion &&
+                      header.mHash == hash &&
+                      header.mVertsPerSide == uint32_t(vertsPerSide) &&
+                      header.mTileStride == tileStride &&
+                      header.mIndexSlots >= header.mMaxTiles*2 &&
+                      (header.mIndexSlots & (header.mIndexSlots-1)) == 0 &&
+                      header.mIndexOffset == sPageSize &&
+                      header.mDataOffset >= header.mIndexOffset + header.mIndexSlots*sizeof(IndexSlot) &&
+                      uint64_t(status.st_size) >= header.mDataOffset);
+        if(!valid)
+        {
+            ::close(fd);
+            if(attempt > 0)
+            {
+                error = "Failed to initialize "+path;
+                return false;
+            }
+            if(!create(path, hash, vertsPerSide, maxTiles, error))
+                return false;
+            continue;
+        }
+
+        // Map the maximum size up front. Pages past the end of the file are
+        // never touched; the file is grown before a tile is published.
+        size_t mappingSize = header.mDataOffset + size_t(header.mMaxTiles)*header.mTileStride;
+        void *mapping = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(mapping == MAP_FAILED)
+        {
+            error = "Failed to map "+path+": "+strerror(errno);
+            ::close(fd);
+            return false;
+        }
+
+        mFile = fd;
+        mMapping = static_cast<unsigned char*>(mapping);
+        mMappingSize = mappingSize;
+        mTileHeightBytes = heightBytes;
+        return true;
+    }
+    return false;
+}
+
+void TileStore::close()
+{
+    if(mMapping)
+        munmap(mMapping, mMappingSize);
+    mMapping = nullptr;
+    mMappingSize = 0;
+    if(mFile >= 0)
+        ::close(mFile);
+    mFile = -1;
+}
+
+void TileStore::write(size_t lodLevel, const osg::Vec2f &center, const float *heights, const osg::Vec3f *normals,
+                      float geometricError)
+{
+    if(!mMapping)
+        return;
+
+    std::lock_guard<std::mutex> lock(mWriteMutex);
+    if(flock(mFile, LOCK_EX) != 0)
+        return;
+
+    Header *header = getHeader();
+    uint32_t existing;
+    IndexSlot *slot = findSlot(lodLevel, center, existing);
+    const uint32_t tile = header->mNumTiles;
+    if(slot && existing == 0 && tile < header->mMaxTiles)
+    {
+        // Reserve the disk space first, so running out of it fails here
+        // rather than with a signal while writing through the mapping.
+        const size_t numVerts = header->mVertsPerSide*header->mVertsPerSide;
+        const off_t offset = header->mDataOffset + off_t(tile)*header->mTileStride;
+        if(posix_fallocate(mFile, offset, header->mTileStride) == 0)
+        {
+            unsigned char *data = mMapping + offset;
+            memcpy(data, heights, numVerts*sizeof(float));
+            memcpy(data + mTileHeightBytes, normals, numVerts*sizeof(osg::Vec3f));
+            memcpy(data + mTileHeightBytes + numVerts*sizeof(osg::Vec3f), &geometricError, sizeof(float));
+            __atomic_store_n(&header->mNumTiles, tile+1, __ATOMIC_RELAXED);
+
+            slot->mLodLevel = uint32_t(lodLevel);
+            slot->mCenterX = center.x() + 0.0f;
+            slot->mCenterY = center.y() + 0.0f;
+            storeRelease(&slot->mTile, tile+1);
+        }
+    }
+
+    flock(mFile, LOCK_UN);
+}
+
+#else
+
+bool TileStore::create(const std::string&, uint64_t, int, unsigned int, std::string &error)
+{
+    error = "Not supported on this platform";
+    return false;
+}
+
+bool TileStore::open(const std::string &path, uint64_t hash, int vertsPerSide,
+                     unsigned int maxTiles, std::string &error)
+{
+    return create(path, hash, vertsPerSide, maxTiles, error);
+}
+
+void TileStore::close()
+{
+}
+
+void TileStore::write(size_t, const osg::Vec2f&, const float*, const osg::Vec3f*, float)
+{
+}
+
+#endif
+
+TileStore::Header *TileStore::getHeader() const
+{
+    return reinterpret_cast<Header*>(mMapping);
+}
+
+TileStore::IndexSlot *TileStore::getIndex() const
+{
+    return reinterpret_cast<IndexSlot*>(mMapping + getHeader()->mIndexOffset);
+}
+
+TileStore::IndexSlot *TileStore::findSlot(uint32_t lodLevel, const osg::Vec2f &center, uint32_t &tile) const
+{
+    // Adding 0 turns -0 into +0, so the bits match whenever the values do
+    const float centerX = center.x() + 0.0f;
+    const float centerY = center.y() + 0.0f;
+
+    uint32_t hash = lodLevel * 0x9e3779b1u;
+    hash ^= floatBits(centerX) * 0x85ebca77u;
+    hash ^= floatBits(centerY) * 0xc2b2ae3du;
+    hash ^= hash >> 15;
+
+    const uint32_t mask = getHeader()->mIndexSlots - 1;
+    IndexSlot *index = getIndex();
+    for(uint32_t i = 0;i <= mask;++i)
+    {
+        IndexSlot *slot = &index[(hash+i) & mask];
+        // Only the tile number read here says what the slot held when we looked. Another
+        // writer may fill an empty slot with some other tile right after.
+        tile = loadAcquire(&slot->mTile);
+        if(tile == 0)
+            return slot;
+        if(slot->mLodLevel == lodLevel && slot->mCenterX == centerX && slot->mCenterY == centerY)
+            return slot;
+    }
+    tile = 0;
+    return nullptr;
+}
+
+bool TileStore::read(size_t lodLevel, const osg::Vec2f &center, float *heights, osg::Vec3f *normals,
+                     float &geometricError) const
+{
+    if(!mMapping)
+        return false;
+
+    uint32_t tile;
+    findSlot(lodLevel, center, tile);
+    if(tile == 0)
+    {
+        ++mMisses;
+        return false;
+    }
+    ++mHits;
+
+    const Header *header = getHeader();
+    const size_t numVerts = header->mVertsPerSide*header->mVertsPerSide;
+    const unsigned char *data = mMapping + header->mDataOffset + size_t(tile-1)*header->mTileStride;
+    memcpy(heights, data, numVerts*sizeof(float));
+    memcpy(normals, data + mTileHeightBytes, numVerts*sizeof(osg::Vec3f));
+    memcpy(&geometricError, data + mTileHeightBytes + numVerts*sizeof(osg::Vec3f), sizeof(float));
+    return true;
+}
+
+bool TileStore::contains(size_t lodLevel, const osg::Vec2f &center) const
+{
+    if(!mMapping)
+        return false;
+    uint32_t tile;
+    findSlot(lodLevel, center, tile);
+    return tile != 0;
+}
+
+size_t TileStore::getMaxTiles() const
+{
+    if(!mMapping)
+        return 0;
+    return getHeader()->mMaxTiles;
+}
+
+size_t TileStore::getNumTiles() const
+{
+    if(!mMapping)
+        return 0;
+    return __atomic_load_n(&getHeader()->mNumTiles, __ATOMIC_RELAXED);
+}
+
+}
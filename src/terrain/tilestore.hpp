@@ -0,0 +1,100 @@
+#ifndef COMPONENTS_TERRAIN_TILESTORE_H
+#define COMPONENTS_TERRAIN_TILESTORE_H
+
+#include <string>
+#include <mutex>
+#include <atomic>
+
+#include <stdint.h>
+
+#include <osg/Vec2f>
+#include <osg/Vec3f>
+
+namespace Terrain
+{
+
+    /**
+     * @brief A persistent on-disk store of generated chunk heights and normals,
+     *        so they don't have to be generated again on the next run. The file
+     *        is memory-mapped and may be shared by several processes at once;
+     *        tiles are only ever added, never modified.
+     *        File layout: a header page, an open-addressed index of tile keys,
+     *        then page-aligned tiles of heights followed by normals and the
+     *        tile's geometric error.
+     * @note  Not available on Windows; open() always fails there.
+     */
+    class TileStore
+    {
+    public:
+        /// Bump whenever the file layout changes.
+        static const uint32_t sVersion = 2;
+
+        TileStore();
+        ~TileStore();
+
+        /// Open the store at \a path, creating it if it doesn't exist. An existing
+        /// file made with a different layout, hash or vertex count is replaced.
+        /// @param hash identifies the data the tiles were generated from
+        /// @param vertsPerSide number of vertices along each side of a tile
+        /// @param maxTiles maximum number of tiles the file may hold
+        /// @return false on failure, with the reason in \a error
+        bool open(const std::string &path, uint64_t hash, int vertsPerSide,
+                  unsigned int maxTiles, std::string &error);
+        void close();
+
+        bool isOpen() const { return mMapping != nullptr; }
+
+        /// Copy a tile's data out of the store. Thread-safe.
+        /// @param heights receives vertsPerSide^2 heights
+        /// @param normals receives vertsPerSide^2 normals
+        /// @param geometricError receives the error passed to write()
+        /// @return false if the tile isn't in the store
+        bool read(size_t lodLevel, const osg::Vec2f &center, float *heights, osg::Vec3f *normals,
+                  float &geometricError) const;
+
+        /// Check if a tile is in the store, without affecting the hit/miss counts. Thread-safe.
+        bool contains(size_t lodLevel, const osg::Vec2f &center) const;
+
+        /// Add a tile to the store, unless it's already there or the store is full.
+        /// Thread-safe.
+        void write(size_t lodLevel, const osg::Vec2f &center, const float *heights, const osg::Vec3f *normals,
+                   float geometricError);
+
+        size_t getNumTiles() const;
+        /// Get the number of tiles the store can hold. This is fixed when the file is created.
+        size_t getMaxTiles() const;
+        size_t getNumHits() const { return mHits; }
+        size_t getNumMisses() const { return mMisses; }
+
+        /// 64-bit FNV-1a hash, for building the \a hash passed to open().
+        static uint64_t hashBytes(const void *data, size_t size, uint64_t hash=14695981039346656037ULL);
+
+    private:
+        struct Header;
+        struct IndexSlot;
+
+        Header *getHeader() const;
+        IndexSlot *getIndex() const;
+        /// Find the slot holding the given tile, or the empty slot where it would go.
+        /// @param tile receives the slot's tile number as of the lookup, 0 if it was empty
+        IndexSlot *findSlot(uint32_t lodLevel, const osg::Vec2f &center, uint32_t &tile) const;
+
+        bool create(const std::string &path, uint64_t hash, int vertsPerSide,
+                    unsigned int maxTiles, std::string &error);
+
+        int mFile;
+        unsigned char *mMapping;
+        size_t mMappingSize;
+
+        size_t mTileHeightBytes;
+
+        // Serializes writers within this process. flock() handles other processes.
+        std::mutex mWriteMutex;
+
+        mutable std::atomic<size_t> mHits;
+        mutable std::atomic<size_t> mMisses;
+    };
+
+}
+
+#endif
@@ -0,0 +1,204 @@
+#include "vertexcache.hpp"
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+namespace
+{
+
+// Size of the LRU cache modelled while scoring. Real caches are usually
+// smaller, but this is what the scoring function was tuned for.
+const int MaxCacheSize = 32;
+const int MaxValence = 32;
+
+const float CacheDecayPower = 1.5f;
+const float LastTriScore = 0.75f;
+const float ValenceBoostScale = 2.0f;
+const float ValenceBoostPower = 0.5f;
+
+struct ScoreTables
+{
+    float mCache[MaxCacheSize];
+    float mValence[MaxValence];
+
+    ScoreTables()
+    {
+        for(int i = 0;i < MaxCacheSize;++i)
+        {
+            // The last triangle's vertices get a fixed score, so it doesn't
+            // matter which of them is reused first
+            if(i < 3)
+                mCache[i] = LastTriScore;
+            else
+                mCache[i] = std::pow(1.0f - (i-3) / float(MaxCacheSize-3), CacheDecayPower);
+        }
+        mValence[0] = 0.0f;
+        for(int i = 1;i < MaxValence;++i)
+            mValence[i] = ValenceBoostScale * std::pow(float(i), -ValenceBoostPower);
+    }
+};
+const ScoreTables sScores;
+
+float getVertexScore(int cachePos, int remainingTris)
+{
+    // Vertices nothing needs anymore are never worth anything
+    if(remainingTris == 0)
+        return -1.0f;
+
+    float score = (cachePos >= 0) ? sScores.mCache[cachePos] : 0.0f;
+    // Boost vertices with few triangles left, to finish them off and avoid
+    // leaving lone triangles behind
+    return score + sScores.mValence[std::min(remainingTris, MaxValence-1)];
+}
+
+}
+
+namespace Terrain
+{
+
+template<typename IndexType>
+void optimizeVertexCache(IndexType *indices, size_t numIndices, size_t numVerts)
+{
+    const size_t numTris = numIndices / 3;
+    if(numTris == 0)
+        return;
+
+    // Triangles using each vertex, the ones not drawn yet coming first
+    std::vector<int> remaining(numVerts, 0);
+    for(size_t i = 0;i < numTris*3;++i)
+        ++remaining[indices[i]];
+    std::vector<size_t> triOffsets(numVerts+1, 0);
+    for(size_t v = 0;v < numVerts;++v)
+        triOffsets[v+1] = triOffsets[v] + remaining[v];
+    std::vector<size_t> vertTris(numTris*3);
+    {
+        std::vector<size_t> fill(triOffsets.begin(), triOffsets.end()-1);
+        for(size_t i = 0;i < numTris*3;++i)
+            vertTris[fill[indices[i]]++] = i/3;
+    }
+
+    std::vector<int> cachePos(numVerts, -1);
+    std::vector<float> vertScores(numVerts);
+    for(size_t v = 0;v < numVerts;++v)
+        vertScores[v] = getVertexScore(-1, remaining[v]);
+
+    std::vector<float> triScores(numTris);
+    std::vector<bool> drawn(numTris, false);
+    size_t bestTri = 0;
+    for(size_t t = 0;t < numTris;++t)
+    {
+        triScores[t] = vertScores[indices[t*3]] + vertScores[indices[t*3+1]] + vertScores[indices[t*3+2]];
+        if(triScores[t] > triScores[bestTri])
+            bestTri = t;
+    }
+
+    std::vector<IndexType> output;
+    output.reserve(numTris*3);
+    std::vector<size_t> cache, newCache;
+    cache.reserve(MaxCacheSize+3);
+    newCache.reserve(MaxCacheSize+3);
+    size_t nextUndrawn = 0;
+    while(1)
+    {
+        drawn[bestTri] = true;
+        const IndexType *tri = indices + bestTri*3;
+        output.insert(output.end(), tri, tri+3);
+
+        // Move the triangle's vertices to the front of the cache, and take
+        // the triangle out of their lists of remaining triangles
+        newCache.assign(tri, tri+3);
+        for(int i = 0;i < 3;++i)
+        {
+            size_t v = tri[i];
+            size_t *begin = &vertTris[triOffsets[v]];
+            size_t *end = begin + remaining[v];
+            std::iter_swap(std::find(begin, end, bestTri), end-1);
+            --remaining[v];
+        }
+        for(size_t v : cache)
+        {
+            if(v != tri[0] && v != tri[1] && v != tri[2])
+                newCache.push_back(v);
+        }
+        cache.swap(newCache);
+
+        // Rescore everything that moved in the cache. Anything pushed out of
+        // it needs a new score too.
+        for(size_t i = 0;i < cache.size();++i)
+        {
+            size_t v = cache[i];
+            cachePos[v] = (i < size_t(MaxCacheSize)) ? int(i) : -1;
+            vertScores[v] = getVertexScore(cachePos[v], remaining[v]);
+        }
+
+        // The best next triangle is usually one using a cached vertex
+        float bestScore = -1.0f;
+        for(size_t v : cache)
+        {
+            for(int i = 0;i < remaining[v];++i)
+            {
+                size_t t = vertTris[triOffsets[v] + i];
+                triScores[t] = vertScores[indices[t*3]] + vertScores[indices[t*3+1]] + vertScores[indices[t*3+2]];
+                if(triScores[t] > bestScore)
+                {
+                    bestScore = triScores[t];
+                    bestTri = t;
+                }
+            }
+        }
+        if(cache.size() > size_t(MaxCacheSize))
+            cache.resize(MaxCacheSize);
+
+        if(bestScore < 0.0f)
+        {
+            // Nothing left around the cache. Continue with whatever comes next.
+            while(nextUndrawn < numTris && drawn[nextUndrawn])
+                ++nextUndrawn;
+            if(nextUndrawn == numTris)
+                break;
+            bestTri = nextUndrawn;
+        }
+    }
+
+    std::copy(output.begin(), output.end(), indices);
+}
+
+template<typename IndexType>
+VertexCacheStats getVertexCacheStats(const IndexType *indices, size_t numIndices, size_t numVerts,
+                                     unsigned int cacheSize)
+{
+    std::vector<size_t> fifo(std::max(cacheSize, 1u), size_t(-1));
+    std::vector<bool> used(numVerts, false);
+    size_t fifoPos = 0;
+    size_t transforms = 0;
+    size_t numUsed = 0;
+    for(size_t i = 0;i < numIndices;++i)
+    {
+        size_t v = indices[i];
+        if(!used[v])
+        {
+            used[v] = true;
+            ++numUsed;
+        }
+        if(std::find(fifo.begin(), fifo.end(), v) == fifo.end())
+        {
+            fifo[fifoPos] = v;
+            fifoPos = (fifoPos+1) % fifo.size();
+            ++transforms;
+        }
+    }
+
+    VertexCacheStats stats;
+    stats.mACMR = (numIndices >= 3) ? transforms / float(numIndices/3) : 0.0f;
+    stats.mATVR = (numUsed > 0) ? transforms / float(numUsed) : 0.0f;
+    return stats;
+}
+
+
+template void optimizeVertexCache<unsigned short>(unsigned short*, size_t, size_t);
+template void optimizeVertexCache<unsigned int>(unsigned int*, size_t, size_t);
+template VertexCacheStats getVertexCacheStats<unsigned short>(const unsigned short*, size_t, size_t, unsigned int);
+template VertexCacheStats getVertexCacheStats<unsigned int>(const unsigned int*, size_t, size_t, unsigned int);
+
+}
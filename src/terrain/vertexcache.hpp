@@ -0,0 +1,34 @@
+#ifndef COMPONENTS_TERRAIN_VERTEXCACHE_H
+#define COMPONENTS_TERRAIN_VERTEXCACHE_H
+
+#include <cstddef>
+
+namespace Terrain
+{
+
+    /// Reorder a triangle list for better post-transform vertex cache reuse, using
+    /// Tom Forsyth's linear-speed vertex cache optimisation. The triangles and their
+    /// winding stay the same, only the order they're drawn in changes.
+    /// @param indices triangle list to reorder in place
+    /// @param numIndices number of indices, a multiple of 3
+    /// @param numVerts number of vertices the indices refer to
+    template<typename IndexType>
+    void optimizeVertexCache(IndexType *indices, size_t numIndices, size_t numVerts);
+
+    struct VertexCacheStats
+    {
+        /// Average cache miss ratio: vertex shader invocations per triangle
+        float mACMR;
+        /// Average transform to vertex ratio: vertex shader invocations per
+        /// vertex used, 1.0 being optimal
+        float mATVR;
+    };
+
+    /// Simulate drawing a triangle list through a FIFO post-transform cache of the given size.
+    template<typename IndexType>
+    VertexCacheStats getVertexCacheStats(const IndexType *indices, size_t numIndices, size_t numVerts,
+                                         unsigned int cacheSize);
+
+}
+
+#endif
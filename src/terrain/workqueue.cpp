@@ -0,0 +1,182 @@
+#include "workqueue.hpp"
+
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+
+namespace
+{
+
+struct RequestCompare {
+    bool operator()(const Terrain::WorkQueue::Request *lhs, const Terrain::WorkQueue::Request *rhs) const
+    { return lhs->getPriority() > rhs->getPriority(); }
+};
+
+}
+
+namespace Terrain
+{
+
+WorkQueue::WorkQueue(Handler *handler, unsigned int numThreads)
+  : mHandler(handler)
+  , mQuit(false)
+  , mOutstanding(0)
+{
+    if(numThreads == 0)
+    {
+        // Leave a core for the main thread
+        numThreads = std::thread::hardware_concurrency();
+        numThreads = (numThreads > 1) ? numThreads-1 : 1;
+    }
+
+    mThreads.reserve(numThreads);
+    for(unsigned int i = 0;i < numThreads;++i)
+        mThreads.push_back(std::thread(&WorkQueue::workerMain, this));
+}
+
+WorkQueue::~WorkQueue()
+{
+    {
+        std::lock_guard<std::mutex> lock(mRequestMutex);
+        mQuit = true;
+    }
+    mRequestCond.notify_all();
+    for(std::thread &thrd : mThreads)
+        thrd.join();
+    mThreads.clear();
+
+    // Anything left over never gets a response
+    for(Request *req : mRequests)
+        delete req;
+    mRequests.clear();
+    for(Request *req : mResponses)
+        delete req;
+    mResponses.clear();
+}
+
+
+void WorkQueue::workerMain()
+{
+    std::unique_lock<std::mutex> lock(mRequestMutex);
+    while(1)
+    {
+        while(!mQuit && mRequests.empty())
+            mRequestCond.wait(lock);
+        if(mQuit) break;
+
+        std::pop_heap(mRequests.begin(), mRequests.end(), RequestCompare());
+        Request *req = mRequests.back();
+        mRequests.pop_back();
+        lock.unlock();
+
+        // Don't bother with requests nobody is waiting for anymore
+        if(!req->isCancelled())
+        {
+            try {
+                mHandler->handleRequest(req);
+                req->mSucceeded = true;
+            }
+            catch(std::exception &e) {
+                std::cerr<< "Terrain request failed: "<<e.what() <<std::endl;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> resplock(mResponseMutex);
+            mResponses.push_back(req);
+        }
+        mResponseCond.notify_all();
+
+        lock.lock();
+    }
+}
+
+
+void WorkQueue::addRequest(Request *req)
+{
+    {
+        std::lock_guard<std::mutex> lock(mResponseMutex);
+        ++mOutstanding;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mRequestMutex);
+        mRequests.push_back(req);
+        std::push_heap(mRequests.begin(), mRequests.end(), RequestCompare());
+    }
+    mRequestCond.notify_one();
+}
+
+void WorkQueue::updatePriorities(const PriorityFunc &func)
+{
+    std::vector<Request*> cancelled;
+    {
+        std::lock_guard<std::mutex> lock(mRequestMutex);
+        auto iter = mRequests.begin();
+        while(iter != mRequests.end())
+        {
+            Request *req = *iter;
+            if(req->isCancelled())
+            {
+                cancelled.push_back(req);
+                iter = mRequests.erase(iter);
+            }
+            else
+            {
+                req->mPriority = func(req);
+                ++iter;
+            }
+        }
+        std::make_heap(mRequests.begin(), mRequests.end(), RequestCompare());
+    }
+
+    if(!cancelled.empty())
+    {
+        // Send them straight back so the handler can account for them
+        {
+            std::lock_guard<std::mutex> lock(mResponseMutex);
+            mResponses.insert(mResponses.end(), cancelled.begin(), cancelled.end());
+        }
+        mResponseCond.notify_all();
+    }
+}
+
+size_t WorkQueue::processResponses()
+{
+    std::deque<Request*> responses;
+    {
+        std::lock_guard<std::mutex> lock(mResponseMutex);
+        responses.swap(mResponses);
+        mOutstanding -= responses.size();
+    }
+
+    for(Request *req : responses)
+    {
+        mHandler->handleResponse(req);
+        delete req;
+    }
+    return responses.size();
+}
+
+size_t WorkQueue::waitResponses()
+{
+    {
+        std::unique_lock<std::mutex> lock(mResponseMutex);
+        while(mResponses.empty() && mOutstanding > 0)
+            mResponseCond.wait(lock);
+    }
+    return processResponses();
+}
+
+size_t WorkQueue::getNumQueued() const
+{
+    std::lock_guard<std::mutex> lock(mRequestMutex);
+    return mRequests.size();
+}
+
+size_t WorkQueue::getNumOutstanding() const
+{
+    std::lock_guard<std::mutex> lock(mResponseMutex);
+    return mOutstanding;
+}
+
+}
@@ -0,0 +1,132 @@
+#ifndef COMPONENTS_TERRAIN_WORKQUEUE_H
+#define COMPONENTS_TERRAIN_WORKQUEUE_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <atomic>
+
+namespace Terrain
+{
+
+    /**
+     * @brief A pool of background threads processing terrain load requests.
+     *        Requests are handled on a worker thread, then queued up to be
+     *        completed on the main thread when processResponses is called.
+     *        Pending requests are processed lowest priority value first.
+     */
+    class WorkQueue
+    {
+    public:
+        /// A flag shared between the owner of some data and the requests
+        /// working on it. Once cancelled, requests holding the token are
+        /// skipped if not yet started, and their responses are not delivered
+        /// to the owner.
+        class CancelToken
+        {
+        public:
+            CancelToken() : mFlag(std::make_shared<std::atomic<bool>>(false)) { }
+
+            void cancel() { *mFlag = true; }
+            bool isCancelled() const { return *mFlag; }
+
+            /// Detach from any previously issued requests
+            void reset() { mFlag = std::make_shared<std::atomic<bool>>(false); }
+
+        private:
+            std::shared_ptr<std::atomic<bool>> mFlag;
+        };
+
+        /// Base for a unit of work. Derived types carry the request and response data.
+        class Request
+        {
+        public:
+            Request(unsigned int type, const CancelToken &token, float priority)
+              : mType(type), mToken(token), mPriority(priority), mSucceeded(false)
+            { }
+            virtual ~Request() { }
+
+            unsigned int getType() const { return mType; }
+            bool isCancelled() const { return mToken.isCancelled(); }
+            float getPriority() const { return mPriority; }
+            bool succeeded() const { return mSucceeded; }
+
+        private:
+            unsigned int mType;
+            CancelToken mToken;
+            float mPriority;
+            bool mSucceeded;
+
+            friend class WorkQueue;
+        };
+
+        /// Calculates a new priority for a request that hasn't been started yet.
+        typedef std::function<float(const Request*)> PriorityFunc;
+
+        class Handler
+        {
+        public:
+            virtual ~Handler() { }
+
+            /// Called from a background worker thread
+            virtual void handleRequest(Request *req) = 0;
+            /// Called from the main thread
+            virtual void handleResponse(Request *req) = 0;
+        };
+
+        /// @param numThreads number of worker threads to start, or 0 to pick
+        ///        one based on the number of available cores
+        WorkQueue(Handler *handler, unsigned int numThreads=0);
+        ~WorkQueue();
+
+        /// Queue a request to be handled in the background.
+        /// @note takes ownership of \a req
+        void addRequest(Request *req);
+
+        /// Recalculate the priority of all requests that haven't been started
+        /// yet. Cancelled requests are dropped. Must be called from the main thread.
+        void updatePriorities(const PriorityFunc &func);
+
+        /// Complete any finished requests. Must be called from the main thread.
+        /// @return the number of responses handled
+        size_t processResponses();
+
+        /// Block until at least one request has finished, then complete it
+        /// and any others that are ready. Returns immediately if there is
+        /// nothing outstanding. Must be called from the main thread.
+        size_t waitResponses();
+
+        /// Get the number of requests that have been added but not yet completed.
+        size_t getNumOutstanding() const;
+
+        /// Get the number of requests waiting for a worker thread.
+        size_t getNumQueued() const;
+
+        size_t getNumThreads() const { return mThreads.size(); }
+
+    private:
+        void workerMain();
+
+        Handler *mHandler;
+
+        std::vector<std::thread> mThreads;
+
+        mutable std::mutex mRequestMutex;
+        std::condition_variable mRequestCond;
+        // Heap ordered so the lowest priority value is at the front
+        std::vector<Request*> mRequests;
+        bool mQuit;
+
+        mutable std::mutex mResponseMutex;
+        std::condition_variable mResponseCond;
+        std::deque<Request*> mResponses;
+        size_t mOutstanding;
+    };
+
+}
+
+#endif
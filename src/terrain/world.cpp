@@ -31,6 +31,11 @@ float World::getHeightAt(const osg::Vec3f &worldPos)
     return mStorage->getHeightAt(worldPos);
 }
 
+void World::getHeightsAt(const osg::Vec3f *worldPos, size_t count, float *heights)
+{
+    mStorage->getHeightsAt(worldPos, count, heights);
+}
+
 void World::convertPosition(float &x, float &y, float &z)
 {
     Terrain::convertPosition(mAlign, x, y, z);
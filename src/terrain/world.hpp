@@ -2,6 +2,9 @@
 #define COMPONENTS_TERRAIN_WORLD_H
 
 #include <iostream>
+#include <string>
+
+#include <stdint.h>
 
 #include <osg/ref_ptr>
 #include <osg/BoundingBox>
@@ -13,6 +16,7 @@ namespace osg
 {
     class Vec2f;
     class Vec3f;
+    class Polytope;
 }
 
 namespace osgViewer
@@ -46,12 +50,17 @@ namespace Terrain
         bool getShadowsEnabled() { return mShadows; }
         bool getSplitShadowsEnabled() { return mSplitShadows; }
 
-        float getHeightAt (const osg::Vec3f& worldPos);
+        virtual float getHeightAt (const osg::Vec3f& worldPos);
+
+        /// Get the terrain heights at \a count positions at once
+        virtual void getHeightsAt (const osg::Vec3f* worldPos, size_t count, float* heights);
 
         /// Update chunk LODs according to this camera position
+        /// @param frustum the view frustum in world space. Terrain outside of it may be loaded later
+        ///        than the rest. An empty polytope counts as seeing everything.
         /// @note Calling this method might lead to composite textures being rendered, so it is best
         /// not to call it when render commands are still queued, since that would cause a flush.
-        virtual void update (const osg::Vec3f& cameraPos) = 0;
+        virtual void update (const osg::Vec3f& cameraPos, const osg::Polytope& frustum) = 0;
 
         // This is only a hint and may be ignored by the implementation.
         virtual void loadCell(int x, int y) {}
@@ -78,6 +87,29 @@ namespace Terrain
 
         virtual void rebuildCompositeMaps(int) { }
 
+        /// Keep composite maps in a file at \a path, loading them from there rather than rendering
+        /// them again on the next run. This is only a hint and may be ignored by the implementation.
+        /// @param hash identifies the terrain data; stored maps rendered from different data are discarded
+        /// @return false on failure, with the reason in \a error
+        virtual bool openCompositeMapStore(const std::string &path, uint64_t hash, std::string &error)
+        { error = "Not supported"; return false; }
+
+        /// Limit the time one call to update may spend restructuring the terrain, spreading
+        /// the rest over the following frames. This is only a hint and may be ignored by the implementation.
+        /// @param microseconds time budget per update, or 0 for no limit
+        virtual void setUpdateBudget(unsigned int microseconds) { }
+
+        /// Limit the number of composite maps rendered per frame, leaving the rest for later frames.
+        /// This is only a hint and may be ignored by the implementation.
+        virtual void setCompositeMapBudget(unsigned int maps) { }
+
+        /// Pick LODs so that the geometric error of chunks projects to at most this many pixels
+        /// on screen. This is only a hint and may be ignored by the implementation.
+        /// @param pixels allowed error in pixels, or 0 to pick LODs by distance alone
+        /// @param fovY vertical field of view in degrees
+        /// @param viewportHeight in pixels
+        virtual void setMaxScreenSpaceError(float pixels, float fovY, int viewportHeight) { }
+
         int getVisibilityFlags() { return mVisibilityFlags; }
 
         Alignment getAlign() { return mAlign; }
@@ -0,0 +1,461 @@
+#include "terrainstorage.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <map>
+
+#include <osg/Texture2D>
+#include <osgDB/ReadFile>
+
+#include "noiseutils/noisebounds.h"
+
+#include "terrain/quadtreenode.hpp"
+#include "terrain/normals.hpp"
+
+#include "log.hpp"
+
+
+namespace
+{
+
+// Copy the heights that known chunks have at the points of a grid, clearing
+// their missing flags
+void copyKnownHeights(const std::vector<Terrain::GeneratedChunk> &known, Terrain::Alignment align,
+                      double originX, double originY, double spacing, int gridSize,
+                      float *heights, char *missing)
+{
+    for(const Terrain::GeneratedChunk &chunk : known)
+    {
+        const double chunk_vtx = chunk.mSize / double(TERRAIN_SIZE-1);
+        const double chunkX = chunk.mCenter.x() - chunk.mSize/2.0;
+        const double chunkY = chunk.mCenter.y() - chunk.mSize/2.0;
+        for(int y = 0;y < gridSize;++y)
+        {
+            double fy = (originY + y*spacing - chunkY) / chunk_vtx;
+            if(!(fy >= 0.0 && fy <= TERRAIN_SIZE-1) || fy != std::floor(fy))
+                continue;
+            for(int x = 0;x < gridSize;++x)
+            {
+                if(!missing[y*gridSize + x])
+                    continue;
+                double fx = (originX + x*spacing - chunkX) / chunk_vtx;
+                if(!(fx >= 0.0 && fx <= TERRAIN_SIZE-1) || fx != std::floor(fx))
+                    continue;
+
+                heights[y*gridSize + x] = chunk.getHeight(align, int(fx)*TERRAIN_SIZE + int(fy));
+                missing[y*gridSize + x] = 0;
+            }
+        }
+    }
+}
+
+}
+
+namespace TK
+{
+
+TerrainStorage::TerrainStorage()
+{
+    osg::ref_ptr<osg::Image> heightmap = osgDB::readImageFile("terrain/tk-heightmap.png");
+    if(!heightmap.valid())
+        throw std::runtime_error("Failed to load terrain/tk-heightmap.png");
+    heightmap->flipVertical();
+    mHeightmapModule.SetImage(heightmap.get());
+    mHeightmapModule.SetFrequency(32.0);
+
+    float fields_base = 16.0f/255.0f * 2.0f - 1.0f;
+    mBaseFieldsTerrain.SetFrequency(noise::module::DEFAULT_PERLIN_FREQUENCY * 2.0);
+    mFieldsTerrain.SetSourceModule(0, mBaseFieldsTerrain);
+    mFieldsTerrain.SetScale(1.0 / 32.0);
+
+    mBaseSeaTerrain.SetFrequency(2.0 * 2.0);
+    mSeaTerrain.SetSourceModule(0, mBaseSeaTerrain);
+    mSeaTerrain.SetScale(1.0 / 64.0);
+
+    float edge_falloff = 8.0f/255.0f;
+    mCombinedTerrain.SetSourceModule(0, mSeaTerrain);
+    mCombinedTerrain.SetSourceModule(1, mFieldsTerrain);
+    mCombinedTerrain.SetControlModule(mHeightmapModule);
+    mCombinedTerrain.SetBounds(fields_base-edge_falloff, std::numeric_limits<double>::max());
+    mCombinedTerrain.SetEdgeFalloff(edge_falloff);
+
+    mFinalTerrain.SetSourceModule(0, mCombinedTerrain);
+    mFinalTerrain.SetSourceModule(1, mHeightmapModule);
+
+    mCompiledTerrain.Compile(mFinalTerrain);
+
+    mHaveNoiseBounds = noise::utils::GetOutputBounds(mSeaTerrain, mSeaBounds[0], mSeaBounds[1]) &&
+                       noise::utils::GetOutputBounds(mFieldsTerrain, mFieldsBounds[0], mFieldsBounds[1]);
+
+    // Anything that changes the generated chunks needs to go in here. Bump
+    // the version when changing how they're generated.
+    const double params[] = {
+        double(TERRAIN_GENERATOR_VERSION),
+        double(TERRAIN_SIZE), double(TERRAIN_WORLD_SIZE), double(TERRAIN_WORLD_HEIGHT),
+        mHeightmapModule.GetFrequency(),
+        mBaseFieldsTerrain.GetFrequency(), mBaseFieldsTerrain.GetLacunarity(),
+        mBaseFieldsTerrain.GetPersistence(), double(mBaseFieldsTerrain.GetOctaveCount()),
+        double(mBaseFieldsTerrain.GetSeed()), double(mBaseFieldsTerrain.GetNoiseQuality()),
+        mFieldsTerrain.GetScale(), mFieldsTerrain.GetBias(),
+        mBaseSeaTerrain.GetFrequency(), mBaseSeaTerrain.GetLacunarity(),
+        mBaseSeaTerrain.GetPersistence(), double(mBaseSeaTerrain.GetOctaveCount()),
+        double(mBaseSeaTerrain.GetSeed()), double(mBaseSeaTerrain.GetNoiseQuality()),
+        mSeaTerrain.GetScale(), mSeaTerrain.GetBias(),
+        mCombinedTerrain.GetLowerBound(), mCombinedTerrain.GetUpperBound(),
+        mCombinedTerrain.GetEdgeFalloff()
+    };
+    const int dims[] = { heightmap->s(), heightmap->t(), int(heightmap->getPixelFormat()), int(heightmap->getDataType()) };
+    mGeneratorHash = Terrain::TileStore::hashBytes(params, sizeof(params));
+    mGeneratorHash = Terrain::TileStore::hashBytes(dims, sizeof(dims), mGeneratorHash);
+    mGeneratorHash = Terrain::TileStore::hashBytes(heightmap->data(), heightmap->getTotalSizeInBytes(), mGeneratorHash);
+}
+
+bool TerrainStorage::openTileStore(const std::string &path, unsigned int maxTiles)
+{
+    mTileStore.close();
+    if(path.empty())
+        return false;
+
+    std::string error;
+    if(!mTileStore.open(path, mGeneratorHash, TERRAIN_SIZE, maxTiles, error))
+    {
+        Log::get().stream(Log::Level_Error)<< "Failed to open terrain tile store: "<<error;
+        return false;
+    }
+    Log::get().stream()<< "Opened terrain tile store "<<path<<", "<<mTileStore.getNumTiles()<<" tiles";
+    return true;
+}
+
+bool TerrainStorage::storeChunk(int lodLevel, float size, const osg::Vec2f &center)
+{
+    if(mTileStore.contains(lodLevel, center))
+        return false;
+
+    std::vector<float> tileHeights(TERRAIN_SIZE*TERRAIN_SIZE);
+    std::vector<osg::Vec3f> tileNormals(TERRAIN_SIZE*TERRAIN_SIZE);
+    float geometricError = 0.0f;
+    generateChunk(size, center, Terrain::Align_XY, std::vector<Terrain::GeneratedChunk>(),
+                  &tileHeights[0], &tileNormals[0], (lodLevel > 0) ? &geometricError : nullptr);
+    mTileStore.write(lodLevel, center, &tileHeights[0], &tileNormals[0], geometricError);
+    return true;
+}
+
+void TerrainStorage::getStatus(std::ostream &status) const
+{
+    if(!mTileStore.isOpen())
+        return;
+    status<< "Tile store: "<<mTileStore.getNumTiles()<<" tiles, "
+          <<mTileStore.getNumHits()<<" hits, "<<mTileStore.getNumMisses()<<" misses" <<std::endl;
+}
+
+void TerrainStorage::benchmarkNoise(int samples)
+{
+    // Spread the samples over the whole map, a row at a time
+    float minX, maxX, minY, maxY;
+    getBounds(minX, maxX, minY, maxY);
+    const int width = 256;
+    const int rows = (samples+width-1) / width;
+    samples = rows * width;
+
+    std::vector<double> x(samples), y(samples, 0.0), z(samples);
+    for(int i = 0;i < samples;++i)
+    {
+        x[i] = minX + (maxX-minX) * ((i%width)+0.5) / width;
+        z[i] = minY + (maxY-minY) * ((i/width)+0.5) / rows;
+    }
+    std::vector<double> interpreted(samples), compiled(samples), batched(samples);
+
+    typedef std::chrono::steady_clock clock;
+    clock::time_point start = clock::now();
+    for(int i = 0;i < samples;++i)
+        interpreted[i] = mFinalTerrain.GetValue(x[i], y[i], z[i]);
+    clock::time_point interpEnd = clock::now();
+    for(int i = 0;i < samples;++i)
+        compiled[i] = mCompiledTerrain.GetValue(x[i], y[i], z[i]);
+    clock::time_point compiledEnd = clock::now();
+    noise::utils::GetValues(mFinalTerrain, &x[0], &y[0], &z[0], samples, &batched[0]);
+    clock::time_point batchedEnd = clock::now();
+
+    double compiledDiff = 0.0, batchedDiff = 0.0;
+    for(int i = 0;i < samples;++i)
+    {
+        compiledDiff = std::max(compiledDiff, std::abs(compiled[i] - interpreted[i]));
+        batchedDiff = std::max(batchedDiff, std::abs(batched[i] - interpreted[i]));
+    }
+
+    typedef std::chrono::duration<double,std::milli> msecs;
+    Log::get().stream()<< "Noise benchmark, "<<samples<<" samples ("<<mCompiledTerrain.GetInstructionCount()<<" instructions):";
+    Log::get().stream()<< "  interpreted: "<<msecs(interpEnd-start).count()<<"ms";
+    Log::get().stream()<< "  compiled:    "<<msecs(compiledEnd-interpEnd).count()<<"ms (max diff "<<compiledDiff<<")";
+    Log::get().stream()<< "  batched:     "<<msecs(batchedEnd-compiledEnd).count()<<"ms (max diff "<<batchedDiff<<", kernel "<<noise::utils::GetBatchKernel()<<")";
+}
+
+void TerrainStorage::getBounds(float& minX, float& maxX, float& minY, float& maxY)
+{
+    minX = -(int)mHeightmapModule.GetImage()->s()/2;
+    minY = -(int)mHeightmapModule.GetImage()->t()/2;
+    maxX =  mHeightmapModule.GetImage()->s()/2;
+    maxY =  mHeightmapModule.GetImage()->t()/2;
+}
+
+bool TerrainStorage::getMinMaxHeights(float size, const osg::Vec2f& center, float& min, float& max)
+{
+    if(!mHaveNoiseBounds)
+    {
+        min = -TERRAIN_WORLD_HEIGHT*2.0f;
+        max =  TERRAIN_WORLD_HEIGHT*2.0f;
+        return true;
+    }
+
+    double heightMin, heightMax;
+    mHeightmapModule.GetValueRange(center.x()-size/2.0, center.y()-size/2.0,
+                                   center.x()+size/2.0, center.y()+size/2.0,
+                                   heightMin, heightMax);
+    // Allow for rounding in the interpolation
+    heightMin -= 1e-6;
+    heightMax += 1e-6;
+
+    // The heightmap is also the selector's control, so only include the
+    // noise that can actually be selected here (both, at the edges).
+    const double lower = mCombinedTerrain.GetLowerBound();
+    const double upper = mCombinedTerrain.GetUpperBound();
+    const double falloff = mCombinedTerrain.GetEdgeFalloff();
+    double noiseMin = std::numeric_limits<double>::max();
+    double noiseMax = -std::numeric_limits<double>::max();
+    if(heightMin < lower+falloff || heightMax >= upper-falloff)
+    {
+        noiseMin = std::min(noiseMin, mSeaBounds[0]);
+        noiseMax = std::max(noiseMax, mSeaBounds[1]);
+    }
+    if(heightMax >= lower-falloff && heightMin < upper+falloff)
+    {
+        noiseMin = std::min(noiseMin, mFieldsBounds[0]);
+        noiseMax = std::max(noiseMax, mFieldsBounds[1]);
+    }
+
+    min = (heightMin + noiseMin) * TERRAIN_WORLD_HEIGHT;
+    max = (heightMax + noiseMax) * TERRAIN_WORLD_HEIGHT;
+    return true;
+}
+
+void TerrainStorage::fillVertexBuffers(int lodLevel, float size, const osg::Vec2f& center, Terrain::Alignment align,
+                                       const std::vector<Terrain::GeneratedChunk>& known,
+                                       std::vector<osg::Vec3f>& positions, std::vector<osg::Vec3f>& normals,
+                                       std::vector<osg::Vec4ub>& colours, float& geometricError)
+{
+    assert(size == 1<<lodLevel);
+
+    std::vector<float> tileHeights(TERRAIN_SIZE*TERRAIN_SIZE);
+    std::vector<osg::Vec3f> tileNormals(TERRAIN_SIZE*TERRAIN_SIZE);
+    if(!mTileStore.read(lodLevel, center, &tileHeights[0], &tileNormals[0], geometricError))
+    {
+        // Nothing is more detailed than LOD 0, so don't bother measuring it
+        geometricError = 0.0f;
+        generateChunk(size, center, align, known, &tileHeights[0], &tileNormals[0],
+                      (lodLevel > 0) ? &geometricError : nullptr);
+        mTileStore.write(lodLevel, center, &tileHeights[0], &tileNormals[0], geometricError);
+    }
+
+    positions.resize(TERRAIN_SIZE*TERRAIN_SIZE);
+    normals.resize(TERRAIN_SIZE*TERRAIN_SIZE);
+    colours.resize(TERRAIN_SIZE*TERRAIN_SIZE);
+
+    for(int px = 0;px < TERRAIN_SIZE;++px)
+    {
+        for(int py = 0;py < TERRAIN_SIZE;++py)
+        {
+            size_t idx = (px*TERRAIN_SIZE) + py;
+
+            positions[idx][0] = (px/float(TERRAIN_SIZE-1) - 0.5f) * size * TERRAIN_WORLD_SIZE;
+            positions[idx][1] = (py/float(TERRAIN_SIZE-1) - 0.5f) * size * TERRAIN_WORLD_SIZE;
+            positions[idx][2] = tileHeights[idx];
+            Terrain::convertPosition(align, positions[idx][0], positions[idx][1], positions[idx][2]);
+
+            normals[idx] = tileNormals[idx];
+            Terrain::convertPosition(align, normals[idx][0], normals[idx][1], normals[idx][2]);
+
+            colours[idx][0] = 255;
+            colours[idx][1] = 255;
+            colours[idx][2] = 255;
+            colours[idx][3] = 255;
+        }
+    }
+}
+
+void TerrainStorage::generateChunk(float size, const osg::Vec2f& center, Terrain::Alignment align,
+                                   const std::vector<Terrain::GeneratedChunk>& known,
+                                   float *tileHeights, osg::Vec3f *tileNormals, float *geometricError)
+{
+    // We need an extra rows and columns on the sides to calculate proper normals
+    const int mapSize = TERRAIN_SIZE+2;
+    // Node sizes and centers are powers of two, so all these are exact
+    const double cell_vtx = size / double(TERRAIN_SIZE-1);
+    const double originX = center.x() - size/2.0 - cell_vtx;
+    const double originY = center.y() - size/2.0 - cell_vtx;
+
+    // Heights in world units, and which we still need to generate
+    std::vector<float> heights(mapSize*mapSize);
+    std::vector<char> missing(mapSize*mapSize, 1);
+    copyKnownHeights(known, align, originX, originY, cell_vtx, mapSize, &heights[0], &missing[0]);
+
+    // To measure the error against the next more detailed level, we need the
+    // vertices it adds between ours: the edge midpoints and the cell centers
+    const int fineSize = 2*(TERRAIN_SIZE-1)+1;
+    const double fine_vtx = cell_vtx / 2.0;
+    const double fineX = center.x() - size/2.0;
+    const double fineY = center.y() - size/2.0;
+    std::vector<float> fineHeights;
+    std::vector<char> fineMissing;
+    if(geometricError)
+    {
+        fineHeights.resize(fineSize*fineSize);
+        fineMissing.resize(fineSize*fineSize, 0);
+        for(int y = 0;y < fineSize;++y)
+        {
+            for(int x = 0;x < fineSize;++x)
+                fineMissing[y*fineSize + x] = ((x|y) & 1);
+        }
+        copyKnownHeights(known, align, fineX, fineY, fine_vtx, fineSize, &fineHeights[0], &fineMissing[0]);
+    }
+
+    // Generate the rest in one batch
+    std::vector<double> xcoords, zcoords;
+    xcoords.reserve(mapSize*mapSize + fineHeights.size());
+    zcoords.reserve(mapSize*mapSize + fineHeights.size());
+    for(int y = 0;y < mapSize;++y)
+    {
+        for(int x = 0;x < mapSize;++x)
+        {
+            if(!missing[y*mapSize + x])
+                continue;
+            xcoords.push_back(originX + x*cell_vtx);
+            zcoords.push_back(originY + y*cell_vtx);
+        }
+    }
+    for(int y = 0;y < fineSize && geometricError;++y)
+    {
+        for(int x = 0;x < fineSize;++x)
+        {
+            if(!fineMissing[y*fineSize + x])
+                continue;
+            xcoords.push_back(fineX + x*fine_vtx);
+            zcoords.push_back(fineY + y*fine_vtx);
+        }
+    }
+    if(!xcoords.empty())
+    {
+        std::vector<double> ycoords(xcoords.size(), 0.0), values(xcoords.size());
+        noise::utils::GetValues(mCompiledTerrain, &xcoords[0], &ycoords[0], &zcoords[0],
+                                xcoords.size(), &values[0]);
+        size_t next = 0;
+        for(size_t i = 0;i < heights.size();++i)
+        {
+            if(missing[i])
+                heights[i] = float(values[next++]) * TERRAIN_WORLD_HEIGHT;
+        }
+        for(size_t i = 0;i < fineHeights.size();++i)
+        {
+            if(fineMissing[i])
+                fineHeights[i] = float(values[next++]) * TERRAIN_WORLD_HEIGHT;
+        }
+    }
+
+    if(geometricError)
+    {
+        // Compare the finer vertices to our triangles. Cells are split from
+        // their (x,y) to their (x+1,y+1) corner, see BufferCache.
+        auto coarse = [&](int x, int y) { return heights[(y+1)*mapSize + (x+1)]; };
+        float error = 0.0f;
+        for(int y = 0;y < fineSize;++y)
+        {
+            for(int x = (y & 1) ? 0 : 1;x < fineSize;x += (y & 1) ? 1 : 2)
+            {
+                const int cx = x/2, cy = y/2;
+                float interpolated;
+                if(!(y & 1))
+                    interpolated = (coarse(cx, cy) + coarse(cx+1, cy)) * 0.5f;
+                else if(!(x & 1))
+                    interpolated = (coarse(cx, cy) + coarse(cx, cy+1)) * 0.5f;
+                else
+                    interpolated = (coarse(cx, cy) + coarse(cx+1, cy+1)) * 0.5f;
+                error = std::max(error, std::abs(fineHeights[y*fineSize + x] - interpolated));
+            }
+        }
+        *geometricError = error;
+    }
+
+    // Heights are in world units, and the central differences span two vertices,
+    // so this is one over twice the vertex spacing
+    Terrain::computeNormals(&heights[0], TERRAIN_SIZE, TERRAIN_SIZE,
+                            (TERRAIN_SIZE-1) / (2.0f * TERRAIN_WORLD_SIZE * size), tileNormals);
+
+    for(int py = 0;py < TERRAIN_SIZE;++py)
+    {
+        const float *src = &heights[(py+1)*mapSize + 1];
+        for(int px = 0;px < TERRAIN_SIZE;++px)
+            tileHeights[(px*TERRAIN_SIZE) + py] = src[px];
+    }
+}
+
+void TerrainStorage::getBlendmaps(float size, const osg::Vec2f& center, bool pack,
+                                  std::vector<osg::ref_ptr<osg::Image>>& blendmaps,
+                                  std::vector<Terrain::LayerInfo>& layerList)
+{
+    layerList.push_back(Terrain::LayerInfo{"dirt_grayrocky_diffusespecular.dds","dirt_grayrocky_normalheight.dds", true, true});
+}
+
+void TerrainStorage::getBlendmaps(const std::vector<Terrain::QuadTreeNode*>& nodes, std::vector<Terrain::LayerCollection>& out, bool pack)
+{
+    for(Terrain::QuadTreeNode *node : nodes)
+    {
+        Terrain::LayerCollection layers;
+        layers.mTarget = node;
+
+        getBlendmaps(node->getSize(), node->getCenter(), pack, layers.mBlendmaps, layers.mLayers);
+
+        out.push_back(std::move(layers));
+    }
+}
+
+osg::Texture2D *TerrainStorage::getTextureImage(const std::string &name)
+{
+    static std::map<std::string,osg::ref_ptr<osg::Texture2D>> sTextureList;
+    auto iter = sTextureList.find(name);
+    if(iter != sTextureList.end())
+        return iter->second.get();
+
+    osg::ref_ptr<osg::Image> image = osgDB::readImageFile(name);
+    if(!image.valid()) return nullptr;
+
+    osg::ref_ptr<osg::Texture2D> tex = new osg::Texture2D(image.get());
+    tex->setUnRefImageDataAfterApply(true);
+    tex->setWrap(osg::Texture::WRAP_S, osg::Texture::REPEAT);
+    tex->setWrap(osg::Texture::WRAP_T, osg::Texture::REPEAT);
+    sTextureList.insert(std::make_pair(name, tex));
+    return tex.release();
+}
+
+float TerrainStorage::getHeightAt(const osg::Vec3f &worldPos)
+{
+    float val = mCompiledTerrain.GetValue(worldPos.x() / TERRAIN_WORLD_SIZE, 0.0f, worldPos.z() / -TERRAIN_WORLD_SIZE);
+    return val * TERRAIN_WORLD_HEIGHT;
+}
+
+void TerrainStorage::getHeightsAt(const osg::Vec3f *worldPos, size_t count, float *heights)
+{
+    if(count == 0)
+        return;
+
+    std::vector<double> x(count), y(count, 0.0), z(count), values(count);
+    for(size_t i = 0;i < count;++i)
+    {
+        x[i] = worldPos[i].x() / TERRAIN_WORLD_SIZE;
+        z[i] = worldPos[i].z() / -TERRAIN_WORLD_SIZE;
+    }
+    noise::utils::GetValues(mCompiledTerrain, &x[0], &y[0], &z[0], count, &values[0]);
+    for(size_t i = 0;i < count;++i)
+        heights[i] = float(values[i]) * TERRAIN_WORLD_HEIGHT;
+}
+
+} // namespace TK
@@ -0,0 +1,329 @@
+#ifndef TERRAINSTORAGE_HPP
+#define TERRAINSTORAGE_HPP
+
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+
+#include <osg/Image>
+
+#include <libnoise/noise.h>
+
+#include "noiseutils/noisebatch.h"
+#include "noiseutils/noisecompiler.h"
+
+#include "terrain/storage.hpp"
+#include "terrain/tilestore.hpp"
+
+
+namespace TK
+{
+
+
+// This custom module allows us to provide image data as a source for other
+// libnoise modules (such as selectors).
+class ImageSrcModule : public noise::module::Module, public noise::utils::BatchModule
+{
+protected:
+    osg::ref_ptr<osg::Image> mImage;
+    double mFrequency;
+
+    // Min/max red values of each 2^n x 2^n block of pixels, for each level n
+    std::vector<std::vector<std::pair<float,float>>> mRangePyramid;
+
+    void buildRangePyramid()
+    {
+        mRangePyramid.clear();
+        if(!mImage.valid())
+            return;
+
+        size_t width = mImage->s();
+        size_t height = mImage->t();
+        std::vector<std::pair<float,float>> level(width*height);
+        for(size_t y = 0;y < height;++y)
+        {
+            for(size_t x = 0;x < width;++x)
+            {
+                float r = mImage->getColor(x, y).r();
+                level[y*width + x] = std::make_pair(r, r);
+            }
+        }
+        mRangePyramid.push_back(std::move(level));
+
+        while(width > 1 || height > 1)
+        {
+            const std::vector<std::pair<float,float>> &prev = mRangePyramid.back();
+            size_t newWidth = (width+1) / 2;
+            size_t newHeight = (height+1) / 2;
+            std::vector<std::pair<float,float>> next(newWidth*newHeight);
+            for(size_t y = 0;y < newHeight;++y)
+            {
+                for(size_t x = 0;x < newWidth;++x)
+                {
+                    std::pair<float,float> range = prev[(y*2)*width + x*2];
+                    for(size_t i = 0;i < 4;++i)
+                    {
+                        size_t px = std::min(x*2 + (i&1), width-1);
+                        size_t py = std::min(y*2 + (i>>1), height-1);
+                        const std::pair<float,float> &r = prev[py*width + px];
+                        range.first = std::min(range.first, r.first);
+                        range.second = std::max(range.second, r.second);
+                    }
+                    next[y*newWidth + x] = range;
+                }
+            }
+            mRangePyramid.push_back(std::move(next));
+            width = newWidth;
+            height = newHeight;
+        }
+    }
+
+public:
+    ImageSrcModule()
+      : noise::module::Module(0), mFrequency(1.0)
+    { }
+    virtual ~ImageSrcModule() { }
+
+    // Sets the source Image object.
+    void SetImage(osg::Image *image)
+    {
+        mImage = image;
+        buildRangePyramid();
+    }
+
+    // Retrieves the source Image object. Set it again after modifying it.
+    osg::Image *GetImage() { return mImage.get(); }
+
+    // Retrieves the source Image object.
+    const osg::Image *GetImage() const { return mImage.get(); }
+
+    // Sets the number of samples per unit (default=1). Higher values
+    // effectively shrink the image.
+    void SetFrequency(double freq)
+    {
+        if(!(freq > 0.0 && freq < std::numeric_limits<double>::max()))
+            throw std::runtime_error("Invalid ImageSrcModule frequency");
+        mFrequency = freq;
+    }
+
+    double GetFrequency() const { return mFrequency; }
+
+    // No source modules
+    virtual int GetSourceModuleCount() const { return 0; }
+
+    // Retrieves the range of output values within the given area. The range
+    // may be slightly larger than the actual values, but never smaller.
+    void GetValueRange(double x0, double z0, double x1, double z1, double &min, double &max) const
+    {
+        const size_t width = mImage->s();
+        const size_t height = mImage->t();
+
+        x0 = std::min<double>(std::max(x0*mFrequency + width/2.0, 0.0), width-1);
+        x1 = std::min<double>(std::max(x1*mFrequency + width/2.0, 0.0), width-1);
+        z0 = std::min<double>(std::max(z0*mFrequency + height/2.0, 0.0), height-1);
+        z1 = std::min<double>(std::max(z1*mFrequency + height/2.0, 0.0), height-1);
+
+        // Include the next pixel over, which may be interpolated with
+        size_t sx0 = size_t(x0), sx1 = std::min(size_t(x1)+1, width-1);
+        size_t sy0 = size_t(z0), sy1 = std::min(size_t(z1)+1, height-1);
+
+        // Find the first level where the area covers no more than 2x2 blocks
+        size_t level = 0;
+        while(level+1 < mRangePyramid.size() &&
+              (size_t(1)<<level) < std::max(sx1-sx0+1, sy1-sy0+1))
+            ++level;
+        const std::vector<std::pair<float,float>> &blocks = mRangePyramid[level];
+        const size_t levelWidth = (width + (size_t(1)<<level) - 1) >> level;
+
+        float lo = std::numeric_limits<float>::max();
+        float hi = -std::numeric_limits<float>::max();
+        for(size_t y = sy0>>level;y <= sy1>>level;++y)
+        {
+            for(size_t x = sx0>>level;x <= sx1>>level;++x)
+            {
+                lo = std::min(lo, blocks[y*levelWidth + x].first);
+                hi = std::max(hi, blocks[y*levelWidth + x].second);
+            }
+        }
+        // The components are normalized to 0...1, while libnoise expects -1...+1.
+        min = lo*2.0 - 1.0;
+        max = hi*2.0 - 1.0;
+    }
+
+    virtual double GetValue(double x, double /*y*/, double z) const
+    {
+        const size_t width = mImage->s();
+        const size_t height = mImage->t();
+
+        // NOTE: X is west/east and Z is north/south (Y is up/down, but we
+        // don't bother with depth)
+        x *= mFrequency;
+        z *= mFrequency;
+
+        // Offset the image so 0 is the center
+        x += width/2.0;
+        z += height/2.0;
+
+        x = std::min<double>(std::max(x, 0.0), width-1);
+        z = std::min<double>(std::max(z, 0.0), height-1);
+
+        size_t sx = size_t(x);
+        size_t sy = size_t(z);
+
+        // The components are normalized to 0...1, while libnoise expects -1...+1.
+        osg::Vec4 clr = mImage->getColor(sx, sy);
+        return clr.r()*2.0 - 1.0;
+    }
+
+    virtual void GetValues(const double *x, const double *y, const double *z, int count, double *out) const
+    {
+        for(int i = 0;i < count;++i)
+            out[i] = ImageSrcModule::GetValue(x[i], y[i], z[i]);
+    }
+};
+
+// Same as above, except applies linear interpolation to the calculated height.
+class ImageInterpSrcModule : public ImageSrcModule
+{
+public:
+    ImageInterpSrcModule() { }
+
+    virtual double GetValue(double x, double /*y*/, double z) const
+    {
+        size_t width = mImage->s();
+        size_t height = mImage->t();
+
+        x = x*mFrequency + width/2.0;
+        z = z*mFrequency + height/2.0;
+
+        x = std::min<double>(std::max(x, 0.0), width-1);
+        z = std::min<double>(std::max(z, 0.0), height-1);
+
+        size_t sx = size_t(x);
+        size_t sy = size_t(z);
+
+        x = x - sx;
+        z = z - sy;
+
+        float b00 = (1.0-x) * (1.0-z);
+        float b01 = (    x) * (1.0-z);
+        float b10 = (1.0-x) * (    z);
+        float b11 = (    x) * (    z);
+
+        // Bilinear interpolate using the four nearest colors
+        osg::Vec4 clr00 = mImage->getColor(sx, sy);
+        osg::Vec4 clr01 = mImage->getColor(std::min(sx+1, width-1), sy);
+        osg::Vec4 clr10 = mImage->getColor(sx, std::min(sy+1,height-1));
+        osg::Vec4 clr11 = mImage->getColor(std::min(sx+1, width-1), std::min(sy+1,height-1));
+        // The components are normalized to 0...1, while libnoise expects -1...+1.
+        return (clr00.r()*b00 + clr01.r()*b01 + clr10.r()*b10 + clr11.r()*b11)*2.0 - 1.0;
+    }
+
+    virtual void GetValues(const double *x, const double *y, const double *z, int count, double *out) const
+    {
+        for(int i = 0;i < count;++i)
+            out[i] = ImageInterpSrcModule::GetValue(x[i], y[i], z[i]);
+    }
+};
+
+
+/* World size/height is just a placeholder for now. */
+#define TERRAIN_WORLD_SIZE 2048.0f
+#define TERRAIN_WORLD_HEIGHT 2400.0f
+#define TERRAIN_SIZE 65
+/* Largest chunk size, in cells, the quad tree may load. */
+#define TERRAIN_MAX_BATCH_SIZE 65536
+/* Bump when changing how chunks are generated, to invalidate stored tiles. */
+#define TERRAIN_GENERATOR_VERSION 3
+/* Maximum number of chunks kept in the tile store. */
+#define TERRAIN_TILESTORE_MAX_TILES 16384
+
+class TerrainStorage : public Terrain::Storage
+{
+    ImageInterpSrcModule mHeightmapModule;
+
+    noise::module::Perlin mBaseFieldsTerrain;
+    noise::module::ScaleBias mFieldsTerrain;
+    noise::module::Billow mBaseSeaTerrain;
+    noise::module::ScaleBias mSeaTerrain;
+    noise::module::Select mCombinedTerrain;
+
+    noise::module::Add mFinalTerrain;
+
+    // mFinalTerrain flattened for faster single-point lookups
+    noise::utils::CompiledModule mCompiledTerrain;
+
+    // Output ranges of the noise added on top of the heightmap
+    bool mHaveNoiseBounds;
+    double mSeaBounds[2];
+    double mFieldsBounds[2];
+
+    // Identifies the heightmap and noise parameters, for the tile store
+    uint64_t mGeneratorHash;
+    Terrain::TileStore mTileStore;
+
+    // Generate a chunk's heights and normals, before conversion to the
+    // requested alignment, in fillVertexBuffers' vertex order. If given,
+    // geometricError receives the chunk's error against the next more
+    // detailed level, which takes about three times the samples.
+    void generateChunk(float size, const osg::Vec2f &center, Terrain::Alignment align,
+                       const std::vector<Terrain::GeneratedChunk> &known,
+                       float *heights, osg::Vec3f *normals, float *geometricError);
+
+public:
+    TerrainStorage();
+
+    // Open (or create) the persistent store of generated chunks at the
+    // given path, replacing it if it was made from different data. The
+    // tile limit only applies when a new file is created.
+    bool openTileStore(const std::string &path, unsigned int maxTiles=TERRAIN_TILESTORE_MAX_TILES);
+
+    const Terrain::TileStore &getTileStore() const { return mTileStore; }
+
+    // Identifies the heightmap and noise parameters the terrain is generated from
+    uint64_t getGeneratorHash() const { return mGeneratorHash; }
+
+    // Generate a chunk into the tile store, if it isn't already there.
+    // Returns false if it was already stored. Thread-safe.
+    bool storeChunk(int lodLevel, float size, const osg::Vec2f &center);
+
+    void getStatus(std::ostream &status) const;
+
+    // Times the interpreted, compiled and batched noise graph on the given
+    // number of samples and logs the results.
+    void benchmarkNoise(int samples);
+
+    virtual void getBounds(float& minX, float& maxX, float& minY, float& maxY);
+
+    virtual bool getMinMaxHeights(float size, const osg::Vec2f &center, float& min, float& max);
+
+    virtual void fillVertexBuffers(int lodLevel, float size, const osg::Vec2f &center, Terrain::Alignment align,
+                                   const std::vector<Terrain::GeneratedChunk> &known,
+                                   std::vector<osg::Vec3f> &positions, std::vector<osg::Vec3f> &normals,
+                                   std::vector<osg::Vec4ub> &colours, float &geometricError);
+
+    virtual void getBlendmaps(float chunkSize, const osg::Vec2f &chunkCenter, bool pack,
+                              std::vector<osg::ref_ptr<osg::Image>> &blendmaps,
+                              std::vector<Terrain::LayerInfo> &layerList);
+
+    virtual void getBlendmaps(const std::vector<Terrain::QuadTreeNode*> &nodes, std::vector<Terrain::LayerCollection> &out, bool pack);
+
+    virtual osg::Texture2D *getTextureImage(const std::string &name);
+
+    virtual float getHeightAt(const osg::Vec3f &worldPos);
+
+    virtual void getHeightsAt(const osg::Vec3f *worldPos, size_t count, float *heights);
+
+    virtual Terrain::LayerInfo getDefaultLayer()
+    {
+        return Terrain::LayerInfo{"dirt_grayrocky_diffusespecular.dds", "dirt_grayrocky_normalheight.dds", false, false};
+    }
+
+    virtual float getCellWorldSize() { return TERRAIN_WORLD_SIZE; }
+
+    virtual int getCellVertices() { return TERRAIN_SIZE; }
+};
+
+} // namespace TK
+
+#endif /* TERRAINSTORAGE_HPP */
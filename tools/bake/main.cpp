@@ -0,0 +1,247 @@
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <osgDB/Registry>
+
+#include "terrain/workqueue.hpp"
+
+#include "terrainstorage.hpp"
+#include "log.hpp"
+
+
+namespace
+{
+
+struct Chunk
+{
+    int mLodLevel;
+    int mSize;
+    osg::Vec2f mCenter;
+};
+
+class ChunkRequest : public Terrain::WorkQueue::Request
+{
+public:
+    ChunkRequest(const Chunk &chunk, const Terrain::WorkQueue::CancelToken &token)
+      : Request(0, token, -float(chunk.mLodLevel)), mChunk(chunk), mBaked(false)
+    { }
+
+    Chunk mChunk;
+    bool mBaked;
+};
+
+class BakeHandler : public Terrain::WorkQueue::Handler
+{
+    TK::TerrainStorage &mStorage;
+
+public:
+    size_t mBaked;
+    size_t mFailed;
+
+    BakeHandler(TK::TerrainStorage &storage) : mStorage(storage), mBaked(0), mFailed(0) { }
+
+    virtual void handleRequest(Terrain::WorkQueue::Request *req)
+    {
+        ChunkRequest *chunkreq = static_cast<ChunkRequest*>(req);
+        const Chunk &chunk = chunkreq->mChunk;
+        chunkreq->mBaked = mStorage.storeChunk(chunk.mLodLevel, chunk.mSize, chunk.mCenter);
+    }
+
+    virtual void handleResponse(Terrain::WorkQueue::Request *req)
+    {
+        if(!req->succeeded())
+            ++mFailed;
+        else if(static_cast<ChunkRequest*>(req)->mBaked)
+            ++mBaked;
+    }
+};
+
+
+// Collect every chunk DefaultWorld may load, walking the quad tree the same
+// way QuadTreeNode::update splits it for any camera position.
+void collectChunks(TK::TerrainStorage &storage, int size, const osg::Vec2f &center, int minLodLevel,
+                   float minX, float maxX, float minY, float maxY, std::vector<Chunk> &chunks)
+{
+    int lodLevel = 0;
+    while((1<<lodLevel) < size)
+        ++lodLevel;
+
+    // Outside of the actual terrain, where the root was rounded up to a power of two.
+    // QuadTreeNode::buildChildren makes these dummies, which never load a chunk.
+    float halfSize = size/2.f;
+    if(center.x() - halfSize > maxX || center.x() + halfSize < minX ||
+       center.y() - halfSize > maxY || center.y() + halfSize < minY)
+        return;
+
+    float minZ, maxZ;
+    if(size <= TERRAIN_MAX_BATCH_SIZE && storage.getMinMaxHeights(size, center, minZ, maxZ))
+        chunks.push_back(Chunk{lodLevel, size, center});
+
+    if(size <= 1 || lodLevel <= minLodLevel)
+        return;
+
+    int childSize = size>>1;
+    collectChunks(storage, childSize, center + osg::Vec2f(-halfSize/2.f, -halfSize/2.f), minLodLevel, minX, maxX, minY, maxY, chunks);
+    collectChunks(storage, childSize, center + osg::Vec2f( halfSize/2.f, -halfSize/2.f), minLodLevel, minX, maxX, minY, maxY, chunks);
+    collectChunks(storage, childSize, center + osg::Vec2f(-halfSize/2.f,  halfSize/2.f), minLodLevel, minX, maxX, minY, maxY, chunks);
+    collectChunks(storage, childSize, center + osg::Vec2f( halfSize/2.f,  halfSize/2.f), minLodLevel, minX, maxX, minY, maxY, chunks);
+}
+
+int parseInt(const char *opt, const char *value)
+{
+    std::stringstream sstr(value ? value : "");
+    int ret;
+    if(!(sstr >> ret) || ret < 0)
+    {
+        std::stringstream str;
+        str<< "Invalid value for "<<opt<<": "<<(value ? value : "(none)");
+        throw std::runtime_error(str.str());
+    }
+    return ret;
+}
+
+void printUsage(const char *name)
+{
+    std::cout<< "Usage: "<<name<<" [options]" <<std::endl
+             << "Generates every terrain chunk into a tile store, so the game doesn't have to." <<std::endl
+             << "An interrupted bake continues where it left off when run again." <<std::endl
+             << std::endl
+             << "  --data <dir>     Add a data directory to search for the heightmap" <<std::endl
+             << "  --out <file>     Tile store to write (default: terrain-tiles.bin)" <<std::endl
+             << "  --threads <n>    Number of worker threads (default: all cores)" <<std::endl
+             << "  --min-lod <n>    Smallest LOD level to bake (default: 0)" <<std::endl;
+}
+
+}
+
+
+int main(int argc, char *argv[])
+{
+    try {
+        TK::Log log(TK::Log::Level_Normal, "twokinds-bake.log");
+
+        std::string outname = "terrain-tiles.bin";
+        int numThreads = 0;
+        int minLodLevel = 0;
+        osgDB::FilePathList dbpaths;
+        for(int i = 1;i < argc;i++)
+        {
+            std::string opt = argv[i];
+            const char *value = (i+1 < argc) ? argv[i+1] : nullptr;
+            if(opt == "--help" || opt == "-h")
+            {
+                printUsage(argv[0]);
+                return 0;
+            }
+            else if(opt == "--data" && value)
+                dbpaths.push_back(argv[++i]);
+            else if(opt == "--out" && value)
+                outname = argv[++i];
+            else if(opt == "--threads")
+            {
+                numThreads = parseInt(argv[i], value);
+                ++i;
+            }
+            else if(opt == "--min-lod")
+            {
+                minLodLevel = parseInt(argv[i], value);
+                ++i;
+            }
+            else
+            {
+                std::stringstream str;
+                str<< "Unrecognized option: "<<argv[i];
+                throw std::runtime_error(str.str());
+            }
+        }
+#ifdef TWOKINDS_DATA_ROOT
+        dbpaths.push_back(TWOKINDS_DATA_ROOT);
+#endif
+        osgDB::Registry::instance()->setDataFilePathList(dbpaths);
+
+        TK::TerrainStorage storage;
+
+        // Same root node as DefaultWorld
+        float minX, maxX, minY, maxY;
+        storage.getBounds(minX, maxX, minY, maxY);
+        int origSizeX = maxX-minX;
+        int origSizeY = maxY-minY;
+        int size = 1;
+        while(size < std::max(origSizeX, origSizeY))
+            size <<= 1;
+        osg::Vec2f center((minX+maxX)/2.f + (size-origSizeX)/2.f,
+                          (minY+maxY)/2.f + (size-origSizeY)/2.f);
+
+        std::vector<Chunk> chunks;
+        collectChunks(storage, size, center, minLodLevel, minX, maxX, minY, maxY, chunks);
+
+        if(!storage.openTileStore(outname, chunks.size()))
+            return 1;
+        const Terrain::TileStore &store = storage.getTileStore();
+        if(store.getMaxTiles() < chunks.size())
+        {
+            TK::Log::get().stream(TK::Log::Level_Error)<< outname<<" can hold "<<store.getMaxTiles()<<
+                " tiles, but "<<chunks.size()<<" are needed. Remove it, or bake to another file.";
+            return 1;
+        }
+
+        // Resume by skipping whatever a previous run already stored
+        std::vector<Chunk> pending;
+        for(const Chunk &chunk : chunks)
+        {
+            if(!store.contains(chunk.mLodLevel, chunk.mCenter))
+                pending.push_back(chunk);
+        }
+        TK::Log::get().stream()<< chunks.size()<<" chunks, "<<(chunks.size()-pending.size())<<
+            " already stored, "<<pending.size()<<" to bake";
+
+        if(numThreads == 0)
+            numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+
+        BakeHandler handler(storage);
+        Terrain::WorkQueue queue(&handler, numThreads);
+        Terrain::WorkQueue::CancelToken token;
+        for(const Chunk &chunk : pending)
+            queue.addRequest(new ChunkRequest(chunk, token));
+
+        typedef std::chrono::steady_clock clock;
+        const clock::time_point start = clock::now();
+        clock::time_point lastReport = start;
+        while(queue.getNumOutstanding() > 0)
+        {
+            queue.waitResponses();
+
+            clock::time_point now = clock::now();
+            if(now - lastReport >= std::chrono::seconds(5) || queue.getNumOutstanding() == 0)
+            {
+                double secs = std::chrono::duration<double>(now - start).count();
+                TK::Log::get().stream()<< "  "<<handler.mBaked<<"/"<<pending.size()<<" chunks, "<<
+                    (secs > 0.0 ? handler.mBaked/secs : 0.0)<<" tiles/sec";
+                lastReport = now;
+            }
+        }
+
+        double secs = std::chrono::duration<double>(clock::now() - start).count();
+        TK::Log::get().stream()<< "Baked "<<handler.mBaked<<" chunks in "<<secs<<"s on "<<numThreads<<
+            " threads ("<<(secs > 0.0 ? handler.mBaked/secs : 0.0)<<" tiles/sec), "<<
+            store.getNumTiles()<<" in "<<outname;
+        if(handler.mFailed > 0)
+        {
+            TK::Log::get().stream(TK::Log::Level_Error)<< handler.mFailed<<" chunks failed";
+            return 1;
+        }
+    }
+    catch(std::exception &e) {
+        std::cerr<< "*** An exception has occured! ***" <<std::endl
+                 << e.what() <<std::endl;
+        return 1;
+    }
+
+    return 0;
+}
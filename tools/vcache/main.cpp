@@ -0,0 +1,165 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include <string>
+
+#include <osg/PrimitiveSet>
+
+#include "terrain/buffercache.hpp"
+#include "terrain/vertexcache.hpp"
+
+
+namespace
+{
+
+struct Totals
+{
+    double mACMR;
+    double mATVR;
+    size_t mCount;
+
+    Totals() : mACMR(0.0), mATVR(0.0), mCount(0) { }
+
+    void add(const Terrain::VertexCacheStats &stats)
+    {
+        mACMR += stats.mACMR;
+        mATVR += stats.mATVR;
+        ++mCount;
+    }
+};
+
+void appendIndices(const osg::PrimitiveSet *prim, std::vector<unsigned int> &indices)
+{
+    if(!prim)
+        return;
+    for(unsigned int i = 0;i < prim->getNumIndices();++i)
+        indices.push_back(prim->index(i));
+}
+
+Terrain::VertexCacheStats getStats(const Terrain::BufferCache::Primitives &prims, unsigned int verts,
+                                   unsigned int cacheSize)
+{
+    // Measured as if both ranges went through the cache in one go
+    std::vector<unsigned int> indices;
+    appendIndices(prims.mInterior.get(), indices);
+    appendIndices(prims.mEdges.get(), indices);
+    return Terrain::getVertexCacheStats(indices.data(), indices.size(), verts*verts, cacheSize);
+}
+
+// Full grid, and the average over every stitched permutation
+void measure(const Terrain::BufferCache &cache, unsigned int verts, unsigned int cacheSize,
+             Terrain::VertexCacheStats &grid, Totals &stitched)
+{
+    grid = getStats(cache.getPrimitives(0), verts, cacheSize);
+
+    const unsigned int maxDelta = cache.getMaxLodDelta();
+    for(unsigned int flags = 1;flags < 0x10000;++flags)
+    {
+        bool valid = true;
+        for(int i = 0;i < 4;++i)
+            valid = valid && ((flags >> (4*i)) & 0xf) <= maxDelta;
+        if(valid)
+            stitched.add(getStats(cache.getPrimitives(flags), verts, cacheSize));
+    }
+}
+
+unsigned int parseUInt(const char *opt, const char *value)
+{
+    std::stringstream sstr(value ? value : "");
+    int ret;
+    if(!(sstr >> ret) || ret <= 0)
+    {
+        std::stringstream str;
+        str<< "Invalid value for "<<opt<<": "<<(value ? value : "(none)");
+        throw std::runtime_error(str.str());
+    }
+    return ret;
+}
+
+void printUsage(const char *name)
+{
+    std::cout<< "Usage: "<<name<<" [options]" <<std::endl
+             << "Reports post-transform vertex cache efficiency of the terrain index buffers," <<std::endl
+             << "in their original order and after optimizing it." <<std::endl
+             << std::endl
+             << "  --verts <n>      Vertices along a chunk side (default: 65)" <<std::endl
+             << "  --cache <n>      Simulated FIFO cache size; may be given several times" <<std::endl
+             << "                   (default: 16 and 32)" <<std::endl;
+}
+
+}
+
+
+int main(int argc, char *argv[])
+{
+    try {
+        unsigned int verts = 65;
+        std::vector<unsigned int> cacheSizes;
+        for(int i = 1;i < argc;i++)
+        {
+            std::string opt = argv[i];
+            const char *value = (i+1 < argc) ? argv[i+1] : nullptr;
+            if(opt == "--help" || opt == "-h")
+            {
+                printUsage(argv[0]);
+                return 0;
+            }
+            else if(opt == "--verts")
+            {
+                verts = parseUInt(argv[i], value);
+                ++i;
+            }
+            else if(opt == "--cache")
+            {
+                cacheSizes.push_back(parseUInt(argv[i], value));
+                ++i;
+            }
+            else
+            {
+                std::stringstream str;
+                str<< "Unrecognized option: "<<argv[i];
+                throw std::runtime_error(str.str());
+            }
+        }
+        if(verts < 3)
+            throw std::runtime_error("Need at least 3 vertices along a side");
+        if(cacheSizes.empty())
+        {
+            cacheSizes.push_back(16);
+            cacheSizes.push_back(32);
+        }
+
+        Terrain::BufferCache original(verts, false);
+        Terrain::BufferCache optimized(verts, true);
+
+        std::cout<< verts<<"x"<<verts<<" vertices, "<<
+            (original.getMaxLodDelta()+1)*(original.getMaxLodDelta()+1)*
+            (original.getMaxLodDelta()+1)*(original.getMaxLodDelta()+1)<<" stitching permutations" <<std::endl;
+        std::cout<< std::fixed<<std::setprecision(3);
+        for(unsigned int cacheSize : cacheSizes)
+        {
+            Terrain::VertexCacheStats gridBefore, gridAfter;
+            Totals stitchedBefore, stitchedAfter;
+            measure(original, verts, cacheSize, gridBefore, stitchedBefore);
+            measure(optimized, verts, cacheSize, gridAfter, stitchedAfter);
+
+            std::cout<< std::endl<<"FIFO cache of "<<cacheSize<<" vertices:" <<std::endl;
+            std::cout<< "                      ACMR before  after     ATVR before  after" <<std::endl;
+            std::cout<< "  full grid           "<<std::setw(11)<<gridBefore.mACMR<<std::setw(7)<<gridAfter.mACMR<<
+                "     "<<std::setw(11)<<gridBefore.mATVR<<std::setw(7)<<gridAfter.mATVR <<std::endl;
+            std::cout<< "  stitched (average)  "<<std::setw(11)<<stitchedBefore.mACMR/stitchedBefore.mCount<<
+                std::setw(7)<<stitchedAfter.mACMR/stitchedAfter.mCount<<
+                "     "<<std::setw(11)<<stitchedBefore.mATVR/stitchedBefore.mCount<<
+                std::setw(7)<<stitchedAfter.mATVR/stitchedAfter.mCount <<std::endl;
+        }
+    }
+    catch(std::exception &e) {
+        std::cerr<< "*** An exception has occured! ***" <<std::endl
+                 << e.what() <<std::endl;
+        return 1;
+    }
+
+    return 0;
+}